@@ -0,0 +1,91 @@
+#ifndef __MYOS__COMMON__CPU_H
+#define __MYOS__COMMON__CPU_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    namespace common
+    {
+        inline uint64_t ReadTimestampCounter()
+        {
+            uint32_t low, high;
+            __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
+            return ((uint64_t)high << 32) | low;
+        }
+
+        // 64 by 32 bit division with divl, since there is no libgcc to
+        // provide __udivdi3. Saturates when the quotient does not fit.
+        inline uint32_t DivideU64(uint64_t dividend, uint32_t divisor)
+        {
+            uint32_t low = (uint32_t)dividend;
+            uint32_t high = (uint32_t)(dividend >> 32);
+            if (high >= divisor)
+                return 0xFFFFFFFF;
+
+            uint32_t quotient, remainder;
+            __asm__("divl %4" : "=a" (quotient), "=d" (remainder) : "a" (low), "d" (high), "rm" (divisor));
+            return quotient;
+        }
+
+        // (value * factor) >> shift without losing the top bits of the
+        // product, for fixed-point conversions of cycle counts. shift must
+        // be between 1 and 32.
+        inline uint64_t ScaleU64(uint64_t value, uint32_t factor, uint32_t shift)
+        {
+            uint64_t low = (uint64_t)(uint32_t)value * factor;
+            uint64_t high = (uint64_t)(uint32_t)(value >> 32) * factor;
+            return (high << (32 - shift)) + (low >> shift);
+        }
+
+        // Feature flags from CPUID leaf 1
+        static const uint32_t CPUID_EDX_PSE = 1 << 3;
+        static const uint32_t CPUID_EDX_SEP = 1 << 11;
+        static const uint32_t CPUID_EDX_PGE = 1 << 13;
+
+        inline uint32_t CPUFeatures()
+        {
+            uint32_t eax, ebx, ecx, edx;
+            __asm__ volatile("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1));
+            return edx;
+        }
+
+        // Family, model and stepping from CPUID leaf 1
+        inline uint32_t CPUSignature()
+        {
+            uint32_t eax, ebx, ecx, edx;
+            __asm__ volatile("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1));
+            return eax;
+        }
+
+        // For short sections that interrupts must not split. Returns the
+        // flags to hand to RestoreInterrupts.
+        inline uint32_t DisableInterrupts()
+        {
+            uint32_t flags;
+            __asm__ volatile("pushfl; popl %0; cli" : "=r" (flags) : : "memory");
+            return flags;
+        }
+
+        inline void RestoreInterrupts(uint32_t flags)
+        {
+            if (flags & 0x200)
+                __asm__ volatile("sti" : : : "memory");
+        }
+
+        // Ring the code is running in, from the low bits of cs
+        inline uint32_t CurrentPrivilegeLevel()
+        {
+            uint32_t cs;
+            __asm__ volatile("mov %%cs, %0" : "=r" (cs));
+            return cs & 3;
+        }
+
+        inline void WriteModelSpecificRegister(uint32_t msr, uint64_t value)
+        {
+            __asm__ volatile("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+        }
+    }
+}
+
+#endif
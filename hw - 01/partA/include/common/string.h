@@ -0,0 +1,55 @@
+#ifndef __MYOS__COMMON__STRING_H
+#define __MYOS__COMMON__STRING_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    namespace common
+    {
+        // There is no libc, these are the few helpers the kernel needs.
+        // Whole words are moved with rep movsl, the rest byte by byte.
+
+        inline void* memcpy(void* destination, const void* source, size_t size)
+        {
+            void* d = destination;
+            const void* s = source;
+            size_t words = size / 4;
+            size_t bytes = size % 4;
+            __asm__ volatile("cld; rep movsl; mov %3, %%ecx; rep movsb"
+                : "+D" (d), "+S" (s), "+c" (words) : "r" (bytes) : "memory");
+            return destination;
+        }
+
+        // Copes with overlapping ranges, copying backwards when the
+        // destination lies above the source
+        inline void* memmove(void* destination, const void* source, size_t size)
+        {
+            if (destination <= source || (uint8_t*)destination >= (const uint8_t*)source + size)
+                return memcpy(destination, source, size);
+
+            void* d = (uint8_t*)destination + size - 1;
+            const void* s = (const uint8_t*)source + size - 1;
+            __asm__ volatile("std; rep movsb; cld"
+                : "+D" (d), "+S" (s), "+c" (size) : : "memory");
+            return destination;
+        }
+
+        inline void* memset(void* destination, uint8_t value, size_t size)
+        {
+            void* d = destination;
+            __asm__ volatile("cld; rep stosb" : "+D" (d), "+c" (size) : "a" (value) : "memory");
+            return destination;
+        }
+
+        inline size_t strlen(const char* text)
+        {
+            size_t length = 0;
+            while (text[length] != '\0')
+                length++;
+            return length;
+        }
+    }
+}
+
+#endif
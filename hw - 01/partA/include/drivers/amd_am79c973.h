@@ -52,13 +52,11 @@ namespace myos
             
             
             BufferDescriptor* sendBufferDescr;
-            common::uint8_t sendBufferDescrMemory[2048+15];
-            common::uint8_t sendBuffers[2*1024+15][8];
+            common::uint8_t* sendBuffers; // 8 buffers of 2 KiB from page frames
             common::uint8_t currentSendBuffer;
             
             BufferDescriptor* recvBufferDescr;
-            common::uint8_t recvBufferDescrMemory[2048+15];
-            common::uint8_t recvBuffers[2*1024+15][8];
+            common::uint8_t* recvBuffers; // 8 buffers of 2 KiB from page frames
             common::uint8_t currentRecvBuffer;
             
             
@@ -5,6 +5,7 @@
 #include <common/types.h>
 #include <hardwarecommunication/interrupts.h>
 #include <hardwarecommunication/port.h>
+#include <drivers/busmasteride.h>
 
 namespace myos
 {
@@ -24,15 +25,74 @@ namespace myos
             hardwarecommunication::Port8Bit devicePort;
             hardwarecommunication::Port8Bit commandPort;
             hardwarecommunication::Port8Bit controlPort;
+
+            // What Identify found out about the drive
+            bool present;
+            bool lba48;               // takes the EXT commands with 48-bit addresses
+            bool dmaCapable;
+            common::uint64_t sectors; // addressable sectors, 0 until identified
+            char model[41];
+
+            // Sectors moved per data request: what SET MULTIPLE MODE
+            // accepted, or 1 when READ/WRITE MULTIPLE are not used
+            common::uint8_t sectorsPerBlock;
+
+            // Channel DMA engine, when transfers should go through it
+            BusMasterIDE* dma;
+
+            common::uint8_t WaitWhileBusy(common::uint8_t status);
+            bool WaitForData();
+            void SelectSectors(common::uint64_t lba, common::uint32_t count, bool extended);
+            bool Transfer(common::uint64_t lba, common::uint32_t count, common::uint8_t* buffer, bool write);
+            bool TransferDMA(common::uint64_t lba, common::uint32_t count, common::uint8_t* buffer, bool write);
         public:
+            static const common::uint32_t TIMEOUT_MS = 1000;
+            static const common::uint32_t SECTOR_SIZE = 512;
+            static const common::uint32_t MAX_SECTORS_28 = 256;   // per command
+            static const common::uint32_t MAX_SECTORS_48 = 65536;
+
             
             AdvancedTechnologyAttachment(bool master, common::uint16_t portBase);
             ~AdvancedTechnologyAttachment();
             
-            void Identify();
+            // Reads the drive's model, size and capabilities, prints them
+            // and turns on multiple sector transfers. False when there is
+            // no drive.
+            bool Identify();
+
+            // Transfers of count sectors to or from the buffer. With a DMA
+            // engine set and a buffer in the kernel's identity map, the
+            // drive moves the data itself; otherwise it is polled PIO,
+            // with as few commands and data requests as the drive allows.
+            // Sectors past 2^28, and commands of more than 256 sectors, use
+            // LBA48 when the drive has it.
+            bool ReadSectors(common::uint64_t lba, common::uint32_t count, common::uint8_t* buffer);
+            bool WriteSectors(common::uint64_t lba, common::uint32_t count, const common::uint8_t* buffer);
+
+            // Issue a DMA command for the engine's loaded table; the
+            // handler hears about the end. For a block layer that keeps
+            // its own requests in flight.
+            bool StartDMA(common::uint64_t lba, common::uint32_t count, bool write, BusMasterIDEEventHandler* handler);
+            BusMasterIDE* DMA() { return dma; }
+            // FLUSH CACHE ended by the interrupt, through the DMA engine's
+            // handler
+            bool StartFlush(BusMasterIDEEventHandler* handler);
+
+            // Use the channel's engine from now on, or PIO again with 0.
+            // Ignored when Identify found the drive cannot do DMA.
+            void SetDMA(BusMasterIDE* dma);
+            bool UsesDMA() { return dma != 0; }
+
+            bool Present() { return present; }
+            bool SupportsLBA48() { return lba48; }
+            common::uint64_t Sectors() { return sectors; }
+            const char* Model() { return model; }
+            common::uint8_t SectorsPerBlock() { return sectorsPerBlock; }
+
+            // Single sector, printed to the console
             void Read28(common::uint32_t sectorNum, int count = 512);
             void Write28(common::uint32_t sectorNum, common::uint8_t* data, common::uint32_t count);
-            void Flush();
+            bool Flush();
             
             
         };
@@ -0,0 +1,110 @@
+#ifndef __MYOS__DRIVERS__BLOCKQUEUE_H
+#define __MYOS__DRIVERS__BLOCKQUEUE_H
+
+#include <common/types.h>
+#include <drivers/ata.h>
+#include <drivers/busmasteride.h>
+#include <multitasking.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+        struct BlockRequest
+        {
+            common::uint64_t lba;
+            common::uint32_t count; // sectors
+            common::uint8_t* buffer;
+            bool write;
+            // Write the drive's cache out instead; lba, count and buffer
+            // are not used. It runs once no transfer is in flight.
+            bool flush;
+
+            // Called with interrupts off once the request is done, from the
+            // drive's interrupt or the task doing PIO, before the tasks
+            // waiting for it with BlockQueue::Wait are woken
+            void (*callback)(BlockRequest* request, void* data);
+            void* data;
+
+            volatile bool done;
+            bool succeeded;
+
+            // Used by the queue
+            BlockRequest* next;
+            Task* waiter;
+        };
+
+        // Asynchronous requests to one drive. Submitting only queues the
+        // request; the drive works through the queue on its own, one DMA
+        // command after the other, each started from the interrupt that
+        // ended the one before. The queue is kept in sector order and
+        // served by an elevator sweeping upwards from where the last
+        // command ended, and requests continuing each other in the same
+        // direction go out as one command. Flushes go out between two
+        // transfers and end on their interrupt as well.
+        //
+        // Drives without DMA are served with PIO by a kernel task running
+        // Serve, with interrupts on, while the tasks waiting for requests
+        // sleep. Without that task the waiting tasks take turns at it.
+        class BlockQueue : public BusMasterIDEEventHandler
+        {
+        public:
+            static const common::uint32_t MAX_MERGE = 64; // requests per command
+
+        protected:
+            AdvancedTechnologyAttachment* drive;
+            BlockRequest* pending; // sorted by lba
+            BlockRequest* flushes;
+            BlockRequest* active;  // the command in flight, in lba order
+            common::uint64_t headPosition;
+
+            // PIO: a task is moving data, the task running Serve if there
+            // is one, and that task while it sleeps
+            bool servicing;
+            bool serving;
+            Task* server;
+
+            common::uint32_t submitted;
+            common::uint32_t commands;
+            common::uint32_t merged;
+
+            BlockRequest* NextCommand(common::uint32_t* sectors);
+            void Dispatch();
+            bool RunPIO(common::uint32_t flags);
+            void Finish(BlockRequest* requests, bool succeeded);
+
+        public:
+            BlockQueue(AdvancedTechnologyAttachment* drive);
+            ~BlockQueue();
+
+            // Most sectors a request, or a merged command, may cover
+            common::uint32_t MaxSectors();
+
+            // False when the request cannot be served: too large, or a
+            // buffer the drive cannot reach, outside the identity map with
+            // DMA or outside the kernel half without
+            bool Submit(BlockRequest* request);
+            // Sleeps the calling task until the request is done. Several
+            // tasks may wait for the same request.
+            bool Wait(BlockRequest* request);
+
+            bool Read(common::uint64_t lba, common::uint32_t count, common::uint8_t* buffer);
+            bool Write(common::uint64_t lba, common::uint32_t count, common::uint8_t* buffer);
+            bool Flush();
+
+            // Body of the kernel task that does the PIO for a drive
+            // without DMA. Never returns.
+            void Serve();
+
+            AdvancedTechnologyAttachment* Drive() { return drive; }
+
+            virtual void OnTransferDone(bool succeeded);
+
+            common::uint32_t Submitted() { return submitted; }
+            common::uint32_t Commands() { return commands; }
+            common::uint32_t Merged() { return merged; }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __MYOS__DRIVERS__BUFFERCACHE_H
+#define __MYOS__DRIVERS__BUFFERCACHE_H
+
+#include <common/types.h>
+#include <drivers/blockqueue.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+        // One block of a device in memory. Callers get it pinned from
+        // BufferCache::Get and hand it back with Release.
+        struct CachedBlock
+        {
+            BlockQueue* device; // 0 while unused
+            common::uint64_t block;
+            common::uint8_t* data;
+
+            common::uint32_t references;
+            bool valid;             // data holds the block
+            bool dirty;             // changed since it was last written
+            volatile bool io;       // a read or write is in flight
+            bool readAhead;         // prefetched and not asked for yet
+
+            CachedBlock* hashNext;
+            CachedBlock* lruPrev;   // towards the most recently used
+            CachedBlock* lruNext;
+
+            BlockRequest request;
+        };
+
+        // Blocks of BLOCK_SECTORS sectors kept in memory, found by device
+        // and block number through a hash table. Unpinned blocks are
+        // reused least recently used first, clean ones before dirty ones.
+        // Writes stay in memory until WriteBack, which the kernel runs
+        // periodically, or Sync; going out together they merge in the
+        // block queue. A device read block after block is read ahead of
+        // the reader, READAHEAD_BLOCKS at a time.
+        class BufferCache
+        {
+        public:
+            static const common::uint32_t BLOCK_SHIFT = 3;
+            static const common::uint32_t BLOCK_SECTORS = 1 << BLOCK_SHIFT;
+            static const common::uint32_t BLOCK_SIZE = BLOCK_SECTORS * AdvancedTechnologyAttachment::SECTOR_SIZE;
+            static const common::uint32_t BLOCKS = 256;           // 1 MiB
+            static const common::uint32_t HASH_BUCKETS = 512;     // power of two
+            static const common::uint32_t READAHEAD_BLOCKS = 16;
+            static const common::uint32_t READAHEAD_TRIGGER = 2;  // sequential reads before it starts
+
+        protected:
+            CachedBlock blocks[BLOCKS];
+            CachedBlock* buckets[HASH_BUCKETS];
+            CachedBlock* lruHead;
+            CachedBlock* lruTail;
+            common::uint8_t* memory;
+
+            // Streaming detection, for the device read last
+            BlockQueue* streamDevice;
+            common::uint64_t streamBlock;
+            common::uint32_t streamLength;
+            common::uint64_t readAheadNext; // first block not read ahead yet
+
+            common::uint32_t lookups;
+            common::uint32_t hits;
+            common::uint32_t readAheads;
+            common::uint32_t readAheadHits;
+            common::uint32_t writeBacks;
+
+            static common::uint32_t Hash(BlockQueue* device, common::uint64_t block);
+            CachedBlock* Find(BlockQueue* device, common::uint64_t block);
+            void Unhash(CachedBlock* block);
+            void Touch(CachedBlock* block);
+            CachedBlock* Evict();
+            void Assign(CachedBlock* block, BlockQueue* device, common::uint64_t number);
+            bool StartIO(CachedBlock* block, bool write);
+            void ReadAhead(BlockQueue* device, common::uint64_t block);
+            static void TransferDone(BlockRequest* request, void* data);
+
+        public:
+            static BufferCache* activeBufferCache;
+
+            BufferCache();
+            ~BufferCache();
+
+            // The block with its data read, pinned; 0 when it cannot be
+            // read or every block is pinned. Without fill the data is not
+            // read, for callers about to overwrite all of it.
+            CachedBlock* Get(BlockQueue* device, common::uint64_t block, bool fill = true);
+            void Release(CachedBlock* block);
+            void MarkDirty(CachedBlock* block);
+
+            // Sector ranges, copied through the cache
+            bool Read(BlockQueue* device, common::uint64_t lba, common::uint32_t count, common::uint8_t* buffer);
+            bool Write(BlockQueue* device, common::uint64_t lba, common::uint32_t count, common::uint8_t* buffer);
+
+            // Starts writing every unpinned dirty block and returns how
+            // many; does not wait for them
+            common::uint32_t WriteBack();
+            // Writes the device's dirty blocks and waits until they and
+            // the drive's cache are on the disk
+            bool Sync(BlockQueue* device);
+
+            common::uint32_t Lookups() { return lookups; }
+            common::uint32_t Hits() { return hits; }
+            common::uint32_t ReadAheads() { return readAheads; }
+            common::uint32_t ReadAheadHits() { return readAheadHits; }
+            common::uint32_t WriteBacks() { return writeBacks; }
+        };
+    }
+}
+
+#endif
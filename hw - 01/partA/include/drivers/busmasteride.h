@@ -0,0 +1,105 @@
+#ifndef __MYOS__DRIVERS__BUSMASTERIDE_H
+#define __MYOS__DRIVERS__BUSMASTERIDE_H
+
+#include <common/types.h>
+#include <hardwarecommunication/interrupts.h>
+#include <hardwarecommunication/port.h>
+#include <hardwarecommunication/pci.h>
+#include <multitasking.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+        // One contiguous piece of a transfer. It must not cross a 64 KiB
+        // boundary; a byte count of 0 means 64 KiB.
+        struct PhysicalRegionDescriptor
+        {
+            common::uint32_t address;
+            common::uint16_t byteCount;
+            common::uint16_t flags; // bit 15 ends the table
+        } __attribute__((packed));
+
+        // Told about the end of a transfer started with a handler. Runs in
+        // interrupt context.
+        class BusMasterIDEEventHandler
+        {
+        public:
+            BusMasterIDEEventHandler();
+            virtual void OnTransferDone(bool succeeded);
+        };
+
+        // Bus-master DMA engine of one IDE channel, found through PCI
+        // (class 1, subclass 1) at BAR4. The drive moves the data to or
+        // from memory itself and raises the channel's IRQ when done; a
+        // task waiting for it is off the CPU meanwhile.
+        class BusMasterIDE : public hardwarecommunication::InterruptHandler
+        {
+        public:
+            // One page of descriptors. Transfers are kept to what a table
+            // covers in the worst case.
+            static const common::uint32_t PRD_ENTRIES = 512;
+            static const common::uint32_t MAX_SECTORS = 32768;
+
+        protected:
+            common::uint16_t base; // 0 without a controller
+            hardwarecommunication::Port8Bit commandPort;
+            hardwarecommunication::Port8Bit statusPort;
+            hardwarecommunication::Port32Bit tablePort;
+            hardwarecommunication::Port8Bit driveStatusPort; // reading it acknowledges the drive
+
+            PhysicalRegionDescriptor* table;
+            common::uint32_t entries;
+            common::uint8_t direction; // command bit 3: the drive writes memory
+
+            volatile bool busy;
+            volatile bool done;
+            bool succeeded;
+            Task* waiter;
+            BusMasterIDEEventHandler* handler;
+
+            common::uint32_t transfers;
+            common::uint64_t blockedCycles; // waiting tasks were off the CPU
+
+            static common::uint16_t FindBase(hardwarecommunication::PeripheralComponentInterconnectController* pci, bool primary);
+            void Complete();
+
+        public:
+            BusMasterIDE(hardwarecommunication::InterruptManager* interruptManager,
+                hardwarecommunication::PeripheralComponentInterconnectController* pci, bool primary = true);
+            ~BusMasterIDE();
+
+            bool Present() { return base != 0 && table != 0; }
+            bool Busy() { return busy; }
+
+            // Describe the memory of the next transfer, one buffer at a
+            // time, then load the table. Buffers have to be identity
+            // mapped and word aligned.
+            void Clear();
+            bool Append(common::uint8_t* buffer, common::uint32_t size);
+            bool Load(bool write);
+            bool Prepare(common::uint8_t* buffer, common::uint32_t size, bool write);
+
+            // Start the engine once the drive took its DMA command. With a
+            // handler, it is told about the end; otherwise Wait for it.
+            void Start(BusMasterIDEEventHandler* handler = 0);
+            // For a command without data: the handler hears about the
+            // drive's next interrupt. Call before issuing the command.
+            void Expect(BusMasterIDEEventHandler* handler);
+            bool Wait(bool wasEnabled);
+
+            // Sleep until *flag is set by whoever wakes *waiter. Called with
+            // interrupts off; wasEnabled says whether the caller had them
+            // on and may thus leave the CPU. Without interrupts the engine
+            // is polled.
+            void WaitFor(volatile bool* flag, Task** waiter, bool wasEnabled);
+
+            common::uint32_t Transfers() { return transfers; }
+            common::uint64_t BlockedCycles() { return blockedCycles; }
+
+            virtual common::uint32_t HandleInterrupt(common::uint32_t esp);
+        };
+    }
+}
+
+#endif
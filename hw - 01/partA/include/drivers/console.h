@@ -0,0 +1,46 @@
+#ifndef __MYOS__DRIVERS__CONSOLE_H
+#define __MYOS__DRIVERS__CONSOLE_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+        // VGA text mode console. Text is rendered into a copy of the
+        // screen in RAM, a run of characters at a time; only the rows that
+        // changed are copied to video memory, and scrolling is a single
+        // memmove of the copy.
+        class Console
+        {
+        public:
+            static const int WIDTH = 80;
+            static const int HEIGHT = 25;
+            static const common::uint16_t ATTRIBUTE = 0x0700; // light grey on black
+
+        protected:
+            common::uint16_t* videoMemory;
+            common::uint16_t screen[WIDTH * HEIGHT];
+            int x;
+            int y;
+            int firstDirty; // rows to copy at the end of the write
+            int lastDirty;
+
+            void NewLine();
+            void Scroll();
+            void MarkDirty(int row);
+            void Update();
+
+        public:
+            static Console* activeConsole;
+
+            Console(common::uint16_t* videoMemory = (common::uint16_t*)0xb8000);
+            ~Console();
+
+            void Write(const char* text, common::size_t length);
+            void Clear();
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __MYOS__DRIVERS__SERIAL_H
+#define __MYOS__DRIVERS__SERIAL_H
+
+#include <common/types.h>
+#include <hardwarecommunication/port.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+        // 16550 UART, polled. Used for output only, so the kernel log can
+        // be captured outside the machine.
+        class SerialPort
+        {
+        public:
+            static const common::uint16_t COM1 = 0x3F8;
+
+        protected:
+            hardwarecommunication::Port8Bit dataPort;
+            hardwarecommunication::Port8Bit interruptEnablePort;
+            hardwarecommunication::Port8Bit fifoControlPort;
+            hardwarecommunication::Port8Bit lineControlPort;
+            hardwarecommunication::Port8Bit modemControlPort;
+            hardwarecommunication::Port8Bit lineStatusPort;
+
+        public:
+            static SerialPort* activeSerialPort;
+
+            SerialPort(common::uint16_t base = COM1, common::uint32_t baudRate = 38400);
+            ~SerialPort();
+
+            void Write(const char* text, common::size_t length);
+        };
+    }
+}
+
+#endif
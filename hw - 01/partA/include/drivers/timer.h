@@ -0,0 +1,71 @@
+#ifndef __MYOS__DRIVERS__TIMER_H
+#define __MYOS__DRIVERS__TIMER_H
+
+#include <common/types.h>
+#include <hardwarecommunication/interrupts.h>
+#include <hardwarecommunication/pit.h>
+#include <drivers/driver.h>
+#include <timerwheel.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+
+        // Drives the scheduler tick from PIT channel 0 and keeps a
+        // monotonic clock. Time is read from the TSC, calibrated against
+        // the PIT at startup, so the clock keeps going while the tick is
+        // stopped in tickless idle. Then the PIT runs one shot at a time,
+        // each ending when the timer wheel next has work.
+        class TimerDriver : public myos::hardwarecommunication::InterruptHandler, public Driver,
+            public myos::hardwarecommunication::TickSource
+        {
+        protected:
+            myos::hardwarecommunication::ProgrammableIntervalTimer pit;
+            TimerWheel wheel;
+            myos::common::uint32_t frequency;
+            myos::common::uint32_t divisor; // of the periodic tick
+            myos::common::uint64_t tickStoppedAt;
+            myos::common::uint32_t timestampFrequency; // TSC cycles per second
+            myos::common::uint32_t cyclesPerTick;
+            myos::common::uint32_t nanosecondsPerCycle; // 8.24 fixed point
+            myos::common::uint64_t startTimestamp;
+            myos::common::uint32_t interrupts;
+
+        public:
+            static const myos::common::uint32_t NANOSECONDS_SHIFT = 24;
+            static TimerDriver* activeTimer;
+
+            TimerDriver(myos::hardwarecommunication::InterruptManager* manager, myos::common::uint32_t frequency);
+            ~TimerDriver();
+            virtual myos::common::uint32_t HandleInterrupt(myos::common::uint32_t esp);
+            virtual void Activate();
+
+            virtual bool StopTick();
+            virtual myos::common::uint32_t RestartTick();
+
+            myos::common::uint32_t Frequency() { return frequency; }
+            myos::common::uint32_t TimestampFrequency() { return timestampFrequency; }
+            myos::common::uint32_t CyclesPerTick() { return cyclesPerTick; }
+            myos::common::uint32_t Interrupts() { return interrupts; }
+
+            // Time since the driver was created
+            myos::common::uint32_t Ticks();
+            myos::common::uint64_t Nanoseconds();
+            myos::common::uint32_t Milliseconds();
+            myos::common::uint32_t TicksForMilliseconds(myos::common::uint32_t milliseconds);
+
+            // Timeouts for code that polls hardware: take a deadline, then
+            // give up once it has expired
+            myos::common::uint64_t Deadline(myos::common::uint32_t milliseconds);
+            bool Expired(myos::common::uint64_t deadline);
+
+            // Spin for a while. Only for code that cannot block, tasks
+            // should use sys_sleep.
+            void Delay(myos::common::uint32_t milliseconds);
+        };
+
+    }
+}
+
+#endif
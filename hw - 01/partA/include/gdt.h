@@ -5,6 +5,40 @@
 
 namespace myos
 {
+
+    // The kernel's segment only uses esp0/ss0, the stack the CPU switches
+    // to when an interrupt arrives in ring 3; a double fault switches
+    // tasks and saves the rest there
+    struct TaskStateSegment
+    {
+        myos::common::uint32_t previousTask;
+        myos::common::uint32_t esp0;
+        myos::common::uint32_t ss0;
+        myos::common::uint32_t esp1;
+        myos::common::uint32_t ss1;
+        myos::common::uint32_t esp2;
+        myos::common::uint32_t ss2;
+        myos::common::uint32_t cr3;
+        myos::common::uint32_t eip;
+        myos::common::uint32_t eflags;
+        myos::common::uint32_t eax;
+        myos::common::uint32_t ecx;
+        myos::common::uint32_t edx;
+        myos::common::uint32_t ebx;
+        myos::common::uint32_t esp;
+        myos::common::uint32_t ebp;
+        myos::common::uint32_t esi;
+        myos::common::uint32_t edi;
+        myos::common::uint32_t es;
+        myos::common::uint32_t cs;
+        myos::common::uint32_t ss;
+        myos::common::uint32_t ds;
+        myos::common::uint32_t fs;
+        myos::common::uint32_t gs;
+        myos::common::uint32_t ldt;
+        myos::common::uint16_t trap;
+        myos::common::uint16_t ioMapBase;
+    } __attribute__((packed));
     
     class GlobalDescriptorTable
     {
@@ -31,6 +65,13 @@ namespace myos
             SegmentDescriptor unusedSegmentSelector;
             SegmentDescriptor codeSegmentSelector;
             SegmentDescriptor dataSegmentSelector;
+            SegmentDescriptor userCodeSegmentSelector;
+            SegmentDescriptor userDataSegmentSelector;
+            SegmentDescriptor taskStateSegmentSelector;
+            SegmentDescriptor doubleFaultSegmentSelector;
+
+            static TaskStateSegment taskStateSegment;
+            static TaskStateSegment doubleFaultSegment;
 
         public:
 
@@ -39,6 +80,20 @@ namespace myos
 
             myos::common::uint16_t CodeSegmentSelector();
             myos::common::uint16_t DataSegmentSelector();
+            // Including the requested privilege level 3
+            myos::common::uint16_t UserCodeSegmentSelector();
+            myos::common::uint16_t UserDataSegmentSelector();
+            myos::common::uint16_t TaskStateSegmentSelector();
+            myos::common::uint16_t DoubleFaultSegmentSelector();
+
+            // Stack for interrupts that arrive while a task runs in ring 3
+            void SetKernelStack(myos::common::uint32_t esp0) { taskStateSegment.esp0 = esp0; }
+
+            // The task a double fault switches to, so it runs on a stack of
+            // its own even when the faulting code has none left
+            void SetDoubleFaultTask(void (*entry)(), myos::common::uint32_t esp, myos::common::uint32_t cr3);
+            // Where that switch saved the state of the faulting code
+            static TaskStateSegment* TaskState() { return &taskStateSegment; }
     };
 
 }
@@ -25,6 +25,19 @@ namespace myos
             virtual myos::common::uint32_t HandleInterrupt(myos::common::uint32_t esp);
         };
 
+        // A periodic tick that can be stopped while the CPU idles
+        class TickSource
+        {
+        public:
+            TickSource();
+
+            // Replace the periodic tick by a single interrupt when the
+            // next timer is due. False when one is due right away.
+            virtual bool StopTick();
+            // Back to the periodic tick; returns how many ticks were skipped
+            virtual myos::common::uint32_t RestartTick();
+        };
+
         class InterruptManager
         {
             friend class InterruptHandler;
@@ -52,6 +65,15 @@ namespace myos
             } __attribute__((packed));
 
             myos::common::uint16_t hardwareInterruptOffset;
+
+            // Tickless idle: while no task is ready the tick source fires
+            // only when the next timer is due, and the ticks that would
+            // have fired meanwhile are counted
+            TickSource* tickSource;
+            bool tickStopped;
+            myos::common::uint32_t idleTicksAvoided;
+            void EnterTicklessIdle();
+            void LeaveTicklessIdle();
             static void SetInterruptDescriptorTableEntry(myos::common::uint8_t interrupt,
                 myos::common::uint16_t codeSegmentSelectorOffset, void (*handler)(),
                 myos::common::uint8_t DescriptorPrivilegeLevel, myos::common::uint8_t DescriptorType);
@@ -113,6 +135,12 @@ namespace myos
             myos::common::uint16_t HardwareInterruptOffset();
             void Activate();
             void Deactivate();
+            // The interrupt switches to the task of that segment instead
+            // of calling a handler on the current stack
+            void SetTaskGate(myos::common::uint8_t interrupt, myos::common::uint16_t taskStateSegmentSelector);
+
+            void EnableTicklessIdle(TickSource* tickSource);
+            myos::common::uint32_t IdleTicksAvoided() { return idleTicksAvoided; }
         };
 
     }
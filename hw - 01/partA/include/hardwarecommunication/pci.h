@@ -74,6 +74,9 @@ namespace myos
             void SelectDrivers(myos::drivers::DriverManager* driverManager, myos::hardwarecommunication::InterruptManager* interrupts);
             myos::drivers::Driver* GetDriver(PeripheralComponentInterconnectDeviceDescriptor dev, myos::hardwarecommunication::InterruptManager* interrupts);
             PeripheralComponentInterconnectDeviceDescriptor GetDeviceDescriptor(myos::common::uint16_t bus, myos::common::uint16_t device, myos::common::uint16_t function);
+            // First function of the given class and subclass
+            bool FindDevice(myos::common::uint8_t class_id, myos::common::uint8_t subclass_id, PeripheralComponentInterconnectDeviceDescriptor* result);
+            void EnableBusMaster(PeripheralComponentInterconnectDeviceDescriptor* dev);
             BaseAddressRegister GetBaseAddressRegister(myos::common::uint16_t bus, myos::common::uint16_t device, myos::common::uint16_t function, myos::common::uint16_t bar);
         };
 
@@ -0,0 +1,48 @@
+#ifndef __MYOS__HARDWARECOMMUNICATION__PIT_H
+#define __MYOS__HARDWARECOMMUNICATION__PIT_H
+
+#include <common/types.h>
+#include <hardwarecommunication/port.h>
+
+namespace myos
+{
+    namespace hardwarecommunication
+    {
+
+        // Intel 8253/8254. Channel 0 drives IRQ0, channel 2 is gated
+        // through port 0x61 and can be polled, which makes it usable for
+        // timing things before interrupts are on.
+        class ProgrammableIntervalTimer
+        {
+        public:
+            static const myos::common::uint32_t BASE_FREQUENCY = 1193182;
+            static const myos::common::uint32_t DEFAULT_DIVISOR = 65536; // what the BIOS leaves, about 18.2 Hz
+
+        protected:
+            Port8BitSlow channel0DataPort;
+            Port8BitSlow channel2DataPort;
+            Port8BitSlow commandPort;
+            Port8BitSlow channel2GatePort;
+
+        public:
+            ProgrammableIntervalTimer();
+            ~ProgrammableIntervalTimer();
+
+            // Program channel 0 as a rate generator firing IRQ0 about
+            // frequency times a second. Returns the divisor actually used.
+            myos::common::uint32_t SetFrequency(myos::common::uint32_t frequency);
+            void SetDivisor(myos::common::uint32_t divisor);
+
+            // Program channel 0 to fire IRQ0 once, after count PIT cycles
+            // (at most 65536), then stay quiet until reprogrammed
+            void SetOneShot(myos::common::uint32_t count);
+
+            // Time-stamp counter cycles per second, measured against
+            // channel 2
+            myos::common::uint32_t CalibrateTimestampCounter();
+        };
+
+    }
+}
+
+#endif
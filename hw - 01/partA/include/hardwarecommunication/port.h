@@ -70,6 +70,10 @@ namespace myos
                 virtual myos::common::uint16_t Read();
                 virtual void Write(myos::common::uint16_t data);
 
+                // count words at once with rep insw / rep outsw
+                void ReadString(myos::common::uint16_t* buffer, myos::common::uint32_t count);
+                void WriteString(const myos::common::uint16_t* buffer, myos::common::uint32_t count);
+
             protected:
                 static inline myos::common::uint16_t Read16(myos::common::uint16_t _port)
                 {
@@ -82,6 +86,16 @@ namespace myos
                 {
                     __asm__ volatile("outw %0, %1" : : "a" (_data), "Nd" (_port));
                 }
+
+                static inline void ReadString16(myos::common::uint16_t _port, myos::common::uint16_t* _buffer, myos::common::uint32_t _count)
+                {
+                    __asm__ volatile("cld; rep insw" : "+D" (_buffer), "+c" (_count) : "d" (_port) : "memory");
+                }
+
+                static inline void WriteString16(myos::common::uint16_t _port, const myos::common::uint16_t* _buffer, myos::common::uint32_t _count)
+                {
+                    __asm__ volatile("cld; rep outsw" : "+S" (_buffer), "+c" (_count) : "d" (_port) : "memory");
+                }
         };
 
 
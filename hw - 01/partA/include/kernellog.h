@@ -0,0 +1,57 @@
+#ifndef __MYOS__KERNELLOG_H
+#define __MYOS__KERNELLOG_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR };
+
+    struct LogRecord
+    {
+        static const common::uint32_t TEXT_SIZE = 48;
+
+        // Position in the log plus one once the record is complete, zero
+        // while it is being written
+        volatile common::uint32_t sequence;
+        common::uint8_t level;
+        common::uint8_t length;
+        common::uint16_t reserved;
+        common::uint64_t timestamp; // when it was logged, in cycles
+        char text[TEXT_SIZE];
+    } __attribute__((packed));
+
+    // Fixed-size log the kernel writes everything into. Writing is a slot
+    // reservation with lock xadd and a copy, so it is cheap enough for
+    // interrupt handlers and needs no lock; when the reader falls behind
+    // the oldest records are overwritten. Text longer than a record is
+    // split over several. There is one writer side per CPU and a single
+    // reader, which checks the sequence of every record it copies out.
+    class KernelLog
+    {
+    public:
+        static const common::uint32_t ENTRIES = 512; // power of two
+
+    private:
+        LogRecord records[ENTRIES];
+        volatile common::uint32_t head; // next record to write
+        common::uint32_t tail;          // next record to read
+        common::uint32_t dropped;       // overwritten before they were read
+
+    public:
+        static KernelLog* activeKernelLog;
+
+        KernelLog();
+        ~KernelLog();
+
+        void Write(LogLevel level, const char* text, common::size_t length);
+
+        // Copies out the oldest unread record. Fails when there is none,
+        // or when the next one is still being written.
+        bool Read(LogRecord* record);
+
+        common::uint32_t Dropped() { return dropped; }
+    };
+}
+
+#endif
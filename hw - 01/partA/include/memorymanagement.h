@@ -3,20 +3,90 @@
 
 #include <common/types.h>
 
+void* operator new(unsigned size, void* ptr);
+
 namespace myos
 {
+    // Boundary-tag chunk. The header holds the size of the whole chunk,
+    // header included, with the two flags packed into its low bits.
     struct MemoryChunk
     {
-        MemoryChunk* next;
-        MemoryChunk* prev;
-        bool allocated;
+        common::size_t sizeAndFlags;
+    };
+
+    // A free chunk keeps its size-class links in its payload and a copy
+    // of its size in its last word, so the chunk behind it can find it.
+    struct FreeMemoryChunk : public MemoryChunk
+    {
+        FreeMemoryChunk* nextFree;
+        FreeMemoryChunk* prevFree;
+    };
+
+    // Every block handed to the heap starts with one of these, followed
+    // by its chunks and an allocated, zero-sized end marker.
+    struct MemoryRegion
+    {
+        MemoryRegion* next;
         common::size_t size;
     };
 
+    struct HeapStats
+    {
+        common::size_t totalBytes;
+        common::size_t bytesInUse;
+        common::size_t bytesFree;
+        common::size_t largestFreeBlock;
+        common::uint32_t usedChunks;
+        common::uint32_t freeChunks;
+        common::uint32_t regions;
+        common::uint32_t fragmentation; // percent of free bytes outside the largest free block
+    };
+
     class MemoryManager
     {
+    public:
+        // Chunk sizes are multiples of this. Chunk headers sit 4 bytes
+        // below an aligned address so every payload is 8-byte aligned.
+        static const common::size_t ALIGNMENT = 8;
+        static const common::size_t CHUNK_ALLOCATED = 1;
+        static const common::size_t CHUNK_PREV_ALLOCATED = 2;
+        static const common::size_t CHUNK_FLAGS = ALIGNMENT - 1;
+        static const common::size_t MIN_CHUNK_SIZE = sizeof(FreeMemoryChunk) + sizeof(common::size_t);
+
+        // Chunks below SMALL_LIMIT get an exact-fit bin per ALIGNMENT step,
+        // larger chunks share one bin per power of two.
+        static const common::size_t SMALL_LIMIT = 256;
+        static const int NUM_SMALL_BINS = SMALL_LIMIT / ALIGNMENT;
+        static const int NUM_BINS = NUM_SMALL_BINS + 24;
+
+        // When the heap runs out it grows by at least 2^HEAP_GROW_ORDER
+        // page frames
+        static const int HEAP_GROW_ORDER = 8;
+
     protected:
-        MemoryChunk* first;
+        MemoryRegion* regions;
+        common::size_t heapLow;
+        common::size_t heapHigh;
+        common::size_t bytesInUse;
+
+        FreeMemoryChunk* bins[NUM_BINS];
+        common::uint32_t binMap[(NUM_BINS + 31) / 32];
+
+        static common::size_t ChunkSize(MemoryChunk* chunk) { return chunk->sizeAndFlags & ~CHUNK_FLAGS; }
+        static MemoryChunk* NextChunk(MemoryChunk* chunk) { return (MemoryChunk*)((common::size_t)chunk + ChunkSize(chunk)); }
+        static MemoryChunk* PrevChunk(MemoryChunk* chunk) { return (MemoryChunk*)((common::size_t)chunk - ((common::size_t*)chunk)[-1]); }
+        static void* Payload(MemoryChunk* chunk) { return (void*)((common::size_t)chunk + sizeof(MemoryChunk)); }
+        static common::size_t ChunkSizeFor(common::size_t size);
+
+        static int BinIndex(common::size_t size);
+        int FindNonEmptyBin(int index);
+        void InsertFree(MemoryChunk* chunk);
+        void RemoveFree(MemoryChunk* chunk);
+        void MakeFree(MemoryChunk* chunk, common::size_t size);
+        MemoryChunk* FindFit(common::size_t size);
+        void Split(MemoryChunk* chunk, common::size_t size);
+        MemoryChunk* ChunkFor(void* ptr);
+        bool Grow(common::size_t size);
 
     public:
         static MemoryManager* activeMemoryManager;
@@ -24,14 +94,117 @@ namespace myos
         MemoryManager(common::size_t start, common::size_t size);
         ~MemoryManager();
 
+        void AddRegion(common::size_t start, common::size_t size);
+
         void* malloc(common::size_t size);
+        void* malloc_aligned(common::size_t size, common::size_t align);
+        void* calloc(common::size_t count, common::size_t size);
+        void* realloc(void* ptr, common::size_t size);
         void free(void* ptr);
+
+        common::size_t BytesInUse() { return bytesInUse; }
+        bool Verify(HeapStats* stats = 0);
+    };
+
+    struct ArenaBlock
+    {
+        ArenaBlock* next;
+        common::size_t size;
+        common::size_t used;
+    };
+
+    // Bump allocator over page-frame blocks. Single allocations cannot be
+    // freed; Release gives every block back at once.
+    class Arena
+    {
+    protected:
+        ArenaBlock* blocks;
+        common::size_t bytesAllocated;
+
+    public:
+        Arena();
+        ~Arena();
+
+        void* Allocate(common::size_t size);
+        void Release();
+
+        common::size_t BytesAllocated() { return bytesAllocated; }
+    };
+
+    struct Slab
+    {
+        Slab* next;
+        Slab* prev;
+        void* freeObjects;
+        common::uint32_t nextUnused;
+        common::uint32_t inUse;
+    };
+
+    // Object cache in the style of kmem_cache: carves size-aligned slabs
+    // into equally sized objects, so freeing an object finds its slab by
+    // masking the address and objects carry no per-object header.
+    class SlabAllocator
+    {
+    public:
+        static const common::size_t PAGE_SIZE = 4096;
+        static const common::size_t MAX_SLAB_SIZE = 8 * PAGE_SIZE;
+
+    protected:
+        common::size_t objectSize;
+        common::size_t slabSize;
+        common::size_t headerSize;
+        common::uint32_t objectsPerSlab;
+
+        Slab* partialSlabs;
+        Slab* fullSlabs;
+        Slab* emptySlab;
+
+        common::uint32_t objectsInUse;
+        common::uint32_t slabsHeld;
+
+        Slab* NewSlab();
+        void ReleaseSlab(Slab* slab);
+        static void Link(Slab** list, Slab* slab);
+        static void Unlink(Slab** list, Slab* slab);
+
+    public:
+        SlabAllocator(common::size_t objectSize);
+        ~SlabAllocator();
+
+        void* Allocate();
+        void Free(void* object);
+
+        common::uint32_t ObjectsInUse() { return objectsInUse; }
+        common::uint32_t SlabsHeld() { return slabsHeld; }
+    };
+
+    template<class T>
+    class SlabCache : public SlabAllocator
+    {
+    public:
+        SlabCache() : SlabAllocator(sizeof(T)) {}
+
+        template<typename... Args>
+        T* Create(Args... args)
+        {
+            void* memory = Allocate();
+            if (memory == 0)
+                return 0;
+            return new (memory) T(args...);
+        }
+
+        void Destroy(T* object)
+        {
+            if (object == 0)
+                return;
+            object->~T();
+            Free(object);
+        }
     };
 }
 
 void* operator new(unsigned size);
 void* operator new[](unsigned size);
-void* operator new(unsigned size, void* ptr);
 
 void operator delete(void* ptr);
 void operator delete[](void* ptr);
@@ -0,0 +1,52 @@
+#ifndef __MYOS__MULTIBOOT_H
+#define __MYOS__MULTIBOOT_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    enum MultibootInfoFlags
+    {
+        MULTIBOOT_INFO_MEMORY = 1 << 0,
+        MULTIBOOT_INFO_CMDLINE = 1 << 2,
+        MULTIBOOT_INFO_MODS = 1 << 3,
+        MULTIBOOT_INFO_MEM_MAP = 1 << 6
+    };
+
+    enum MultibootMemoryType
+    {
+        MULTIBOOT_MEMORY_AVAILABLE = 1
+    };
+
+    struct MultibootInfo
+    {
+        common::uint32_t flags;
+        common::uint32_t mem_lower;
+        common::uint32_t mem_upper;
+        common::uint32_t boot_device;
+        common::uint32_t cmdline;
+        common::uint32_t mods_count;
+        common::uint32_t mods_addr;
+        common::uint32_t syms[4];
+        common::uint32_t mmap_length;
+        common::uint32_t mmap_addr;
+    } __attribute__((packed));
+
+    struct MultibootModule
+    {
+        common::uint32_t mod_start;
+        common::uint32_t mod_end;
+        common::uint32_t string;
+        common::uint32_t reserved;
+    } __attribute__((packed));
+
+    struct MultibootMemoryMapEntry
+    {
+        common::uint32_t size; // size of the rest of the entry
+        common::uint64_t base_addr;
+        common::uint64_t length;
+        common::uint32_t type;
+    } __attribute__((packed));
+}
+
+#endif
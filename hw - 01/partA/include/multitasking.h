@@ -3,12 +3,17 @@
 
 #include <common/types.h>
 #include <gdt.h>
+#include <memorymanagement.h>
+#include <timerwheel.h>
+#include <syscallring.h>
 
 namespace myos
 {
     namespace hardwarecommunication {
         class InterruptHandler;
     }
+
+    class AddressSpace;
     
     struct CPUState
     {
@@ -30,51 +35,173 @@ namespace myos
         common::uint32_t ss;
     } __attribute__((packed));
 
-    enum TaskState { READY, WAITING, FINISHED };
+    // FINISHED tasks still run on their own stack until the next switch.
+    // After that they are ZOMBIEs: only the exit status is kept, until the
+    // parent collects it with waitpid.
+    enum TaskState { READY, WAITING, FINISHED, ZOMBIE, SLEEPING };
+
+    enum SchedulingPolicy { ROUND_ROBIN, MULTILEVEL_FEEDBACK };
+    
+    // Doubly-linked list threaded through the tasks themselves, so every
+    // operation is O(1) and needs no memory
+    class Task;
+
+    class TaskQueue
+    {
+    private:
+        Task* head;
+        Task* tail;
+        common::uint32_t count;
+    public:
+        TaskQueue();
+        void PushBack(Task* task);
+        Task* PopFront();
+        void Remove(Task* task);
+        void Append(TaskQueue* other);
+        Task* Front() { return head; }
+        common::uint32_t Count() { return count; }
+    };
     
     class Task
     {
         friend class TaskManager;
+        friend class TaskQueue;
+    public:
+        static const common::size_t STACK_SIZE = 4096; // 4 KiB, one page frame
+        // Reserved in the task's address space, committed page by page
+        static const common::size_t USER_STACK_SIZE = 64 * 1024;
     private:
-        common::uint8_t stack[4096]; // 4 KiB
+        // Kernel stack, used for interrupts and system calls. The task
+        // itself runs in ring 3 on a stack in its own address space.
+        // Kernel tasks run on it and get a larger one, with a guard page.
+        common::uint8_t* stack;
+        common::size_t stackSize = STACK_SIZE;
+        AddressSpace* addressSpace = 0;
         common::uint32_t pId = 0;
         common::uint32_t pPid = 0;
         TaskState taskState;
         common::uint32_t waitpid;
+        int exitStatus = 0;
+        Timer sleepTimer; // wakes the task from SLEEPING
+        common::uint32_t children = 0; // live or zombie tasks whose parent this is
         CPUState* cpustate;
+        bool cached = false; // allocated from TaskManager::taskCache
+        Arena arena; // task-local allocations of a kernel task, released when it is reaped
+
+        // Intrusive links: the queue the task is on and its pid hash chain
+        Task* queueNext = 0;
+        Task* queuePrev = 0;
+        Task* hashNext = 0;
+
+        // Tasks blocked in waitpid on this one
+        TaskQueue waiters;
+
+        // Registered system call ring. When a request from it blocks, its
+        // completion is posted once the task runs again, with the result
+        // the wakeup left in eax.
+        SyscallRing* ring = 0;
+        bool ringBlocked = false;
+        common::uint32_t ringUserData = 0;
+        common::uint32_t ringConsumed = 0; // returned by the enter call
+
+        // Feedback queue level (0 is the highest) and what is left of the
+        // current time slice, in timer ticks
+        int priority = 0;
+        int ticksLeft = 0;
+        common::uint32_t boostEpoch = 0;
+
+        // Accounting. lastTimestamp is when the task last started running
+        // or, while it is ready, when it became ready.
+        common::uint64_t lastTimestamp = 0;
+        common::uint64_t runtimeCycles = 0;
+        common::uint64_t readyWaitCycles = 0;
+        common::uint32_t switches = 0;
     public:
-        Task(GlobalDescriptorTable *gdt, void (*entrypoint)());
+        // Kernel tasks run in ring 0 on their kernel stack, without an
+        // address space of their own
+        Task(GlobalDescriptorTable *gdt, void (*entrypoint)(), bool userMode = true);
         Task();
         common::uint32_t getId();
         ~Task();
     };
-    
+
     class TaskManager
     {
         friend class hardwarecommunication::InterruptHandler;
+    public:
+        static const int PID_HASH_SIZE = 256; // power of two
+        static const int NUM_PRIORITIES = 4;
+        static const common::uint32_t QUANTUM_MS = 10; // time slice at the top level
+        static const common::uint32_t BOOST_INTERVAL_MS = 1000; // between priority boosts
     private:
-        Task* tasks[256];
+        SchedulingPolicy policy;
+        Task* current;
+        CPUState* idleState; // the boot context, resumed as the idle task when nothing is ready
+        TaskQueue readyQueues[NUM_PRIORITIES];
+        TaskQueue finishedQueue;
+        Task* pidHash[PID_HASH_SIZE];
+        common::uint32_t nextPid;
         int numTasks;
-        int currentTask;
-        GlobalDescriptorTable *gdt = nullptr;
-        int getIndex(common::uint32_t pid);
-    protected:
-        void PrintProcessTable();
+        common::uint32_t ticks;
+        common::uint32_t boostEpoch;
+
+        // Set by the timer driver; until then a tick is assumed to be the
+        // BIOS rate and times are printed in cycles
+        common::uint32_t tickFrequency;
+        common::uint32_t timestampFrequency;
+        common::uint32_t boostInterval; // in ticks
+
+        common::uint64_t scheduleCycles;
+        common::uint32_t scheduleCount;
+
+        GlobalDescriptorTable *gdt = nullptr; // kernel stack switching for ring 3 tasks
+        SlabCache<Task> taskCache;
+        Task* FindTask(common::uint32_t pid);
+        void InsertTask(Task* task, common::uint32_t parentPid);
+        void ReapFinishedTasks();
+        void RemoveTask(Task* task);
+        void MakeReady(Task* task, common::uint64_t now);
+        void BoostAll();
+        static void WakeSleeper(void* task);
+        int Quantum(int priority);
     public:
-        TaskManager();
+        static TaskManager* activeTaskManager;
+
+        TaskManager(SchedulingPolicy policy = ROUND_ROBIN, GlobalDescriptorTable* gdt = 0);
         ~TaskManager();
         void Yield();
         bool AddTask(Task* task);
-        int getCurrentTask() { return currentTask; }  // Getter for currentTask
+        int getCurrentTask() { return current != 0 ? (int)current->pId : -1; }  // pid of the running task
+        bool IsCurrentRunnable() { return current == 0 || current->taskState == READY; }
+        bool IsIdle() { return current == 0; }
+        AddressSpace* CurrentAddressSpace() { return current != 0 ? current->addressSpace : 0; }
+        SyscallRing* CurrentRing() { return current != 0 ? current->ring : 0; }
+        void SetRing(SyscallRing* ring);
+        void BlockInRing(common::uint32_t userData, common::uint32_t consumed);
         CPUState* Schedule(CPUState* cpustate);
         common::uint32_t AddTask(void (*entrypoint)());
         common::uint32_t ExecTask(void* entrypoint);
         common::uint32_t GetPid();
         common::uint32_t ForkTask(CPUState* cpustate);
         bool ExitCurrentTask();
-        bool WaitTask(common::uint32_t pid);
-        void ExitTask();  // Add this line
+        int WaitTask(common::uint32_t pid);
+        void ExitTask(int status);
+        void SleepTask(common::uint32_t milliseconds);
+
+        // For drivers that wait for an interrupt. The current task stays
+        // off the ready queues until WakeTask; the caller switches away
+        // with Yield, with interrupts off until then so the wakeup cannot
+        // come first.
+        Task* BlockCurrentTask();
+        void WakeTask(Task* task);
+        void SetTiming(common::uint32_t tickFrequency, common::uint32_t timestampFrequency);
+        void* AllocateTaskMemory(common::size_t size);
 
+        void PrintProcessTable();
+        SchedulingPolicy Policy() { return policy; }
+        int NumTasks() { return numTasks; }
+        common::uint64_t ScheduleCycles() { return scheduleCycles; }
+        common::uint32_t ScheduleCount() { return scheduleCount; }
     };
 }
 
@@ -0,0 +1,75 @@
+#ifndef __MYOS__PAGEFRAMEALLOCATOR_H
+#define __MYOS__PAGEFRAMEALLOCATOR_H
+
+#include <common/types.h>
+#include <multiboot.h>
+
+namespace myos
+{
+    struct FreeFrameBlock
+    {
+        FreeFrameBlock* next;
+        FreeFrameBlock* prev;
+    };
+
+    // Buddy allocator for physical page frames. Blocks are 2^order frames
+    // (4 KiB up to 4 MiB) and always aligned to their own size.
+    class PageFrameAllocator
+    {
+    public:
+        static const common::size_t PAGE_SIZE = 4096;
+        static const int MAX_ORDER = 10;
+
+    protected:
+        // Per-frame state, one byte for every frame below the highest
+        // usable address
+        enum FrameState
+        {
+            FRAME_INTERIOR = 0x00,
+            FRAME_FREE_HEAD = 0x80,
+            FRAME_USED_HEAD = 0x40,
+            FRAME_AVAILABLE = 0x20,
+            FRAME_RESERVED = 0xFF
+        };
+
+        common::uint8_t* frameState;
+        // Extra owners of a used single frame, for copy-on-write sharing
+        common::uint16_t* frameShares;
+        common::uint32_t numFrames;
+        common::uint32_t freeFrames;
+        common::uint32_t totalFrames;
+
+        FreeFrameBlock* freeLists[MAX_ORDER + 1];
+
+        void MarkAvailable(common::uint64_t start, common::uint64_t length);
+        void Reserve(common::size_t start, common::size_t size);
+        void ReserveBootData(const MultibootInfo* multiboot);
+        static common::uint64_t BootDataEnd(const MultibootInfo* multiboot,
+            common::uint64_t start, common::uint64_t end);
+        void PushBlock(common::uint32_t frame, int order);
+        void RemoveBlock(common::uint32_t frame, int order);
+        void FreeBlock(common::uint32_t frame, int order);
+
+    public:
+        static PageFrameAllocator* activePageFrameAllocator;
+
+        PageFrameAllocator(const MultibootInfo* multiboot);
+        ~PageFrameAllocator();
+
+        void* AllocateFrames(int order);
+        void FreeFrames(void* address);
+
+        // Give a single used frame one more owner. FreeFrames drops an
+        // owner and only frees the frame when the last one is gone.
+        void ShareFrame(void* address);
+        common::uint16_t FrameShares(void* address);
+
+        static int OrderForSize(common::size_t size);
+
+        common::uint32_t FreeFrameCount() { return freeFrames; }
+        common::uint32_t TotalFrameCount() { return totalFrames; }
+        common::size_t HighestAddress() { return numFrames * PAGE_SIZE; }
+    };
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef __MYOS__PAGING_H
+#define __MYOS__PAGING_H
+
+#include <common/types.h>
+#include <hardwarecommunication/interrupts.h>
+#include <multitasking.h>
+
+namespace myos
+{
+    // Two-level i386 page tables. The lower 3 GiB identity map physical
+    // memory for the kernel and are shared by every address space; the
+    // upper GiB belongs to the task. The identity map uses global 4 MiB
+    // pages where the CPU has them, so it costs few TLB entries and
+    // survives the CR3 reload of a task switch.
+    class AddressSpace
+    {
+    public:
+        static const common::size_t PAGE_SIZE = 4096;
+        static const common::size_t LARGE_PAGE_SIZE = 4 * 1024 * 1024;
+        static const common::uint32_t KERNEL_SPACE_END = 0xC0000000;
+        static const common::uint32_t USER_STACK_TOP = 0xF0000000;
+        // A page of per-task data for the code running in the task, such
+        // as its console line buffer
+        static const common::uint32_t TASK_LOCAL_BASE = 0xE0000000;
+        // Task memory handed out by SYS_ALLOC grows up from here to the
+        // local page
+        static const common::uint32_t USER_ARENA_BASE = 0xD0000000;
+        // The top of the kernel half holds the stacks of kernel tasks
+        // instead of identity mapped memory. Each has an unmapped page
+        // below it.
+        static const common::uint32_t KERNEL_STACKS_BASE = 0xBF000000;
+        static const common::size_t KERNEL_STACK_SIZE = 16 * 1024;
+        static const common::uint32_t KERNEL_STACK_SLOTS = (KERNEL_SPACE_END - KERNEL_STACKS_BASE) / (KERNEL_STACK_SIZE + PAGE_SIZE);
+
+        static const common::uint32_t PAGE_PRESENT = 0x001;
+        static const common::uint32_t PAGE_WRITABLE = 0x002;
+        static const common::uint32_t PAGE_USER = 0x004;
+        static const common::uint32_t PAGE_LARGE = 0x080;
+        static const common::uint32_t PAGE_GLOBAL = 0x100;
+        static const common::uint32_t PAGE_COPY_ON_WRITE = 0x200; // available to the OS
+        static const common::uint32_t PAGE_FRAME = 0xFFFFF000;
+
+    protected:
+        common::uint32_t* directory;
+
+        // Range whose pages are committed on their first touch, with an
+        // unmapped guard page right below it
+        common::uint32_t reservedStart;
+        common::uint32_t reservedEnd;
+
+        // Bump pointer of the task arena and the end of its mapped pages
+        common::uint32_t arenaNext;
+        common::uint32_t arenaEnd;
+
+        static common::uint32_t kernelStackSlots[(KERNEL_STACK_SLOTS + 31) / 32];
+
+        static common::uint32_t* AllocateTable();
+        static void FlushPage(common::uint32_t virtualAddress);
+        static void FlushAll();
+
+    public:
+        static AddressSpace* kernelSpace;
+        static common::uint32_t identityEnd; // the identity map covers [PAGE_SIZE, identityEnd)
+        static common::uint32_t largePages; // in the identity map
+        static common::uint32_t smallPages;
+
+        // Counters for the copy-on-write path
+        static common::uint32_t pagesShared;
+        static common::uint32_t pagesCopied;
+        static common::uint32_t pagesReclaimed; // last owner wrote, nothing to copy
+        static common::uint32_t pagesCommitted; // on demand, in reserved ranges
+
+        AddressSpace();
+        ~AddressSpace();
+        // False when there was no frame for the directory
+        bool IsValid() { return directory != 0; }
+
+        // Build the kernel identity map and turn paging on
+        static void EnablePaging();
+
+        // Whether [address, address + size) is identity mapped, so its
+        // virtual addresses are the physical ones a device sees. Without
+        // paging every address is.
+        static bool IsIdentityMapped(common::uint32_t address, common::uint64_t size);
+
+        // Lowest address of a kernel task stack of KERNEL_STACK_SIZE, or 0
+        // when there is no slot or memory left
+        static common::uint8_t* AllocateKernelStack();
+        static void FreeKernelStack(common::uint8_t* stack);
+        static bool IsKernelStack(common::uint8_t* stack);
+
+        // Page table entry for a virtual address, or 0 if its table does
+        // not exist and create is false
+        common::uint32_t* Entry(common::uint32_t virtualAddress, bool create);
+        bool Map(common::uint32_t virtualAddress, common::uint32_t physicalAddress, common::uint32_t flags);
+        void Activate();
+
+        // Whether ring 3 may access [address, address + size). Pages of
+        // the reserved range count as there, since touching them commits
+        // them.
+        bool IsUserRange(common::uint32_t address, common::uint32_t size, bool write);
+        // Length of a string ring 3 may read, or -1 if it may not read it
+        // all or it is longer than maxLength
+        int UserStringLength(common::uint32_t address, common::uint32_t maxLength);
+
+        void Reserve(common::uint32_t start, common::uint32_t size);
+        bool HandleMissingPage(common::uint32_t virtualAddress);
+        bool IsGuardPage(common::uint32_t virtualAddress);
+
+        // User memory that cannot be freed on its own; it goes with the
+        // address space. 0 when the arena is full or out of frames.
+        void* AllocateArena(common::uint32_t size);
+
+        // Copy of the user half that shares every page until one side
+        // writes to it
+        AddressSpace* Clone();
+        bool HandleWriteFault(common::uint32_t virtualAddress);
+    };
+
+    class PageFaultHandler : public hardwarecommunication::InterruptHandler
+    {
+    private:
+        TaskManager* taskManager;
+
+        // Entered through a task gate on a stack of its own, reports the
+        // faulting task and halts
+        static void HandleDoubleFault();
+
+    public:
+        PageFaultHandler(hardwarecommunication::InterruptManager* interruptManager, TaskManager* taskManager,
+            GlobalDescriptorTable* gdt);
+        ~PageFaultHandler();
+
+        virtual common::uint32_t HandleInterrupt(common::uint32_t esp);
+    };
+}
+
+#endif
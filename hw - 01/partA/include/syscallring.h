@@ -0,0 +1,92 @@
+#ifndef __MYOS__SYSCALLRING_H
+#define __MYOS__SYSCALLRING_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    struct SyscallRequest
+    {
+        common::uint32_t number;
+        common::uint32_t arguments[3];
+        common::uint32_t userData; // handed back with the completion
+    };
+
+    struct SyscallCompletion
+    {
+        int result;
+        common::uint32_t userData;
+    };
+
+    // Submission and completion queues a task shares with the kernel, in
+    // the task's own memory. The task fills requests and moves
+    // submitTail, the kernel moves submitHead as it consumes them. The
+    // kernel fills completions and moves completeTail, the task moves
+    // completeHead as it reaps them. Indices run freely and are masked.
+    struct SyscallRing
+    {
+        static const common::uint32_t ENTRIES = 64; // power of two
+
+        // Ask the kernel to run queued requests on every timer tick, so
+        // the task need not trap at all
+        static const common::uint32_t KERNEL_POLL = 1;
+
+        volatile common::uint32_t submitHead;
+        volatile common::uint32_t submitTail;
+        volatile common::uint32_t completeHead;
+        volatile common::uint32_t completeTail;
+        volatile common::uint32_t flags;
+
+        SyscallRequest requests[ENTRIES];
+        SyscallCompletion completions[ENTRIES];
+
+        void Initialize(common::uint32_t flags)
+        {
+            submitHead = submitTail = 0;
+            completeHead = completeTail = 0;
+            this->flags = flags;
+        }
+
+        // Task side. Submit fails while the queue is full.
+        bool Submit(common::uint32_t number, common::uint32_t argument1, common::uint32_t argument2,
+            common::uint32_t argument3, common::uint32_t userData)
+        {
+            if (submitTail - submitHead == ENTRIES)
+                return false;
+            SyscallRequest* request = &requests[submitTail & (ENTRIES - 1)];
+            request->number = number;
+            request->arguments[0] = argument1;
+            request->arguments[1] = argument2;
+            request->arguments[2] = argument3;
+            request->userData = userData;
+            asm volatile("" : : : "memory"); // publish the request before the index
+            submitTail = submitTail + 1;
+            return true;
+        }
+
+        bool Reap(SyscallCompletion* completion)
+        {
+            if (completeHead == completeTail)
+                return false;
+            *completion = completions[completeHead & (ENTRIES - 1)];
+            completeHead = completeHead + 1;
+            return true;
+        }
+
+        common::uint32_t Pending() { return submitTail - submitHead; }
+
+        // Kernel side
+        bool CompletionFull() { return completeTail - completeHead >= ENTRIES; }
+
+        void Complete(common::uint32_t userData, int result)
+        {
+            SyscallCompletion* completion = &completions[completeTail & (ENTRIES - 1)];
+            completion->result = result;
+            completion->userData = userData;
+            asm volatile("" : : : "memory");
+            completeTail = completeTail + 1;
+        }
+    };
+}
+
+#endif
@@ -2,26 +2,180 @@
 #define __MYOS__SYSCALLS_H
 
 #include <common/types.h>
+#include <gdt.h>
 #include <hardwarecommunication/interrupts.h>
 #include <multitasking.h>
 
 namespace myos
 {
+    enum SyscallNumber
+    {
+        SYS_NULL = 0, // does nothing, for measuring the entry cost
+        SYS_FORK = 1,
+        SYS_WAITPID = 2,
+        SYS_EXECVE = 3,
+        SYS_WRITE = 4,      // ebx is the text, esi its length
+        SYS_EXIT = 5,
+        SYS_SLEEP = 6,
+        SYS_STATS = 7,
+        SYS_RING_SETUP = 8, // ebx is the task's SyscallRing, esi its size
+        SYS_RING_ENTER = 9, // runs the queued requests, returns how many
+        SYS_WRITEV = 10,    // ebx is an array of esi IoVectors
+        SYS_ALLOC = 11      // ebx bytes that live until the task is reaped
+    };
+
+    // What the kernel checks before a handler runs
+    enum SyscallFlags
+    {
+        SYSCALL_STRING_ARGUMENT = 1, // ebx is a string the caller may read
+        SYSCALL_OUTPUT_BUFFER = 2,   // ebx is a buffer of esi bytes the caller may write
+        SYSCALL_BLOCKING = 4,        // may take the caller off the CPU
+        SYSCALL_NOT_IN_RING = 8,     // only as a direct call
+        SYSCALL_INPUT_BUFFER = 16,   // ebx is a buffer of esi bytes the caller may read
+        SYSCALL_INPUT_VECTOR = 32    // ebx is an array of esi IoVectors the caller may read
+    };
+
+    struct IoVector
+    {
+        const char* base;
+        common::uint32_t length;
+    };
+
+    // Output of the code running in a task collects here until a newline
+    // or a full buffer, then goes out with one write. It lives in the
+    // task's local page, so every task has its own.
+    struct LineBuffer
+    {
+        static const common::uint32_t SIZE = 256;
+        common::uint32_t length;
+        char data[SIZE];
+    };
+
+    // The task's page at AddressSpace::TASK_LOCAL_BASE. Kernel data is
+    // closed to ring 3, so what the code in the task needs to know of the
+    // kernel is copied here when the task is added; forked children
+    // inherit it with the page.
+    struct TaskLocalPage
+    {
+        LineBuffer lineBuffer;
+        bool fastSyscalls;                   // sysenter is set up
+        common::uint32_t timestampFrequency; // cycles per second, 0 if unknown
+    };
+
+    // Returned in eax when the arguments fail the checks or the number is
+    // not registered
+    static const int SYSCALL_FAULT = -1;
+
+    // One entry per registered system call, as copied out by SYS_STATS
+    struct SyscallStats
+    {
+        const char* name;
+        common::uint32_t number;
+        common::uint32_t calls;
+        common::uint32_t rejected;
+        common::uint64_t cycles; // spent in the handler
+    } __attribute__((packed));
+
+    // System calls arrive either through int 0x80 or through sysenter.
+    // Both take the number in eax and up to three arguments in ebx, esi
+    // and edi, and return the result in eax. Sysenter also uses ecx and
+    // edx for the return stack and address, so the caller loses them.
     class SyscallHandler : public hardwarecommunication::InterruptHandler
     {
+    public:
+        static const int MAX_SYSCALLS = 32;
+        static const common::uint32_t MAX_STRING_LENGTH = 4096;
+        static const common::uint32_t MAX_IO_VECTORS = 64;
+
+        typedef void (*Syscall)(TaskManager* taskManager, CPUState* cpu);
+
     private:
+        struct SyscallEntry
+        {
+            Syscall handler;
+            const char* name;
+            common::uint8_t argumentCount;
+            common::uint32_t flags;
+            common::uint32_t calls;
+            common::uint32_t rejected;
+            common::uint64_t cycles;
+        };
+
         TaskManager* taskManager;
+        SyscallEntry syscallTable[MAX_SYSCALLS];
+
+        bool CheckArguments(SyscallEntry* entry, CPUState* cpu);
+        void Invoke(common::uint32_t number, CPUState* cpu);
+        common::uint32_t ProcessRing(SyscallRing* ring, CPUState* frame);
+
+        static void SysNull(TaskManager* taskManager, CPUState* cpu);
+        static void SysFork(TaskManager* taskManager, CPUState* cpu);
+        static void SysWaitpid(TaskManager* taskManager, CPUState* cpu);
+        static void SysExecve(TaskManager* taskManager, CPUState* cpu);
+        static void SysWrite(TaskManager* taskManager, CPUState* cpu);
+        static void SysWritev(TaskManager* taskManager, CPUState* cpu);
+        static void SysExit(TaskManager* taskManager, CPUState* cpu);
+        static void SysSleep(TaskManager* taskManager, CPUState* cpu);
+        static void SysStats(TaskManager* taskManager, CPUState* cpu);
+        static void SysRingSetup(TaskManager* taskManager, CPUState* cpu);
+        static void SysRingEnter(TaskManager* taskManager, CPUState* cpu);
+        static void SysAlloc(TaskManager* taskManager, CPUState* cpu);
+
+        // Entry point in interruptstubs.s. It builds the same frame as an
+        // interrupt from ring 3 and calls HandleSysenter.
+        static void SysenterEntry();
 
     public:
+        static SyscallHandler* activeSyscallHandler;
+        static bool fastSyscalls; // sysenter is set up; copied to the tasks' local pages
+        // Taken from the GDT for the frame SysenterEntry builds
+        static common::uint32_t userCodeSelector;
+        static common::uint32_t userDataSelector;
+
         SyscallHandler(hardwarecommunication::InterruptManager* interruptManager, myos::common::uint8_t InterruptNumber, TaskManager* taskManager);
         ~SyscallHandler();
-        
+
+        bool Register(common::uint32_t number, Syscall handler, const char* name,
+            common::uint8_t argumentCount, common::uint32_t flags);
+
+        // Needs the GDT layout sysexit expects: user code 16 bytes and
+        // user data 24 bytes behind the kernel code segment
+        bool EnableFastSyscalls(GlobalDescriptorTable* gdt);
+
+        // Runs the current task's queued requests if it asked for polling.
+        // Called on every timer tick.
+        void PollRing();
+
+        myos::common::uint32_t Dispatch(myos::common::uint32_t esp);
         virtual myos::common::uint32_t HandleInterrupt(myos::common::uint32_t esp);
+        static myos::common::uint32_t HandleSysenter(myos::common::uint32_t esp);
     };
 }
 
+// Enter through sysenter when it is available, through int 0x80 otherwise
+extern "C" int syscall(int number, int argument1, int argument2 = 0, int argument3 = 0);
+extern "C" int syscall_int80(int number, int argument1, int argument2 = 0, int argument3 = 0);
+extern "C" int syscall_sysenter(int number, int argument1, int argument2 = 0, int argument3 = 0);
+
 extern "C" int syscall_fork();
-extern "C" void syscall_exit();
-extern "C" void syscall_waitpid(int pid);
+extern "C" void syscall_exit(int status);
+extern "C" int syscall_waitpid(int pid);
+extern "C" void syscall_sleep(int milliseconds);
+extern "C" int syscall_write(const char* text, myos::common::uint32_t length);
+extern "C" int syscall_writev(const myos::IoVector* vectors, int count);
+// Memory that is never freed on its own, only with the task; 0 if none is left
+extern "C" void* syscall_alloc(myos::common::uint32_t size);
+
+// The calling task's local page; 0 in ring 0, where there is none
+extern "C" myos::TaskLocalPage* task_local();
+
+// Buffered output through the task's line buffer. Tasks running in ring 0
+// have none and write straight through.
+extern "C" void console_write(const char* text);
+extern "C" void console_flush();
+// Fills stats with up to count entries and returns how many it wrote
+extern "C" int syscall_stats(myos::SyscallStats* stats, int count);
+extern "C" int syscall_ring_setup(myos::SyscallRing* ring, myos::common::uint32_t flags);
+extern "C" int syscall_ring_enter();
 
 #endif
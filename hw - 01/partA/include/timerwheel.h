@@ -0,0 +1,73 @@
+#ifndef __MYOS__TIMERWHEEL_H
+#define __MYOS__TIMERWHEEL_H
+
+#include <common/types.h>
+
+namespace myos
+{
+    struct Timer
+    {
+        Timer* next;
+        Timer* prev;
+        Timer** list; // head of the list the timer is on, 0 if not pending
+        common::uint32_t expires; // in ticks
+        void (*callback)(void* data);
+        void* data;
+
+        Timer() : next(0), prev(0), list(0), expires(0), callback(0), data(0) {}
+        bool Pending() { return list != 0; }
+    };
+
+    // Hierarchical timing wheel in the style of the classic Unix callout
+    // wheel: four levels of 64 slots, each level 64 times coarser than the
+    // one below. Adding and cancelling a timer is O(1), and each tick runs
+    // one slot plus, every 64 ticks, re-sorts one slot of a coarser level.
+    class TimerWheel
+    {
+    public:
+        static const int LEVELS = 4;
+        static const int SLOT_BITS = 6;
+        static const int SLOTS = 1 << SLOT_BITS;
+        static const common::uint32_t SLOT_MASK = SLOTS - 1;
+
+    protected:
+        Timer* slots[LEVELS][SLOTS];
+        common::uint32_t nextTick; // the next tick Advance will process
+        common::uint32_t pending;
+        common::uint32_t frequency; // ticks per second
+        common::uint32_t expired;
+
+        void Insert(Timer* timer);
+        static void Link(Timer** list, Timer* timer);
+        static void Unlink(Timer* timer);
+        int Cascade(int level, int index);
+
+    public:
+        static TimerWheel* activeTimerWheel;
+
+        TimerWheel(common::uint32_t frequency);
+        ~TimerWheel();
+
+        // Fire the callback once at least the given number of whole ticks
+        // have passed; with 0, on the next tick. Adding a pending timer
+        // moves it.
+        void Add(Timer* timer, common::uint32_t ticks);
+        bool Cancel(Timer* timer);
+
+        // Run every timer due up to and including tick now
+        void Advance(common::uint32_t now);
+
+        // The tick Advance has to run by next: the first timer due on the
+        // finest level, or the next cascade of a coarser one. NO_TIMER
+        // when nothing is pending.
+        static const common::uint32_t NO_TIMER = 0xFFFFFFFF;
+        common::uint32_t NextTick();
+
+        void SetFrequency(common::uint32_t frequency) { this->frequency = frequency; }
+        common::uint32_t TicksForMilliseconds(common::uint32_t milliseconds);
+        common::uint32_t Pending() { return pending; }
+        common::uint32_t Expired() { return expired; }
+    };
+}
+
+#endif
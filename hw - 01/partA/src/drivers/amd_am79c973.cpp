@@ -1,5 +1,8 @@
 
 #include <drivers/amd_am79c973.h>
+#include <memorymanagement.h>
+#include <pageframeallocator.h>
+#include <kernellog.h>
 using namespace myos;
 using namespace myos::common;
 using namespace myos::drivers;
@@ -54,20 +57,27 @@ amd_am79c973::amd_am79c973(PeripheralComponentInterconnectDeviceDescriptor *dev,
     initBlock.reserved3 = 0;
     initBlock.logicalAddress = 0;
     
-    sendBufferDescr = (BufferDescriptor*)((((uint32_t)&sendBufferDescrMemory[0]) + 15) & ~((uint32_t)0xF));
+    // The descriptor rings have to be 16-byte aligned
+    sendBufferDescr = (BufferDescriptor*)MemoryManager::activeMemoryManager->malloc_aligned(8 * sizeof(BufferDescriptor), 16);
     initBlock.sendBufferDescrAddress = (uint32_t)sendBufferDescr;
-    recvBufferDescr = (BufferDescriptor*)((((uint32_t)&recvBufferDescrMemory[0]) + 15) & ~((uint32_t)0xF));
+    recvBufferDescr = (BufferDescriptor*)MemoryManager::activeMemoryManager->malloc_aligned(8 * sizeof(BufferDescriptor), 16);
     initBlock.recvBufferDescrAddress = (uint32_t)recvBufferDescr;
     
+    // The card reads and writes the buffers by physical address, so they
+    // come straight from the page frame allocator (page aligned)
+    int bufferOrder = PageFrameAllocator::OrderForSize(8 * 2048);
+    sendBuffers = (uint8_t*)PageFrameAllocator::activePageFrameAllocator->AllocateFrames(bufferOrder);
+    recvBuffers = (uint8_t*)PageFrameAllocator::activePageFrameAllocator->AllocateFrames(bufferOrder);
+    
     for(uint8_t i = 0; i < 8; i++)
     {
-        sendBufferDescr[i].address = (((uint32_t)&sendBuffers[i]) + 15 ) & ~(uint32_t)0xF;
+        sendBufferDescr[i].address = (uint32_t)&sendBuffers[i * 2048];
         sendBufferDescr[i].flags = 0x7FF
                                  | 0xF000;
         sendBufferDescr[i].flags2 = 0;
         sendBufferDescr[i].avail = 0;
         
-        recvBufferDescr[i].address = (((uint32_t)&recvBuffers[i]) + 15 ) & ~(uint32_t)0xF;
+        recvBufferDescr[i].address = (uint32_t)&recvBuffers[i * 2048];
         recvBufferDescr[i].flags = 0xF7FF
                                  | 0x80000000;
         recvBufferDescr[i].flags2 = 0;
@@ -83,6 +93,16 @@ amd_am79c973::amd_am79c973(PeripheralComponentInterconnectDeviceDescriptor *dev,
 
 amd_am79c973::~amd_am79c973()
 {
+    if (MemoryManager::activeMemoryManager != 0)
+    {
+        MemoryManager::activeMemoryManager->free(sendBufferDescr);
+        MemoryManager::activeMemoryManager->free(recvBufferDescr);
+    }
+    if (PageFrameAllocator::activePageFrameAllocator != 0)
+    {
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(sendBuffers);
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(recvBuffers);
+    }
 }
             
 void amd_am79c973::Activate()
@@ -107,28 +127,28 @@ int amd_am79c973::Reset()
 }
 
 
-void printf(char*);
-void printfHex(uint8_t);
+// Runs in interrupt context, so it only queues its messages in the log
+void printk(LogLevel level, char* str);
 
 uint32_t amd_am79c973::HandleInterrupt(common::uint32_t esp)
 {
-    printf("INTERRUPT FROM AMD am79c973\n");
+    printk(LOG_DEBUG, "INTERRUPT FROM AMD am79c973\n");
     
     registerAddressPort.Write(0);
     uint32_t temp = registerDataPort.Read();
     
-    if((temp & 0x8000) == 0x8000) printf("AMD am79c973 ERROR\n");
-    if((temp & 0x2000) == 0x2000) printf("AMD am79c973 COLLISION ERROR\n");
-    if((temp & 0x1000) == 0x1000) printf("AMD am79c973 MISSED FRAME\n");
-    if((temp & 0x0800) == 0x0800) printf("AMD am79c973 MEMORY ERROR\n");
+    if((temp & 0x8000) == 0x8000) printk(LOG_WARNING, "AMD am79c973 ERROR\n");
+    if((temp & 0x2000) == 0x2000) printk(LOG_WARNING, "AMD am79c973 COLLISION ERROR\n");
+    if((temp & 0x1000) == 0x1000) printk(LOG_WARNING, "AMD am79c973 MISSED FRAME\n");
+    if((temp & 0x0800) == 0x0800) printk(LOG_WARNING, "AMD am79c973 MEMORY ERROR\n");
     if((temp & 0x0400) == 0x0400) Receive();
-    if((temp & 0x0200) == 0x0200) printf("AMD am79c973 DATA SENT\n");
+    if((temp & 0x0200) == 0x0200) printk(LOG_DEBUG, "AMD am79c973 DATA SENT\n");
                                
     // acknoledge
     registerAddressPort.Write(0);
     registerDataPort.Write(temp);
     
-    if((temp & 0x0100) == 0x0100) printf("AMD am79c973 INIT DONE\n");
+    if((temp & 0x0100) == 0x0100) printk(LOG_INFO, "AMD am79c973 INIT DONE\n");
     
     return esp;
 }
@@ -157,7 +177,7 @@ void amd_am79c973::Send(uint8_t* buffer, int size)
 
 void amd_am79c973::Receive()
 {
-    printf("AMD am79c973 DATA RECEIVED\n");
+    printk(LOG_DEBUG, "AMD am79c973 DATA RECEIVED\n");
     
     for(; (recvBufferDescr[currentRecvBuffer].flags & 0x80000000) == 0;
         currentRecvBuffer = (currentRecvBuffer + 1) % 8)
@@ -172,10 +192,22 @@ void amd_am79c973::Receive()
             
             uint8_t* buffer = (uint8_t*)(recvBufferDescr[currentRecvBuffer].address);
             
+            // Dumped 16 bytes to a log line
+            const char* hex = "0123456789ABCDEF";
+            char line[16 * 3 + 2];
+            int length = 0;
             for(int i = 0; i < size; i++)
             {
-                printfHex(buffer[i]);
-                printf(" ");
+                line[length++] = hex[(buffer[i] >> 4) & 0xF];
+                line[length++] = hex[buffer[i] & 0xF];
+                line[length++] = ' ';
+                if(i % 16 == 15 || i == size - 1)
+                {
+                    line[length++] = '\n';
+                    line[length] = '\0';
+                    printk(LOG_DEBUG, line);
+                    length = 0;
+                }
             }
         }
         
@@ -1,4 +1,8 @@
 #include <drivers/ata.h>
+#include <drivers/timer.h>
+#include <kernellog.h>
+#include <paging.h>
+#include <common/cpu.h>
 
 using namespace myos;
 using namespace myos::common;
@@ -6,6 +10,8 @@ using namespace myos::drivers;
 
 
 void printf(char* str);
+void printk(LogLevel level, char* str);
+void sprintf(char* str, const char* format, ...);
 void printfHex(uint8_t);
 
 AdvancedTechnologyAttachment::AdvancedTechnologyAttachment(bool master, common::uint16_t portBase)
@@ -20,13 +26,53 @@ AdvancedTechnologyAttachment::AdvancedTechnologyAttachment(bool master, common::
     controlPort(portBase + 0x206)
 {
     this->master = master;
+    present = false;
+    lba48 = false;
+    dmaCapable = false;
+    dma = 0;
+    sectors = 0;
+    model[0] = '\0';
+    sectorsPerBlock = 1;
 }
 
 AdvancedTechnologyAttachment::~AdvancedTechnologyAttachment()
 {
 }
+
+// Poll until the drive is no longer busy or reports an error. A drive
+// that stays busy past TIMEOUT_MS is reported as an error rather than
+// hanging the caller. The deadline is kept on the TSC, so it also holds
+// with interrupts off; before the timer exists, a status read taking
+// about a microsecond on the ISA bus, their number bounds the wait.
+uint8_t AdvancedTechnologyAttachment::WaitWhileBusy(uint8_t status)
+{
+    TimerDriver* timer = TimerDriver::activeTimer;
+    uint64_t deadline = timer != 0 ? timer->Deadline(TIMEOUT_MS) : 0;
+    uint32_t reads = 0;
+    while(((status & 0x80) == 0x80)
+       && ((status & 0x01) != 0x01))
+    {
+        if(timer != 0 ? timer->Expired(deadline) : ++reads > TIMEOUT_MS * 1000)
+        {
+            printf("ATA TIMEOUT ");
+            return 0x01;
+        }
+        status = commandPort.Read();
+    }
+    return status;
+}
             
-void AdvancedTechnologyAttachment::Identify()
+// Wait for the drive to ask for the next block of data. The alternate
+// status reads give it the 400 ns it needs to update the status.
+bool AdvancedTechnologyAttachment::WaitForData()
+{
+    for(int i = 0; i < 4; i++)
+        controlPort.Read();
+    uint8_t status = WaitWhileBusy(commandPort.Read());
+    return (status & 0x09) == 0x08; // DRQ without ERR
+}
+
+bool AdvancedTechnologyAttachment::Identify()
 {
     devicePort.Write(master ? 0xA0 : 0xB0);
     controlPort.Write(0);
@@ -34,7 +80,7 @@ void AdvancedTechnologyAttachment::Identify()
     devicePort.Write(0xA0);
     uint8_t status = commandPort.Read();
     if(status == 0xFF)
-        return;
+        return false;
     
     
     devicePort.Write(master ? 0xA0 : 0xB0);
@@ -47,27 +93,228 @@ void AdvancedTechnologyAttachment::Identify()
     
     status = commandPort.Read();
     if(status == 0x00)
-        return;
+        return false;
     
-    while(((status & 0x80) == 0x80)
-       && ((status & 0x01) != 0x01))
-        status = commandPort.Read();
+    status = WaitWhileBusy(status);
         
     if(status & 0x01)
     {
         printf("ERROR");
-        return;
+        return false;
     }
     
-    for(int i = 0; i < 256; i++)
+    uint16_t data[256];
+    dataPort.ReadString(data, 256);
+    present = true;
+
+    // Words 27 to 46 are the model, two characters a word, high byte
+    // first, padded with spaces
+    for(int i = 0; i < 20; i++)
     {
-        uint16_t data = dataPort.Read();
-        char *text = "  \0";
-        text[0] = (data >> 8) & 0xFF;
-        text[1] = data & 0xFF;
-        printf(text);
+        model[2 * i] = (data[27 + i] >> 8) & 0xFF;
+        model[2 * i + 1] = data[27 + i] & 0xFF;
     }
+    int length = 40;
+    while(length > 0 && model[length - 1] == ' ')
+        length--;
+    model[length] = '\0';
+
+    // Word 83 bit 10: the 48-bit feature set, with the size in words 100
+    // to 103. Otherwise the size is the 28-bit one in words 60 and 61.
+    lba48 = (data[83] & (1 << 10)) != 0;
+    dmaCapable = (data[49] & (1 << 8)) != 0;
+    if(lba48)
+        sectors = (uint64_t)data[100] | ((uint64_t)data[101] << 16)
+                | ((uint64_t)data[102] << 32) | ((uint64_t)data[103] << 48);
+    else
+        sectors = (uint32_t)data[60] | ((uint32_t)data[61] << 16);
+
+    char text[32];
+    printf(model);
+    sprintf(text, ", %d MiB", (uint32_t)(sectors >> 11));
+    printf(text);
+    if(lba48)
+        printf(", LBA48");
+    if(dmaCapable)
+        printf(", DMA");
     printf("\n");
+
+    // Word 47 is the most sectors READ/WRITE MULTIPLE may move per data
+    // request; the drive only uses it after SET MULTIPLE MODE
+    uint8_t maxSectors = data[47] & 0xFF;
+    sectorsPerBlock = 1;
+    if(maxSectors > 1)
+    {
+        devicePort.Write(master ? 0xA0 : 0xB0);
+        sectorCountPort.Write(maxSectors);
+        commandPort.Write(0xC6);
+        status = WaitWhileBusy(commandPort.Read());
+        if(!(status & 0x01))
+            sectorsPerBlock = maxSectors;
+    }
+    return true;
+}
+
+// Drive, first sector and sector count of the next command. A count of
+// 256, or 65536 for an extended command, is written as 0. The extended
+// registers are two deep: the high bytes go in first.
+void AdvancedTechnologyAttachment::SelectSectors(uint64_t lba, uint32_t count, bool extended)
+{
+    if(extended)
+    {
+        devicePort.Write(master ? 0x40 : 0x50);
+        errorPort.Write(0);
+        sectorCountPort.Write((count >> 8) & 0xFF);
+        lbaLowPort.Write((lba >> 24) & 0xFF);
+        lbaMidPort.Write((lba >> 32) & 0xFF);
+        lbaHiPort.Write((lba >> 40) & 0xFF);
+    }
+    else
+    {
+        devicePort.Write( (master ? 0xE0 : 0xF0) | ((lba & 0x0F000000) >> 24) );
+    }
+    errorPort.Write(0);
+    sectorCountPort.Write(count & 0xFF);
+    lbaLowPort.Write(  lba & 0x000000FF );
+    lbaMidPort.Write( (lba & 0x0000FF00) >> 8 );
+    lbaHiPort.Write( (lba & 0x00FF0000) >> 16 );
+}
+
+// Up to 256 sectors per command, or 65536 with LBA48. The 28-bit
+// commands are used where they reach, since they take fewer port writes.
+// Every data request moves a block of sectorsPerBlock sectors, or what is
+// left of the command, with a single rep insw or rep outsw.
+bool AdvancedTechnologyAttachment::Transfer(uint64_t lba, uint32_t count, uint8_t* buffer, bool write)
+{
+    // Unidentified drives are taken to be as large as the addressing
+    uint64_t limit = sectors != 0 ? sectors : (lba48 ? (1ULL << 48) : (1ULL << 28));
+    if(lba > limit || count > limit - lba)
+        return false;
+
+    // The engine sees physical addresses, which only the identity map
+    // has one to one
+    bool useDMA = dma != 0 && AddressSpace::IsIdentityMapped((uint32_t)buffer, (uint64_t)count * SECTOR_SIZE);
+    if(!useDMA)
+        controlPort.Write(0x02); // polled, so the drive need not raise IRQ 14
+
+    bool multiple = sectorsPerBlock > 1;
+    while(count > 0)
+    {
+        uint32_t maximum = lba48 ? MAX_SECTORS_48 : MAX_SECTORS_28;
+        if(useDMA && maximum > BusMasterIDE::MAX_SECTORS)
+            maximum = BusMasterIDE::MAX_SECTORS;
+        uint32_t commandSectors = count < maximum ? count : maximum;
+        bool extended = commandSectors > MAX_SECTORS_28 || lba + commandSectors > (1ULL << 28);
+        if(WaitWhileBusy(commandPort.Read()) & 0x01)
+            break;
+
+        if(useDMA)
+        {
+            if(!TransferDMA(lba, commandSectors, buffer, write))
+            {
+                printk(LOG_WARNING, "ATA DMA ERROR\n");
+                return false;
+            }
+            buffer += commandSectors * SECTOR_SIZE;
+        }
+        else
+        {
+            SelectSectors(lba, commandSectors, extended);
+            if(write)
+                commandPort.Write(extended ? (multiple ? 0x39 : 0x34) : (multiple ? 0xC5 : 0x30));
+            else
+                commandPort.Write(extended ? (multiple ? 0x29 : 0x24) : (multiple ? 0xC4 : 0x20));
+
+            for(uint32_t done = 0; done < commandSectors; )
+            {
+                uint32_t block = commandSectors - done < sectorsPerBlock ? commandSectors - done : sectorsPerBlock;
+                if(!WaitForData())
+                {
+                    printk(LOG_WARNING, "ATA ERROR\n");
+                    return false;
+                }
+                if(write)
+                    dataPort.WriteString((const uint16_t*)buffer, block * SECTOR_SIZE / 2);
+                else
+                    dataPort.ReadString((uint16_t*)buffer, block * SECTOR_SIZE / 2);
+                buffer += block * SECTOR_SIZE;
+                done += block;
+            }
+        }
+
+        lba += commandSectors;
+        count -= commandSectors;
+    }
+
+    // The last block is only on the disk once the drive is no longer busy
+    uint8_t status = WaitWhileBusy(commandPort.Read());
+    if(count > 0 || (status & 0x01))
+    {
+        printk(LOG_WARNING, "ATA ERROR\n");
+        return false;
+    }
+    return true;
+}
+
+// The interrupt that ends the transfer cannot come before Wait waits for
+// it, since interrupts are off until then
+bool AdvancedTechnologyAttachment::TransferDMA(uint64_t lba, uint32_t count, uint8_t* buffer, bool write)
+{
+    if(!dma->Prepare(buffer, count * SECTOR_SIZE, write))
+        return false;
+
+    uint32_t flags = DisableInterrupts();
+    bool succeeded = StartDMA(lba, count, write, 0) && dma->Wait((flags & 0x200) != 0);
+    RestoreInterrupts(flags);
+    return succeeded;
+}
+
+// The drive takes its command first, then the engine is started
+bool AdvancedTechnologyAttachment::StartDMA(uint64_t lba, uint32_t count, bool write, BusMasterIDEEventHandler* handler)
+{
+    if(dma == 0 || count == 0 || count > BusMasterIDE::MAX_SECTORS)
+        return false;
+    if(WaitWhileBusy(commandPort.Read()) & 0x01)
+        return false;
+
+    bool extended = count > MAX_SECTORS_28 || lba + count > (1ULL << 28);
+    controlPort.Write(0x00); // completion by IRQ
+    SelectSectors(lba, count, extended);
+    if(write)
+        commandPort.Write(extended ? 0x35 : 0xCA);
+    else
+        commandPort.Write(extended ? 0x25 : 0xC8);
+    dma->Start(handler);
+    return true;
+}
+
+bool AdvancedTechnologyAttachment::StartFlush(BusMasterIDEEventHandler* handler)
+{
+    if(dma == 0)
+        return false;
+    if(WaitWhileBusy(commandPort.Read()) & 0x01)
+        return false;
+
+    controlPort.Write(0x00); // completion by IRQ
+    dma->Expect(handler);
+    devicePort.Write( master ? 0xE0 : 0xF0 );
+    commandPort.Write(lba48 ? 0xEA : 0xE7);
+    return true;
+}
+
+void AdvancedTechnologyAttachment::SetDMA(BusMasterIDE* dma)
+{
+    this->dma = (dma != 0 && dma->Present() && dmaCapable) ? dma : 0;
+}
+
+bool AdvancedTechnologyAttachment::ReadSectors(uint64_t lba, uint32_t count, uint8_t* buffer)
+{
+    return Transfer(lba, count, buffer, false);
+}
+
+bool AdvancedTechnologyAttachment::WriteSectors(uint64_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return Transfer(lba, count, (uint8_t*)buffer, true);
 }
 
 void AdvancedTechnologyAttachment::Read28(common::uint32_t sectorNum, int count)
@@ -75,18 +322,11 @@ void AdvancedTechnologyAttachment::Read28(common::uint32_t sectorNum, int count)
     if(sectorNum > 0x0FFFFFFF)
         return;
     
-    devicePort.Write( (master ? 0xE0 : 0xF0) | ((sectorNum & 0x0F000000) >> 24) );
-    errorPort.Write(0);
-    sectorCountPort.Write(1);
-    lbaLowPort.Write(  sectorNum & 0x000000FF );
-    lbaMidPort.Write( (sectorNum & 0x0000FF00) >> 8);
-    lbaLowPort.Write( (sectorNum & 0x00FF0000) >> 16 );
+    SelectSectors(sectorNum, 1, false);
     commandPort.Write(0x20);
     
     uint8_t status = commandPort.Read();
-    while(((status & 0x80) == 0x80)
-       && ((status & 0x01) != 0x01))
-        status = commandPort.Read();
+    status = WaitWhileBusy(status);
         
     if(status & 0x01)
     {
@@ -101,7 +341,7 @@ void AdvancedTechnologyAttachment::Read28(common::uint32_t sectorNum, int count)
     {
         uint16_t wdata = dataPort.Read();
         
-        char *text = "  \0";
+        char text[] = "  ";
         text[0] = wdata & 0xFF;
         
         if(i+1 < count)
@@ -124,52 +364,47 @@ void AdvancedTechnologyAttachment::Write28(common::uint32_t sectorNum, common::u
         return;
     
     
-    devicePort.Write( (master ? 0xE0 : 0xF0) | ((sectorNum & 0x0F000000) >> 24) );
-    errorPort.Write(0);
-    sectorCountPort.Write(1);
-    lbaLowPort.Write(  sectorNum & 0x000000FF );
-    lbaMidPort.Write( (sectorNum & 0x0000FF00) >> 8);
-    lbaLowPort.Write( (sectorNum & 0x00FF0000) >> 16 );
+    SelectSectors(sectorNum, 1, false);
     commandPort.Write(0x30);
     
     
     printf("Writing to ATA Drive: ");
 
-    for(int i = 0; i < count; i += 2)
+    for(uint32_t i = 0; i < count; i += 2)
     {
         uint16_t wdata = data[i];
         if(i+1 < count)
             wdata |= ((uint16_t)data[i+1]) << 8;
         dataPort.Write(wdata);
         
-        char *text = "  \0";
+        char text[] = "  ";
         text[0] = (wdata >> 8) & 0xFF;
         text[1] = wdata & 0xFF;
         printf(text);
     }
     
-    for(int i = count + (count%2); i < 512; i += 2)
+    for(uint32_t i = count + (count%2); i < 512; i += 2)
         dataPort.Write(0x0000);
 
 }
 
-void AdvancedTechnologyAttachment::Flush()
+bool AdvancedTechnologyAttachment::Flush()
 {
+    // FLUSH CACHE EXT on drives that have it
     devicePort.Write( master ? 0xE0 : 0xF0 );
-    commandPort.Write(0xE7);
+    commandPort.Write(lba48 ? 0xEA : 0xE7);
 
     uint8_t status = commandPort.Read();
     if(status == 0x00)
-        return;
+        return false;
     
-    while(((status & 0x80) == 0x80)
-       && ((status & 0x01) != 0x01))
-        status = commandPort.Read();
+    status = WaitWhileBusy(status);
         
     if(status & 0x01)
     {
         printf("ERROR");
-        return;
+        return false;
     }
+    return true;
 }
             
\ No newline at end of file
@@ -0,0 +1,310 @@
+#include <drivers/blockqueue.h>
+#include <paging.h>
+#include <common/cpu.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::drivers;
+
+BlockQueue::BlockQueue(AdvancedTechnologyAttachment* drive)
+{
+    this->drive = drive;
+    pending = 0;
+    flushes = 0;
+    active = 0;
+    headPosition = 0;
+    servicing = false;
+    serving = false;
+    server = 0;
+    submitted = 0;
+    commands = 0;
+    merged = 0;
+}
+
+BlockQueue::~BlockQueue()
+{
+}
+
+// With the most requests merged, each can take two descriptors for its
+// ends besides one per 64 KiB, which still fits the engine's table
+uint32_t BlockQueue::MaxSectors()
+{
+    uint32_t maximum = drive->SupportsLBA48()
+        ? AdvancedTechnologyAttachment::MAX_SECTORS_48 : AdvancedTechnologyAttachment::MAX_SECTORS_28;
+    if (drive->DMA() != 0 && maximum > BusMasterIDE::MAX_SECTORS)
+        maximum = BusMasterIDE::MAX_SECTORS;
+    return maximum;
+}
+
+bool BlockQueue::Submit(BlockRequest* request)
+{
+    // The DMA engine needs the buffer identity mapped; PIO runs in the
+    // serving task, which shares only the kernel half with the submitter
+    uint64_t size = (uint64_t)request->count * AdvancedTechnologyAttachment::SECTOR_SIZE;
+    bool reachable = drive->DMA() != 0
+        ? AddressSpace::IsIdentityMapped((uint32_t)request->buffer, size)
+        : (uint32_t)request->buffer + size <= AddressSpace::KERNEL_SPACE_END;
+    if (!request->flush && (request->count == 0 || request->count > MaxSectors() || !reachable))
+        return false;
+
+    request->done = false;
+    request->succeeded = false;
+    request->waiter = 0;
+
+    uint32_t flags = DisableInterrupts();
+    submitted++;
+
+    // Flushes in the order they come, transfers behind the requests for
+    // the same or lower sectors
+    BlockRequest** link = &pending;
+    if (request->flush)
+        link = &flushes;
+    while (*link != 0 && (request->flush || (*link)->lba <= request->lba))
+        link = &(*link)->next;
+    request->next = *link;
+    *link = request;
+
+    if (drive->DMA() == 0)
+    {
+        if (server != 0 && TaskManager::activeTaskManager != 0)
+            TaskManager::activeTaskManager->WakeTask(server);
+        server = 0;
+    }
+    else if (active == 0)
+        Dispatch();
+    RestoreInterrupts(flags);
+    return true;
+}
+
+// Take the next transfer off the queue, with interrupts off. The elevator
+// takes the lowest request at or above the head and wraps to the lowest
+// of all when there is none; the requests continuing it in the same
+// direction come along, linked behind it.
+BlockRequest* BlockQueue::NextCommand(uint32_t* sectors)
+{
+    BlockRequest** link = &pending;
+    while (*link != 0 && (*link)->lba < headPosition)
+        link = &(*link)->next;
+    if (*link == 0)
+        link = &pending;
+
+    BlockRequest* first = *link;
+    *link = first->next;
+    first->next = 0;
+
+    BlockRequest* last = first;
+    uint64_t end = first->lba + first->count;
+    uint32_t requests = 1;
+    *sectors = first->count;
+    while (*link != 0 && (*link)->lba == end && (*link)->write == first->write
+        && *sectors + (*link)->count <= MaxSectors() && requests < MAX_MERGE)
+    {
+        BlockRequest* request = *link;
+        *link = request->next;
+        request->next = 0;
+        last->next = request;
+        last = request;
+        end += request->count;
+        *sectors += request->count;
+        requests++;
+        merged++;
+    }
+    headPosition = end;
+    commands++;
+    return first;
+}
+
+// Start the next DMA command, with interrupts off
+void BlockQueue::Dispatch()
+{
+    BusMasterIDE* dma = drive->DMA();
+    while (active == 0 && (pending != 0 || flushes != 0))
+    {
+        // The drive takes the flush between two transfers
+        if (flushes != 0)
+        {
+            active = flushes;
+            flushes = 0;
+            commands++;
+            if (drive->StartFlush(this))
+                return; // OnTransferDone goes on from here
+
+            BlockRequest* requests = active;
+            active = 0;
+            Finish(requests, false);
+            continue;
+        }
+
+        uint32_t sectors;
+        BlockRequest* first = NextCommand(&sectors);
+
+        // One descriptor list for all the buffers, one command
+        dma->Clear();
+        bool described = true;
+        for (BlockRequest* request = first; request != 0 && described; request = request->next)
+            described = dma->Append(request->buffer, request->count * AdvancedTechnologyAttachment::SECTOR_SIZE);
+
+        active = first;
+        if (described && dma->Load(first->write) && drive->StartDMA(first->lba, sectors, first->write, this))
+            return;
+
+        active = 0;
+        Finish(first, false);
+    }
+}
+
+// Work through the queue with PIO, one request at a time. Called with
+// interrupts off; each transfer runs with the caller's flags back. False
+// when another task is at it or there was nothing to do.
+bool BlockQueue::RunPIO(uint32_t flags)
+{
+    if (servicing || (pending == 0 && flushes == 0))
+        return false;
+
+    servicing = true;
+    while (pending != 0 || flushes != 0)
+    {
+        if (flushes != 0)
+        {
+            BlockRequest* requests = flushes;
+            flushes = 0;
+            commands++;
+            RestoreInterrupts(flags);
+            bool succeeded = drive->Flush();
+            DisableInterrupts();
+            Finish(requests, succeeded);
+            continue;
+        }
+
+        uint32_t sectors;
+        BlockRequest* first = NextCommand(&sectors);
+        while (BlockRequest* request = first)
+        {
+            first = request->next;
+            request->next = 0;
+            RestoreInterrupts(flags);
+            bool succeeded = request->write
+                ? drive->WriteSectors(request->lba, request->count, request->buffer)
+                : drive->ReadSectors(request->lba, request->count, request->buffer);
+            DisableInterrupts();
+            Finish(request, succeeded);
+        }
+    }
+    servicing = false;
+    return true;
+}
+
+void BlockQueue::Serve()
+{
+    TaskManager* taskManager = TaskManager::activeTaskManager;
+    uint32_t flags = DisableInterrupts();
+    serving = true;
+    while (true)
+    {
+        if (RunPIO(flags) || taskManager == 0)
+            continue;
+        // Submit wakes it for the next request
+        if (pending == 0 && flushes == 0)
+            server = taskManager->BlockCurrentTask();
+        taskManager->Yield();
+    }
+}
+
+void BlockQueue::Finish(BlockRequest* requests, bool succeeded)
+{
+    while (BlockRequest* request = requests)
+    {
+        requests = request->next;
+        request->next = 0;
+        request->succeeded = succeeded;
+        Task* waiter = request->waiter;
+        request->waiter = 0;
+        request->done = true;
+
+        if (request->callback != 0)
+            request->callback(request, request->data);
+        if (waiter != 0 && TaskManager::activeTaskManager != 0)
+            TaskManager::activeTaskManager->WakeTask(waiter);
+    }
+}
+
+// From the channel's interrupt
+void BlockQueue::OnTransferDone(bool succeeded)
+{
+    BlockRequest* requests = active;
+    active = 0;
+    Finish(requests, succeeded);
+    Dispatch();
+}
+
+bool BlockQueue::Wait(BlockRequest* request)
+{
+    uint32_t flags = DisableInterrupts();
+    BusMasterIDE* dma = drive->DMA();
+    TaskManager* taskManager = TaskManager::activeTaskManager;
+
+    // Without DMA the task serving the queue moves the data while this
+    // one sleeps; without such a task, this one does it
+    while (dma == 0 && !request->done)
+    {
+        if (!serving && RunPIO(flags))
+            continue;
+        if (taskManager == 0)
+            break;
+        if (request->waiter == 0 && !taskManager->IsIdle())
+            request->waiter = taskManager->BlockCurrentTask();
+        taskManager->Yield();
+    }
+
+    // Only one task sleeps on a request; the others let it run until the
+    // request is done
+    while (!request->done && request->waiter != 0 && (flags & 0x200) && taskManager != 0)
+    {
+        RestoreInterrupts(flags);
+        taskManager->Yield();
+        flags = DisableInterrupts();
+    }
+    if (dma != 0)
+        dma->WaitFor(&request->done, &request->waiter, (flags & 0x200) != 0);
+    RestoreInterrupts(flags);
+    return request->succeeded;
+}
+
+bool BlockQueue::Read(uint64_t lba, uint32_t count, uint8_t* buffer)
+{
+    BlockRequest request;
+    request.lba = lba;
+    request.count = count;
+    request.buffer = buffer;
+    request.write = false;
+    request.flush = false;
+    request.callback = 0;
+    request.data = 0;
+    return Submit(&request) && Wait(&request);
+}
+
+bool BlockQueue::Write(uint64_t lba, uint32_t count, uint8_t* buffer)
+{
+    BlockRequest request;
+    request.lba = lba;
+    request.count = count;
+    request.buffer = buffer;
+    request.write = true;
+    request.flush = false;
+    request.callback = 0;
+    request.data = 0;
+    return Submit(&request) && Wait(&request);
+}
+
+bool BlockQueue::Flush()
+{
+    BlockRequest request;
+    request.lba = 0;
+    request.count = 0;
+    request.buffer = 0;
+    request.write = false;
+    request.flush = true;
+    request.callback = 0;
+    request.data = 0;
+    return Submit(&request) && Wait(&request);
+}
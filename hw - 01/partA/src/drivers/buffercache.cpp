@@ -0,0 +1,412 @@
+#include <drivers/buffercache.h>
+#include <pageframeallocator.h>
+#include <common/cpu.h>
+#include <common/string.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::drivers;
+
+BufferCache* BufferCache::activeBufferCache = 0;
+
+BufferCache::BufferCache()
+{
+    activeBufferCache = this;
+    for (uint32_t i = 0; i < HASH_BUCKETS; i++)
+        buckets[i] = 0;
+
+    memory = 0;
+    if (PageFrameAllocator::activePageFrameAllocator != 0)
+        memory = (uint8_t*)PageFrameAllocator::activePageFrameAllocator->AllocateFrames(
+            PageFrameAllocator::OrderForSize(BLOCKS * BLOCK_SIZE));
+
+    // Without memory the list stays empty and every Get fails
+    lruHead = 0;
+    lruTail = 0;
+    for (uint32_t i = 0; memory != 0 && i < BLOCKS; i++)
+    {
+        CachedBlock* block = &blocks[i];
+        block->device = 0;
+        block->block = 0;
+        block->data = memory + i * BLOCK_SIZE;
+        block->references = 0;
+        block->valid = false;
+        block->dirty = false;
+        block->io = false;
+        block->readAhead = false;
+        block->hashNext = 0;
+        block->request.done = true;
+        block->request.waiter = 0;
+
+        block->lruPrev = lruTail;
+        block->lruNext = 0;
+        if (lruTail != 0)
+            lruTail->lruNext = block;
+        else
+            lruHead = block;
+        lruTail = block;
+    }
+
+    streamDevice = 0;
+    streamBlock = 0;
+    streamLength = 0;
+    readAheadNext = 0;
+
+    lookups = 0;
+    hits = 0;
+    readAheads = 0;
+    readAheadHits = 0;
+    writeBacks = 0;
+}
+
+BufferCache::~BufferCache()
+{
+    if (memory != 0 && PageFrameAllocator::activePageFrameAllocator != 0)
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(memory);
+    if (activeBufferCache == this)
+        activeBufferCache = 0;
+}
+
+uint32_t BufferCache::Hash(BlockQueue* device, uint64_t block)
+{
+    uint32_t key = (uint32_t)block ^ (uint32_t)(block >> 32) ^ ((uint32_t)device >> 4);
+    return (key * 2654435761u >> 16) & (HASH_BUCKETS - 1);
+}
+
+// Everything below runs with interrupts off: tasks share the cache, and
+// the completion callbacks run in interrupt context.
+
+CachedBlock* BufferCache::Find(BlockQueue* device, uint64_t number)
+{
+    for (CachedBlock* block = buckets[Hash(device, number)]; block != 0; block = block->hashNext)
+        if (block->device == device && block->block == number)
+            return block;
+    return 0;
+}
+
+void BufferCache::Unhash(CachedBlock* block)
+{
+    if (block->device == 0)
+        return;
+    CachedBlock** link = &buckets[Hash(block->device, block->block)];
+    while (*link != block)
+        link = &(*link)->hashNext;
+    *link = block->hashNext;
+    block->hashNext = 0;
+    block->device = 0;
+}
+
+void BufferCache::Assign(CachedBlock* block, BlockQueue* device, uint64_t number)
+{
+    Unhash(block);
+    block->device = device;
+    block->block = number;
+    block->valid = false;
+    block->dirty = false;
+    block->readAhead = false;
+
+    uint32_t bucket = Hash(device, number);
+    block->hashNext = buckets[bucket];
+    buckets[bucket] = block;
+}
+
+// To the front of the LRU list
+void BufferCache::Touch(CachedBlock* block)
+{
+    if (lruHead == block)
+        return;
+
+    block->lruPrev->lruNext = block->lruNext;
+    if (block->lruNext != 0)
+        block->lruNext->lruPrev = block->lruPrev;
+    else
+        lruTail = block->lruPrev;
+
+    block->lruPrev = 0;
+    block->lruNext = lruHead;
+    lruHead->lruPrev = block;
+    lruHead = block;
+}
+
+// The least recently used clean block, else the least recently used
+// dirty one; blocks pinned or in flight are not taken
+CachedBlock* BufferCache::Evict()
+{
+    CachedBlock* dirty = 0;
+    for (CachedBlock* block = lruTail; block != 0; block = block->lruPrev)
+    {
+        if (block->references != 0 || block->io)
+            continue;
+        if (!block->dirty)
+            return block;
+        if (dirty == 0)
+            dirty = block;
+    }
+    return dirty;
+}
+
+bool BufferCache::StartIO(CachedBlock* block, bool write)
+{
+    BlockRequest* request = &block->request;
+    request->lba = block->block << BLOCK_SHIFT;
+    request->count = BLOCK_SECTORS;
+    request->buffer = block->data;
+    request->write = write;
+    request->flush = false;
+    request->callback = TransferDone;
+    request->data = block;
+
+    // Set first: a command that fails to start ends before Submit returns
+    block->io = true;
+    if (!block->device->Submit(request))
+    {
+        block->io = false;
+        return false;
+    }
+    if (write)
+        writeBacks++;
+    return true;
+}
+
+void BufferCache::TransferDone(BlockRequest* request, void* data)
+{
+    CachedBlock* block = (CachedBlock*)data;
+    if (request->write)
+    {
+        // A failed write keeps the block dirty for the next write-back
+        if (request->succeeded)
+            block->dirty = false;
+    }
+    else
+        block->valid = request->succeeded;
+    block->io = false;
+}
+
+// Reads the blocks behind the reader's position that are not cached yet.
+// They go out together and merge into few commands. Only clean blocks
+// are given up for them.
+void BufferCache::ReadAhead(BlockQueue* device, uint64_t number)
+{
+    uint64_t first = readAheadNext > number + 1 ? readAheadNext : number + 1;
+    uint64_t end = number + 1 + READAHEAD_BLOCKS;
+    uint64_t blocks = device->Drive()->Sectors() >> BLOCK_SHIFT;
+    if (end > blocks)
+        end = blocks;
+
+    uint64_t next = first;
+    for (; next < end; next++)
+    {
+        if (Find(device, next) != 0)
+            continue;
+        CachedBlock* block = Evict();
+        if (block == 0 || block->dirty)
+            break;
+
+        Assign(block, device, next);
+        block->readAhead = true;
+        Touch(block);
+        if (!StartIO(block, false))
+            break;
+        readAheads++;
+    }
+    if (next > readAheadNext)
+        readAheadNext = next;
+}
+
+CachedBlock* BufferCache::Get(BlockQueue* device, uint64_t number, bool fill)
+{
+    uint32_t flags = DisableInterrupts();
+    lookups++;
+
+    CachedBlock* block = Find(device, number);
+    if (block != 0)
+    {
+        hits++;
+        if (block->readAhead)
+        {
+            readAheadHits++;
+            block->readAhead = false;
+        }
+    }
+    while (block == 0)
+    {
+        CachedBlock* victim = Evict();
+        if (victim == 0)
+        {
+            RestoreInterrupts(flags);
+            return 0;
+        }
+        if (!victim->dirty)
+        {
+            Assign(victim, device, number);
+            block = victim;
+            break;
+        }
+
+        // A dirty block has to reach the disk before its buffer is reused
+        victim->references++;
+        bool written = StartIO(victim, true);
+        RestoreInterrupts(flags);
+        if (written)
+            victim->device->Wait(&victim->request);
+        flags = DisableInterrupts();
+        victim->references--;
+        if (!written || victim->dirty)
+        {
+            RestoreInterrupts(flags);
+            return 0;
+        }
+
+        // Another task may have brought the block in meanwhile
+        block = Find(device, number);
+    }
+
+    block->references++;
+    Touch(block);
+    if (!block->valid && !block->io)
+    {
+        if (fill)
+            StartIO(block, false);
+        else
+            block->valid = true;
+    }
+
+    // Streaming: the block right after the last one read
+    if (fill)
+    {
+        if (device == streamDevice && number == streamBlock + 1)
+            streamLength++;
+        else if (device != streamDevice || number != streamBlock)
+        {
+            streamDevice = device;
+            streamLength = 1;
+            readAheadNext = number + 1;
+        }
+        streamBlock = number;
+        if (streamLength >= READAHEAD_TRIGGER && readAheadNext <= number + READAHEAD_BLOCKS / 2)
+            ReadAhead(device, number);
+    }
+
+    // Pinned, so it stays this block while the task sleeps
+    while (block->io)
+    {
+        RestoreInterrupts(flags);
+        device->Wait(&block->request);
+        flags = DisableInterrupts();
+    }
+    if (!block->valid)
+    {
+        block->references--;
+        block = 0;
+    }
+    RestoreInterrupts(flags);
+    return block;
+}
+
+void BufferCache::Release(CachedBlock* block)
+{
+    uint32_t flags = DisableInterrupts();
+    block->references--;
+    RestoreInterrupts(flags);
+}
+
+void BufferCache::MarkDirty(CachedBlock* block)
+{
+    block->dirty = true;
+}
+
+bool BufferCache::Read(BlockQueue* device, uint64_t lba, uint32_t count, uint8_t* buffer)
+{
+    while (count > 0)
+    {
+        uint32_t offset = (uint32_t)lba & (BLOCK_SECTORS - 1);
+        uint32_t sectors = BLOCK_SECTORS - offset;
+        if (sectors > count)
+            sectors = count;
+
+        CachedBlock* block = Get(device, lba >> BLOCK_SHIFT);
+        if (block == 0)
+            return false;
+        memcpy(buffer, block->data + offset * AdvancedTechnologyAttachment::SECTOR_SIZE,
+            sectors * AdvancedTechnologyAttachment::SECTOR_SIZE);
+        Release(block);
+
+        lba += sectors;
+        count -= sectors;
+        buffer += sectors * AdvancedTechnologyAttachment::SECTOR_SIZE;
+    }
+    return true;
+}
+
+bool BufferCache::Write(BlockQueue* device, uint64_t lba, uint32_t count, uint8_t* buffer)
+{
+    while (count > 0)
+    {
+        uint32_t offset = (uint32_t)lba & (BLOCK_SECTORS - 1);
+        uint32_t sectors = BLOCK_SECTORS - offset;
+        if (sectors > count)
+            sectors = count;
+
+        // A block written whole is not read first
+        CachedBlock* block = Get(device, lba >> BLOCK_SHIFT, sectors < BLOCK_SECTORS);
+        if (block == 0)
+            return false;
+        memcpy(block->data + offset * AdvancedTechnologyAttachment::SECTOR_SIZE, buffer,
+            sectors * AdvancedTechnologyAttachment::SECTOR_SIZE);
+        MarkDirty(block);
+        Release(block);
+
+        lba += sectors;
+        count -= sectors;
+        buffer += sectors * AdvancedTechnologyAttachment::SECTOR_SIZE;
+    }
+    return true;
+}
+
+// Blocks still pinned are being changed and wait for the next round
+uint32_t BufferCache::WriteBack()
+{
+    uint32_t flags = DisableInterrupts();
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < BLOCKS; i++)
+    {
+        CachedBlock* block = &blocks[i];
+        if (block->device != 0 && block->dirty && !block->io && block->references == 0
+            && StartIO(block, true))
+            started++;
+    }
+    RestoreInterrupts(flags);
+    return started;
+}
+
+bool BufferCache::Sync(BlockQueue* device)
+{
+    bool succeeded = true;
+    uint32_t flags = DisableInterrupts();
+    for (uint32_t i = 0; i < BLOCKS; i++)
+    {
+        CachedBlock* block = &blocks[i];
+        if (block->device == device && block->dirty && !block->io && block->references == 0)
+            StartIO(block, true);
+    }
+
+    for (uint32_t i = 0; i < BLOCKS; i++)
+    {
+        CachedBlock* block = &blocks[i];
+        if (block->device != device)
+            continue;
+        block->references++;
+        while (block->io)
+        {
+            RestoreInterrupts(flags);
+            device->Wait(&block->request);
+            flags = DisableInterrupts();
+        }
+        block->references--;
+        if (block->dirty && block->references == 0)
+            succeeded = false;
+    }
+    RestoreInterrupts(flags);
+
+    return device->Flush() && succeeded;
+}
@@ -0,0 +1,196 @@
+#include <drivers/busmasteride.h>
+#include <pageframeallocator.h>
+#include <paging.h>
+#include <common/cpu.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+BusMasterIDEEventHandler::BusMasterIDEEventHandler()
+{
+}
+
+void BusMasterIDEEventHandler::OnTransferDone(bool)
+{
+}
+
+// BAR4 holds the registers of both channels, the secondary's 8 bytes in.
+// Bus mastering is switched on as the controller is found.
+uint16_t BusMasterIDE::FindBase(PeripheralComponentInterconnectController* pci, bool primary)
+{
+    PeripheralComponentInterconnectDeviceDescriptor dev;
+    if (pci == 0 || !pci->FindDevice(0x01, 0x01, &dev))
+        return 0;
+
+    BaseAddressRegister bar = pci->GetBaseAddressRegister(dev.bus, dev.device, dev.function, 4);
+    if (bar.type != InputOutput || bar.address == 0)
+        return 0;
+
+    pci->EnableBusMaster(&dev);
+    return (uint32_t)bar.address + (primary ? 0 : 8);
+}
+
+// Legacy channels: the primary on IRQ 14 with its drives at 0x1F0, the
+// secondary on IRQ 15 at 0x170
+BusMasterIDE::BusMasterIDE(InterruptManager* interruptManager, PeripheralComponentInterconnectController* pci, bool primary)
+: InterruptHandler(interruptManager, interruptManager->HardwareInterruptOffset() + (primary ? 14 : 15)),
+  base(FindBase(pci, primary)),
+  commandPort(base),
+  statusPort(base + 2),
+  tablePort(base + 4),
+  driveStatusPort(primary ? 0x1F7 : 0x177)
+{
+    table = 0;
+    entries = 0;
+    direction = 0;
+    busy = false;
+    done = false;
+    succeeded = false;
+    waiter = 0;
+    handler = 0;
+    transfers = 0;
+    blockedCycles = 0;
+
+    // A page never crosses the 64 KiB boundary the table must not cross
+    if (base != 0 && PageFrameAllocator::activePageFrameAllocator != 0)
+        table = (PhysicalRegionDescriptor*)PageFrameAllocator::activePageFrameAllocator->AllocateFrames(0);
+}
+
+BusMasterIDE::~BusMasterIDE()
+{
+    if (table != 0 && PageFrameAllocator::activePageFrameAllocator != 0)
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(table);
+}
+
+void BusMasterIDE::Clear()
+{
+    entries = 0;
+}
+
+bool BusMasterIDE::Append(uint8_t* buffer, uint32_t size)
+{
+    uint32_t address = (uint32_t)buffer;
+    if (!Present() || size == 0 || (address & 1) || (size & 1)
+        || !AddressSpace::IsIdentityMapped(address, size))
+        return false;
+
+    while (size > 0)
+    {
+        if (entries == PRD_ENTRIES)
+            return false;
+        uint32_t boundary = 0x10000 - (address & 0xFFFF);
+        uint32_t length = size < boundary ? size : boundary;
+        table[entries].address = address;
+        table[entries].byteCount = length & 0xFFFF;
+        table[entries].flags = 0;
+        entries++;
+        address += length;
+        size -= length;
+    }
+    return true;
+}
+
+bool BusMasterIDE::Load(bool write)
+{
+    if (entries == 0)
+        return false;
+    table[entries - 1].flags = 0x8000;
+
+    commandPort.Write(0x00);   // stopped
+    statusPort.Write(0x06);    // clear interrupt and error
+    tablePort.Write((uint32_t)table);
+    direction = write ? 0x00 : 0x08;
+    return true;
+}
+
+bool BusMasterIDE::Prepare(uint8_t* buffer, uint32_t size, bool write)
+{
+    Clear();
+    return Append(buffer, size) && Load(write);
+}
+
+void BusMasterIDE::Start(BusMasterIDEEventHandler* handler)
+{
+    this->handler = handler;
+    busy = true;
+    done = false;
+    transfers++;
+    commandPort.Write(direction | 0x01);
+}
+
+// The engine stays stopped; its interrupt bit follows the drive's IRQ
+// line all the same
+void BusMasterIDE::Expect(BusMasterIDEEventHandler* handler)
+{
+    commandPort.Write(0x00);
+    statusPort.Write(0x06);
+    this->handler = handler;
+    busy = true;
+    done = false;
+}
+
+bool BusMasterIDE::Wait(bool wasEnabled)
+{
+    WaitFor(&done, &waiter, wasEnabled);
+    return succeeded;
+}
+
+void BusMasterIDE::WaitFor(volatile bool* flag, Task** waiter, bool wasEnabled)
+{
+    TaskManager* taskManager = TaskManager::activeTaskManager;
+    while (!*flag)
+    {
+        if (wasEnabled && taskManager != 0 && !taskManager->IsIdle())
+        {
+            // Other tasks run until the interrupt wakes this one
+            uint64_t start = ReadTimestampCounter();
+            *waiter = taskManager->BlockCurrentTask();
+            taskManager->Yield();
+            blockedCycles += ReadTimestampCounter() - start;
+        }
+        else if (wasEnabled)
+        {
+            // The idle task just halts; sti only takes effect after hlt
+            asm volatile("sti; hlt; cli");
+        }
+        else if (busy && (statusPort.Read() & 0x04))
+        {
+            // No interrupts, so the engine is polled
+            Complete();
+        }
+    }
+}
+
+void BusMasterIDE::Complete()
+{
+    uint8_t status = statusPort.Read();
+    commandPort.Write(0x00);
+    uint8_t driveStatus = driveStatusPort.Read();
+    statusPort.Write(0x06);
+
+    // Engine error, or the drive's ERR or DF
+    succeeded = !(status & 0x02) && !(driveStatus & 0x21);
+    busy = false;
+    done = true;
+
+    if (waiter != 0 && TaskManager::activeTaskManager != 0)
+        TaskManager::activeTaskManager->WakeTask(waiter);
+    waiter = 0;
+
+    // May start the next transfer right away
+    BusMasterIDEEventHandler* handler = this->handler;
+    this->handler = 0;
+    if (handler != 0)
+        handler->OnTransferDone(succeeded);
+}
+
+uint32_t BusMasterIDE::HandleInterrupt(uint32_t esp)
+{
+    if (busy && (statusPort.Read() & 0x04))
+        Complete();
+    else
+        driveStatusPort.Read(); // not a transfer of ours, only acknowledge it
+    return esp;
+}
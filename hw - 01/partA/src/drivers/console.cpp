@@ -0,0 +1,106 @@
+#include <drivers/console.h>
+#include <common/string.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::drivers;
+
+Console* Console::activeConsole = 0;
+
+// Starts from what is on the screen and writes at its top left, like
+// the direct video memory writes did
+Console::Console(uint16_t* videoMemory)
+{
+    activeConsole = this;
+    this->videoMemory = videoMemory;
+    memcpy(screen, videoMemory, sizeof(screen));
+    x = 0;
+    y = 0;
+    firstDirty = HEIGHT;
+    lastDirty = -1;
+}
+
+Console::~Console()
+{
+    if (activeConsole == this)
+        activeConsole = 0;
+}
+
+void Console::MarkDirty(int row)
+{
+    if (row < firstDirty)
+        firstDirty = row;
+    if (row > lastDirty)
+        lastDirty = row;
+}
+
+// Move everything up a row and blank the last one
+void Console::Scroll()
+{
+    memmove(screen, screen + WIDTH, (HEIGHT - 1) * WIDTH * sizeof(uint16_t));
+    for (int i = 0; i < WIDTH; i++)
+        screen[(HEIGHT - 1) * WIDTH + i] = ATTRIBUTE | ' ';
+    firstDirty = 0;
+    lastDirty = HEIGHT - 1;
+}
+
+void Console::NewLine()
+{
+    x = 0;
+    if (y < HEIGHT - 1)
+        y++;
+    else
+        Scroll();
+}
+
+// Copy the changed rows to video memory in one go
+void Console::Update()
+{
+    if (lastDirty < firstDirty)
+        return;
+    memcpy(videoMemory + firstDirty * WIDTH, screen + firstDirty * WIDTH,
+        (lastDirty - firstDirty + 1) * WIDTH * sizeof(uint16_t));
+    firstDirty = HEIGHT;
+    lastDirty = -1;
+}
+
+void Console::Write(const char* text, size_t length)
+{
+    size_t i = 0;
+    while (i < length)
+    {
+        if (text[i] == '\n')
+        {
+            NewLine();
+            i++;
+            continue;
+        }
+
+        // Render up to the next newline or the end of the row
+        uint16_t* cell = screen + y * WIDTH + x;
+        size_t run = 0;
+        while (i + run < length && x + (int)run < WIDTH && text[i + run] != '\n')
+        {
+            cell[run] = ATTRIBUTE | (uint8_t)text[i + run];
+            run++;
+        }
+        MarkDirty(y);
+        x += run;
+        i += run;
+
+        if (x >= WIDTH)
+            NewLine();
+    }
+    Update();
+}
+
+void Console::Clear()
+{
+    for (int i = 0; i < WIDTH * HEIGHT; i++)
+        screen[i] = ATTRIBUTE | ' ';
+    x = 0;
+    y = 0;
+    firstDirty = 0;
+    lastDirty = HEIGHT - 1;
+    Update();
+}
@@ -0,0 +1,47 @@
+#include <drivers/serial.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+SerialPort* SerialPort::activeSerialPort = 0;
+
+SerialPort::SerialPort(uint16_t base, uint32_t baudRate)
+: dataPort(base),
+  interruptEnablePort(base + 1),
+  fifoControlPort(base + 2),
+  lineControlPort(base + 3),
+  modemControlPort(base + 4),
+  lineStatusPort(base + 5)
+{
+    activeSerialPort = this;
+
+    uint16_t divisor = 115200 / baudRate;
+    interruptEnablePort.Write(0x00);
+    lineControlPort.Write(0x80);            // divisor latch
+    dataPort.Write(divisor & 0xFF);
+    interruptEnablePort.Write(divisor >> 8);
+    lineControlPort.Write(0x03);            // 8 bits, no parity, one stop bit
+    fifoControlPort.Write(0xC7);            // clear and enable the FIFOs
+    modemControlPort.Write(0x03);           // DTR and RTS
+}
+
+SerialPort::~SerialPort()
+{
+    if (activeSerialPort == this)
+        activeSerialPort = 0;
+}
+
+void SerialPort::Write(const char* text, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (text[i] == '\n')
+            Write("\r", 1);
+        // Wait until the transmitter can take another byte
+        while ((lineStatusPort.Read() & 0x20) == 0)
+            ;
+        dataPort.Write(text[i]);
+    }
+}
@@ -0,0 +1,128 @@
+#include <drivers/timer.h>
+#include <common/cpu.h>
+#include <syscalls.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+TimerDriver* TimerDriver::activeTimer = 0;
+
+TimerDriver::TimerDriver(InterruptManager* manager, uint32_t frequency)
+: InterruptHandler(manager, manager->HardwareInterruptOffset()),
+  wheel(frequency)
+{
+    activeTimer = this;
+    interrupts = 0;
+
+    timestampFrequency = pit.CalibrateTimestampCounter();
+    nanosecondsPerCycle = DivideU64((uint64_t)1000000000 << NANOSECONDS_SHIFT, timestampFrequency);
+    startTimestamp = ReadTimestampCounter();
+
+    // Until Activate the PIT still runs at the BIOS rate
+    this->frequency = frequency;
+    divisor = ProgrammableIntervalTimer::DEFAULT_DIVISOR;
+    tickStoppedAt = 0;
+    cyclesPerTick = DivideU64((uint64_t)timestampFrequency * ProgrammableIntervalTimer::DEFAULT_DIVISOR,
+        ProgrammableIntervalTimer::BASE_FREQUENCY);
+}
+
+TimerDriver::~TimerDriver()
+{
+    if (activeTimer == this)
+        activeTimer = 0;
+}
+
+void TimerDriver::Activate()
+{
+    divisor = pit.SetFrequency(frequency);
+
+    // The divisor is rounded, so use the rate the PIT really runs at
+    frequency = ProgrammableIntervalTimer::BASE_FREQUENCY / divisor;
+    wheel.SetFrequency(frequency);
+    cyclesPerTick = DivideU64((uint64_t)timestampFrequency * divisor, ProgrammableIntervalTimer::BASE_FREQUENCY);
+}
+
+// A shot lasts at most one full PIT count, about 55 ms. When it ends
+// before the wheel has work, the idle task is still all there is to run
+// and the next shot is programmed.
+bool TimerDriver::StopTick()
+{
+    uint32_t next = wheel.NextTick();
+    uint64_t now = ReadTimestampCounter();
+    uint32_t count = ProgrammableIntervalTimer::DEFAULT_DIVISOR;
+    if (next != TimerWheel::NO_TIMER)
+    {
+        uint64_t due = startTimestamp + (uint64_t)next * cyclesPerTick;
+        if (due <= now + cyclesPerTick)
+            return false; // the next tick has work anyway
+        uint64_t cycles = due - now;
+        uint32_t longest = DivideU64((uint64_t)cyclesPerTick * ProgrammableIntervalTimer::DEFAULT_DIVISOR, divisor);
+        if (cycles < longest)
+            count = DivideU64(cycles * ProgrammableIntervalTimer::BASE_FREQUENCY, timestampFrequency);
+    }
+    pit.SetOneShot(count);
+    tickStoppedAt = now;
+    return true;
+}
+
+uint32_t TimerDriver::RestartTick()
+{
+    pit.SetDivisor(divisor);
+    return DivideU64(ReadTimestampCounter() - tickStoppedAt, cyclesPerTick);
+}
+
+uint32_t TimerDriver::HandleInterrupt(uint32_t esp)
+{
+    interrupts++;
+
+    // The tick count comes from the TSC, so ticks skipped while the
+    // interrupt was masked are caught up here
+    wheel.Advance(Ticks());
+
+    // Requests queued by a task that asked the kernel to poll its ring
+    if (SyscallHandler::activeSyscallHandler != 0)
+        SyscallHandler::activeSyscallHandler->PollRing();
+
+    return esp;
+}
+
+uint32_t TimerDriver::Ticks()
+{
+    return DivideU64(ReadTimestampCounter() - startTimestamp, cyclesPerTick);
+}
+
+uint64_t TimerDriver::Nanoseconds()
+{
+    return ScaleU64(ReadTimestampCounter() - startTimestamp, nanosecondsPerCycle, NANOSECONDS_SHIFT);
+}
+
+uint32_t TimerDriver::Milliseconds()
+{
+    return DivideU64(Nanoseconds(), 1000000);
+}
+
+// Rounded up, and never 0, so a sleep lasts at least as long as asked
+uint32_t TimerDriver::TicksForMilliseconds(uint32_t milliseconds)
+{
+    uint32_t ticks = DivideU64((uint64_t)milliseconds * frequency + 999, 1000);
+    return ticks != 0 ? ticks : 1;
+}
+
+uint64_t TimerDriver::Deadline(uint32_t milliseconds)
+{
+    return Nanoseconds() + (uint64_t)milliseconds * 1000000;
+}
+
+bool TimerDriver::Expired(uint64_t deadline)
+{
+    return Nanoseconds() >= deadline;
+}
+
+void TimerDriver::Delay(uint32_t milliseconds)
+{
+    uint64_t deadline = Deadline(milliseconds);
+    while (!Expired(deadline))
+        asm volatile("pause");
+}
@@ -4,16 +4,41 @@ using namespace myos;
 using namespace myos::common;
 
 
+TaskStateSegment GlobalDescriptorTable::taskStateSegment;
+TaskStateSegment GlobalDescriptorTable::doubleFaultSegment;
+
+// All segments are flat over the whole 4 GiB; paging does the protection
 GlobalDescriptorTable::GlobalDescriptorTable()
     : nullSegmentSelector(0, 0, 0),
         unusedSegmentSelector(0, 0, 0),
-        codeSegmentSelector(0, 64*1024*1024, 0x9A),
-        dataSegmentSelector(0, 64*1024*1024, 0x92)
+        codeSegmentSelector(0, 0xFFFFFFFF, 0x9A),
+        dataSegmentSelector(0, 0xFFFFFFFF, 0x92),
+        userCodeSegmentSelector(0, 0xFFFFFFFF, 0xFA),
+        userDataSegmentSelector(0, 0xFFFFFFFF, 0xF2),
+        taskStateSegmentSelector((uint32_t)&taskStateSegment, sizeof(TaskStateSegment) - 1, 0x89),
+        doubleFaultSegmentSelector((uint32_t)&doubleFaultSegment, sizeof(TaskStateSegment) - 1, 0x89)
 {
     uint32_t i[2];
     i[1] = (uint32_t)this;
     i[0] = sizeof(GlobalDescriptorTable) << 16;
     asm volatile("lgdt (%0)": :"p" (((uint8_t *) i)+2));
+
+    // Reload the segment registers from the new table. The data segments
+    // use the ring 3 descriptor, which ring 0 may use as well, so they
+    // stay valid when a task is entered with iret.
+    asm volatile("mov %0, %%ds\n"
+                 "mov %0, %%es\n"
+                 "mov %0, %%fs\n"
+                 "mov %0, %%gs" : : "r" ((uint32_t)UserDataSegmentSelector()));
+    asm volatile("mov %0, %%ss" : : "r" ((uint32_t)DataSegmentSelector()));
+    asm volatile("pushl %0\n"
+                 "pushl $1f\n"
+                 "lret\n"
+                 "1:" : : "r" ((uint32_t)CodeSegmentSelector()));
+
+    taskStateSegment.ss0 = DataSegmentSelector();
+    taskStateSegment.ioMapBase = sizeof(TaskStateSegment); // no I/O bitmap
+    asm volatile("ltr %0" : : "r" (TaskStateSegmentSelector()));
 }
 
 GlobalDescriptorTable::~GlobalDescriptorTable()
@@ -30,14 +55,50 @@ uint16_t GlobalDescriptorTable::CodeSegmentSelector()
     return (uint8_t*)&codeSegmentSelector - (uint8_t*)this;
 }
 
+uint16_t GlobalDescriptorTable::UserCodeSegmentSelector()
+{
+    return ((uint8_t*)&userCodeSegmentSelector - (uint8_t*)this) | 3;
+}
+
+uint16_t GlobalDescriptorTable::UserDataSegmentSelector()
+{
+    return ((uint8_t*)&userDataSegmentSelector - (uint8_t*)this) | 3;
+}
+
+uint16_t GlobalDescriptorTable::TaskStateSegmentSelector()
+{
+    return (uint8_t*)&taskStateSegmentSelector - (uint8_t*)this;
+}
+
+uint16_t GlobalDescriptorTable::DoubleFaultSegmentSelector()
+{
+    return (uint8_t*)&doubleFaultSegmentSelector - (uint8_t*)this;
+}
+
+void GlobalDescriptorTable::SetDoubleFaultTask(void (*entry)(), uint32_t esp, uint32_t cr3)
+{
+    doubleFaultSegment.cr3 = cr3;
+    doubleFaultSegment.eip = (uint32_t)entry;
+    doubleFaultSegment.eflags = 0x2; // interrupts off
+    doubleFaultSegment.esp = esp;
+    doubleFaultSegment.cs = CodeSegmentSelector();
+    doubleFaultSegment.ss = DataSegmentSelector();
+    doubleFaultSegment.ds = UserDataSegmentSelector();
+    doubleFaultSegment.es = UserDataSegmentSelector();
+    doubleFaultSegment.fs = UserDataSegmentSelector();
+    doubleFaultSegment.gs = UserDataSegmentSelector();
+    doubleFaultSegment.ioMapBase = sizeof(TaskStateSegment);
+}
+
 GlobalDescriptorTable::SegmentDescriptor::SegmentDescriptor(uint32_t base, uint32_t limit, uint8_t type)
 {
     uint8_t* target = (uint8_t*)this;
 
     if (limit <= 65536)
     {
-        // 16-bit address space
-        target[6] = 0x40;
+        // 16-bit address space; system descriptors such as the TSS
+        // must leave the size bit clear
+        target[6] = (type & 0x10) ? 0x40 : 0x00;
     }
     else
     {
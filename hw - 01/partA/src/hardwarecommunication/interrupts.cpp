@@ -1,4 +1,5 @@
 #include <hardwarecommunication/interrupts.h>
+#include <common/cpu.h>
 using namespace myos;
 using namespace myos::common;
 using namespace myos::hardwarecommunication;
@@ -72,6 +73,9 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
 {
     this->taskManager = taskManager;
     this->hardwareInterruptOffset = hardwareInterruptOffset;
+    tickSource = 0;
+    tickStopped = false;
+    idleTicksAvoided = 0;
     uint32_t CodeSegment = globalDescriptorTable->CodeSegmentSelector();
 
     const uint8_t IDT_INTERRUPT_GATE = 0xE;
@@ -121,7 +125,8 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
     SetInterruptDescriptorTableEntry(hardwareInterruptOffset + 0x0E, CodeSegment, &HandleInterruptRequest0x0E, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(hardwareInterruptOffset + 0x0F, CodeSegment, &HandleInterruptRequest0x0F, 0, IDT_INTERRUPT_GATE);
 
-    SetInterruptDescriptorTableEntry(0x80, CodeSegment, &HandleInterruptRequest0x80, 0, IDT_INTERRUPT_GATE);
+    // System calls come from ring 3
+    SetInterruptDescriptorTableEntry(0x80, CodeSegment, &HandleInterruptRequest0x80, 3, IDT_INTERRUPT_GATE);
 
     programmableInterruptControllerMasterCommandPort.Write(0x11);
     programmableInterruptControllerSlaveCommandPort.Write(0x11);
@@ -154,6 +159,12 @@ uint16_t InterruptManager::HardwareInterruptOffset()
     return hardwareInterruptOffset;
 }
 
+void InterruptManager::SetTaskGate(uint8_t interrupt, uint16_t taskStateSegmentSelector)
+{
+    const uint8_t IDT_TASK_GATE = 0x5;
+    SetInterruptDescriptorTableEntry(interrupt, taskStateSegmentSelector, 0, 0, IDT_TASK_GATE);
+}
+
 void InterruptManager::Activate()
 {
     if (ActiveInterruptManager != 0)
@@ -179,8 +190,43 @@ uint32_t InterruptManager::HandleInterrupt(uint8_t interrupt, uint32_t esp)
     return esp;
 }
 
+TickSource::TickSource()
+{
+}
+
+bool TickSource::StopTick()
+{
+    return false;
+}
+
+uint32_t TickSource::RestartTick()
+{
+    return 0;
+}
+
+void InterruptManager::EnableTicklessIdle(TickSource* tickSource)
+{
+    this->tickSource = tickSource;
+}
+
+void InterruptManager::EnterTicklessIdle()
+{
+    tickStopped = tickSource->StopTick();
+}
+
+void InterruptManager::LeaveTicklessIdle()
+{
+    tickStopped = false;
+    idleTicksAvoided += tickSource->RestartTick();
+}
+
 uint32_t InterruptManager::DoHandleInterrupt(uint8_t interrupt, uint32_t esp)
 {
+    // The timer was due, or another interrupt may have made work; either
+    // way the tick comes back
+    if (tickStopped && hardwareInterruptOffset <= interrupt && interrupt < hardwareInterruptOffset + 16)
+        LeaveTicklessIdle();
+
     if (handlers[interrupt] != 0)
     {
         esp = handlers[interrupt]->HandleInterrupt(esp);
@@ -195,6 +241,11 @@ uint32_t InterruptManager::DoHandleInterrupt(uint8_t interrupt, uint32_t esp)
     if (interrupt == hardwareInterruptOffset)
     {
         esp = (uint32_t)taskManager->Schedule((CPUState*)esp);
+
+        // Nothing to run, so the ticks until the next timer have nothing
+        // to do
+        if (tickSource != 0 && taskManager->IsIdle())
+            EnterTicklessIdle();
     }
 
     // hardware interrupts must be acknowledged
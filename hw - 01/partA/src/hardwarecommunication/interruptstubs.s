@@ -5,6 +5,10 @@
 .section .text
 
 .extern _ZN4myos21hardwarecommunication16InterruptManager15HandleInterruptEhj
+.extern _ZN4myos14SyscallHandler14HandleSysenterEj
+.extern _ZN4myos21GlobalDescriptorTable16taskStateSegmentE
+.extern _ZN4myos14SyscallHandler16userCodeSelectorE
+.extern _ZN4myos14SyscallHandler16userDataSelectorE
 
 
 .macro HandleException num
@@ -120,5 +124,57 @@ _ZN4myos21hardwarecommunication16InterruptManager15InterruptIgnoreEv:
     iret
 
 
+# sysenter arrives with interrupts off, the caller's stack in ecx and its
+# return address in edx. Build the frame an interrupt from ring 3 leaves
+# on the task's kernel stack, so the task can also be resumed with iret.
+.global _ZN4myos14SyscallHandler13SysenterEntryEv
+_ZN4myos14SyscallHandler13SysenterEntryEv:
+    movl _ZN4myos21GlobalDescriptorTable16taskStateSegmentE+4, %esp
+
+    pushl _ZN4myos14SyscallHandler16userDataSelectorE
+    pushl %ecx
+    pushfl
+    orl $0x200, (%esp)  # the caller ran with interrupts on
+    pushl _ZN4myos14SyscallHandler16userCodeSelectorE
+    pushl %edx
+    pushl $0
+
+    pushl %ebp
+    pushl %edi
+    pushl %esi
+
+    pushl %edx
+    pushl %ecx
+    pushl %ebx
+    pushl %eax
+
+    movl %esp, %ebp     # callee saved, the frame survives the call
+    pushl %esp
+    call _ZN4myos14SyscallHandler14HandleSysenterEj
+    cmpl %eax, %ebp     # still the same task?
+    mov %eax, %esp
+
+    # none of these change the flags
+    popl %eax
+    popl %ebx
+    popl %ecx
+    popl %edx
+
+    popl %esi
+    popl %edi
+    popl %ebp
+
+    leal 4(%esp), %esp
+    jne sysenter_switch
+
+    movl (%esp), %edx   # return address
+    movl 12(%esp), %ecx # user stack
+    sti                 # takes effect after sysexit
+    sysexit
+
+sysenter_switch:
+    iret
+
+
 .data
     interruptnumber: .byte 0
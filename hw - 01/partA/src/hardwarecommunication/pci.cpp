@@ -5,6 +5,8 @@ using namespace myos::common;
 using namespace myos::drivers;
 using namespace myos::hardwarecommunication;
 
+static myos::SlabCache<amd_am79c973> amdCache;
+
 
 
 
@@ -115,6 +117,38 @@ void PeripheralComponentInterconnectController::SelectDrivers(DriverManager* dri
 }
 
 
+bool PeripheralComponentInterconnectController::FindDevice(uint8_t class_id, uint8_t subclass_id, PeripheralComponentInterconnectDeviceDescriptor* result)
+{
+    for(int bus = 0; bus < 8; bus++)
+    {
+        for(int device = 0; device < 32; device++)
+        {
+            int numFunctions = DeviceHasFunctions(bus, device) ? 8 : 1;
+            for(int function = 0; function < numFunctions; function++)
+            {
+                PeripheralComponentInterconnectDeviceDescriptor dev = GetDeviceDescriptor(bus, device, function);
+                if(dev.vendor_id == 0x0000 || dev.vendor_id == 0xFFFF)
+                    continue;
+                if(dev.class_id == class_id && dev.subclass_id == subclass_id)
+                {
+                    *result = dev;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Let the device read and write memory on its own. The status half of
+// the register is written as zero, which leaves its bits alone.
+void PeripheralComponentInterconnectController::EnableBusMaster(PeripheralComponentInterconnectDeviceDescriptor* dev)
+{
+    uint32_t command = Read(dev->bus, dev->device, dev->function, 0x04) & 0xFFFF;
+    Write(dev->bus, dev->device, dev->function, 0x04, command | 0x04);
+}
+
+
 BaseAddressRegister PeripheralComponentInterconnectController::GetBaseAddressRegister(uint16_t bus, uint16_t device, uint16_t function, uint16_t bar)
 {
     BaseAddressRegister result;
@@ -166,9 +200,7 @@ Driver* PeripheralComponentInterconnectController::GetDriver(PeripheralComponent
             switch(dev.device_id)
             {
                 case 0x2000: // am79c973
-                    driver = (amd_am79c973*)MemoryManager::activeMemoryManager->malloc(sizeof(amd_am79c973));
-                    if(driver != 0)
-                        new (driver) amd_am79c973(&dev, interrupts);
+                    driver = amdCache.Create(&dev, interrupts);
                     printf("AMD am79c973 ");
                     return driver;
                     break;
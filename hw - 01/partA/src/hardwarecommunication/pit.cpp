@@ -0,0 +1,76 @@
+#include <hardwarecommunication/pit.h>
+#include <common/cpu.h>
+
+using namespace myos::common;
+using namespace myos::hardwarecommunication;
+
+ProgrammableIntervalTimer::ProgrammableIntervalTimer()
+    : channel0DataPort(0x40),
+      channel2DataPort(0x42),
+      commandPort(0x43),
+      channel2GatePort(0x61)
+{
+}
+
+ProgrammableIntervalTimer::~ProgrammableIntervalTimer()
+{
+}
+
+uint32_t ProgrammableIntervalTimer::SetFrequency(uint32_t frequency)
+{
+    // A count of 0 means 65536
+    uint32_t divisor = frequency != 0 ? BASE_FREQUENCY / frequency : DEFAULT_DIVISOR;
+    if (divisor < 1)
+        divisor = 1;
+    if (divisor > DEFAULT_DIVISOR)
+        divisor = DEFAULT_DIVISOR;
+    SetDivisor(divisor);
+    return divisor;
+}
+
+void ProgrammableIntervalTimer::SetDivisor(uint32_t divisor)
+{
+    // Channel 0, low byte then high byte, mode 2 (rate generator)
+    commandPort.Write(0x34);
+    channel0DataPort.Write(divisor & 0xFF);
+    channel0DataPort.Write((divisor >> 8) & 0xFF);
+}
+
+void ProgrammableIntervalTimer::SetOneShot(uint32_t count)
+{
+    if (count < 1)
+        count = 1;
+    if (count > DEFAULT_DIVISOR)
+        count = DEFAULT_DIVISOR;
+
+    // Channel 0, low byte then high byte, mode 0 (interrupt on terminal count)
+    commandPort.Write(0x30);
+    channel0DataPort.Write(count & 0xFF);
+    channel0DataPort.Write((count >> 8) & 0xFF);
+}
+
+uint32_t ProgrammableIntervalTimer::CalibrateTimestampCounter()
+{
+    // 50 ms, close to the longest count channel 2 can do
+    const uint32_t count = BASE_FREQUENCY / 20;
+
+    // Gate on, speaker off
+    uint8_t gate = (channel2GatePort.Read() & ~0x02) | 0x01;
+    channel2GatePort.Write(gate);
+
+    // Channel 2, low byte then high byte, mode 0 (interrupt on terminal count)
+    commandPort.Write(0xB0);
+    channel2DataPort.Write(count & 0xFF);
+    channel2DataPort.Write(count >> 8);
+
+    // Restart the count by toggling the gate and wait for OUT2 to go high
+    channel2GatePort.Write(gate & ~0x01);
+    channel2GatePort.Write(gate);
+    uint64_t start = ReadTimestampCounter();
+    while ((channel2GatePort.Read() & 0x20) == 0);
+    uint64_t cycles = ReadTimestampCounter() - start;
+
+    channel2GatePort.Write(gate & ~0x01);
+
+    return DivideU64(cycles * BASE_FREQUENCY, count);
+}
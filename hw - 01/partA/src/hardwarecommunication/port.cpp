@@ -77,6 +77,16 @@ uint16_t Port16Bit::Read()
     return Read16(portnumber);
 }
 
+void Port16Bit::ReadString(uint16_t* buffer, uint32_t count)
+{
+    ReadString16(portnumber, buffer, count);
+}
+
+void Port16Bit::WriteString(const uint16_t* buffer, uint32_t count)
+{
+    WriteString16(portnumber, buffer, count);
+}
+
 
 
 
@@ -1,20 +1,32 @@
 #include <common/types.h>
 #include <gdt.h>
 #include <memorymanagement.h>
+#include <pageframeallocator.h>
+#include <paging.h>
+#include <kernellog.h>
 #include <hardwarecommunication/interrupts.h>
+#include <common/cpu.h>
+#include <common/string.h>
 #include <syscalls.h>
 #include <hardwarecommunication/pci.h>
 #include <drivers/driver.h>
 #include <drivers/keyboard.h>
+#include <drivers/console.h>
+#include <drivers/serial.h>
+#include <drivers/timer.h>
 #include <drivers/mouse.h>
 #include <drivers/vga.h>
 #include <drivers/ata.h>
+#include <drivers/busmasteride.h>
+#include <drivers/blockqueue.h>
+#include <drivers/buffercache.h>
 #include <gui/desktop.h>
 #include <gui/window.h>
 #include <multitasking.h>
 #include <drivers/amd_am79c973.h>
 #include <stdarg.h>
 // #define GRAPHICSMODE
+// #define BENCHMARKMODE
 
 using namespace myos;
 using namespace myos::common;
@@ -92,56 +104,116 @@ void sprintf(char* str, const char* format, ...)
 
 void delay(int milliseconds)
 {
+    if (TimerDriver::activeTimer != 0)
+    {
+        TimerDriver::activeTimer->Delay(milliseconds);
+        return;
+    }
+
     int count = milliseconds * 10000;  // Basit bir gecikme döngüsü
     while(count--) asm volatile("nop");
 }
 
 
-void printf(char* str)
-{
-    static uint16_t* VideoMemory = (uint16_t*)0xb8000;
-    static char* logBuffer = (char*)0x400000; // Bellekte 4MB'dan itibaren ayır.
-    static uint32_t logIndex = 0;
+// Log records from LOG_INFO up are rendered on the screen, all of them on
+// the serial port with their time and level
+static const LogLevel CONSOLE_LEVEL = LOG_INFO;
+static const uint32_t LOG_INTERVAL_MS = 20;
+
+static uint32_t logTimestampFrequency = 0; // known once the timer runs
+static volatile bool logTaskRunning = false;
 
-    static uint8_t x = 0, y = 0;
+static void renderLogRecord(const LogRecord* record)
+{
+    static const char* levelNames[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+    static bool lineStart = true;
 
-    for (int i = 0; str[i] != '\0'; ++i)
+    if (SerialPort::activeSerialPort != 0)
     {
-        switch (str[i])
+        if (lineStart)
         {
-            case '\n':
-                x = 0;
-                y++;
-                logBuffer[logIndex++] = '\n'; // Log buffer'a yaz
-                break;
-            default:
-                VideoMemory[80 * y + x] = (VideoMemory[80 * y + x] & 0xFF00) | str[i];
-                logBuffer[logIndex++] = str[i]; // Log buffer'a yaz
-                x++;
-                break;
+            char prefix[32];
+            uint32_t milliseconds = logTimestampFrequency >= 1000
+                ? DivideU64(record->timestamp, logTimestampFrequency / 1000) : 0;
+            sprintf(prefix, "[%d] ", milliseconds);
+            SerialPort::activeSerialPort->Write(prefix, strlen(prefix));
+            SerialPort::activeSerialPort->Write(levelNames[record->level], strlen(levelNames[record->level]));
+            SerialPort::activeSerialPort->Write(" ", 1);
         }
+        SerialPort::activeSerialPort->Write(record->text, record->length);
+    }
+    if (record->level >= CONSOLE_LEVEL && Console::activeConsole != 0)
+        Console::activeConsole->Write(record->text, record->length);
 
-        if (x >= 80)
-        {
-            x = 0;
-            y++;
-        }
+    lineStart = record->text[record->length - 1] == '\n';
+}
 
-        if (y >= 25)
+// Render everything that is in the log. Only one caller at a time does,
+// the others leave it to that one.
+static void drainLog()
+{
+    static volatile uint32_t draining = 0;
+    static uint32_t dropped = 0;
+
+    KernelLog* log = KernelLog::activeKernelLog;
+    if (log == 0 || __sync_lock_test_and_set(&draining, 1))
+        return;
+
+    LogRecord record;
+    while (log->Read(&record))
+    {
+        if (log->Dropped() != dropped)
         {
-            for (y = 0; y < 25; y++)
-                for (x = 0; x < 80; x++)
-                    VideoMemory[80 * y + x] = (VideoMemory[80 * y + x] & 0xFF00) | ' ';
-            x = 0;
-            y = 0;
+            char buffer[48];
+            sprintf(buffer, "[%d log records lost]\n", log->Dropped() - dropped);
+            dropped = log->Dropped();
+            if (Console::activeConsole != 0)
+                Console::activeConsole->Write(buffer, strlen(buffer));
+            if (SerialPort::activeSerialPort != 0)
+                SerialPort::activeSerialPort->Write(buffer, strlen(buffer));
         }
+        renderLogRecord(&record);
     }
+
+    __sync_lock_release(&draining);
+}
+
+// Everything the kernel prints goes through here. It is only copied into
+// the log; the log task renders it later. Errors, and everything before
+// the log task runs, are rendered right away.
+void print(LogLevel level, const char* text, size_t length)
+{
+    if (KernelLog::activeKernelLog == 0)
+    {
+        if (Console::activeConsole != 0)
+            Console::activeConsole->Write(text, length);
+        return;
+    }
+
+    KernelLog::activeKernelLog->Write(level, text, length);
+    if (!logTaskRunning || level >= LOG_ERROR)
+        drainLog();
+}
+
+void print(const char* text, size_t length)
+{
+    print(LOG_INFO, text, length);
+}
+
+void printk(LogLevel level, char* str)
+{
+    print(level, str, strlen(str));
+}
+
+void printf(char* str)
+{
+    print(LOG_INFO, str, strlen(str));
 }
 
 void printfHex(uint8_t key)
 {
-    char* foo = "00";
-    char* hex = "0123456789ABCDEF";
+    char foo[] = "00";
+    const char* hex = "0123456789ABCDEF";
     foo[0] = hex[(key >> 4) & 0xF];
     foo[1] = hex[key & 0xF];
     printf(foo);
@@ -161,11 +233,14 @@ void printfHex32(uint32_t key)
     printfHex(key & 0xFF);
 }
 
+void sysprintf(char* str);
+
+// Runs in the tasks, so it prints through the system call
 void printInteger(int number)
 {
     if (number == 0)
     {
-        printf("0");
+        sysprintf("0");
         return;
     }
 
@@ -185,7 +260,7 @@ void printInteger(int number)
     if (isNegative)
         buffer[i--] = '-';
 
-    printf(&buffer[i + 1]);
+    sysprintf(&buffer[i + 1]);
 }
 
 class PrintfKeyboardEventHandler : public KeyboardEventHandler
@@ -193,7 +268,7 @@ class PrintfKeyboardEventHandler : public KeyboardEventHandler
 public:
     void OnKeyDown(char c)
     {
-        char* foo = " ";
+        char foo[] = " ";
         foo[0] = c;
         printf(foo);
     }
@@ -234,9 +309,10 @@ public:
     }
 };
 
+// Line buffered, a task's output costs a trap per line
 void sysprintf(char* str)
 {
-    asm("int $0x80" : : "a"(4), "b"(str));
+    console_write(str);
 }
 
 void collatz(int n)
@@ -256,6 +332,55 @@ void collatz(int n)
     sysprintf("1\n");
 }
 
+// The same for a forked child, which keeps the sequence in task memory.
+// There is nothing to free, the memory goes when the child is reaped.
+void collatzChild(int n)
+{
+    const int maxLength = 256;
+    int* sequence = (int*)syscall_alloc(maxLength * sizeof(int));
+    if (sequence == 0)
+    {
+        collatz(n);
+        return;
+    }
+
+    int length = 0;
+    for (int value = n; length < maxLength; length++)
+    {
+        sequence[length] = value;
+        if (value == 1)
+            break;
+        value = (value % 2 == 0) ? value / 2 : 3 * value + 1;
+    }
+
+    sysprintf("Collatz sequence for ");
+    printInteger(n);
+    sysprintf(": ");
+    for (int i = 0; i < length; i++)
+    {
+        printInteger(sequence[i]);
+        sysprintf(", ");
+    }
+    sysprintf("1\n");
+}
+
+// Which system calls the kernel spent its time on, in calls and kilocycles
+void printSyscallStats()
+{
+    SyscallStats stats[SyscallHandler::MAX_SYSCALLS];
+    int count = syscall_stats(stats, SyscallHandler::MAX_SYSCALLS);
+
+    char buffer[64];
+    sysprintf("SYSCALL CALLS REJECTED KCYCLES\n");
+    for (int i = 0; i < count; i++)
+    {
+        sysprintf((char*)stats[i].name);
+        sprintf(buffer, " %d %d %d\n", stats[i].calls, stats[i].rejected,
+            (uint32_t)(stats[i].cycles >> 10));
+        sysprintf(buffer);
+    }
+}
+
 void collatzTask()
 {
     for (int i = 1; i < 4; i++)
@@ -266,19 +391,22 @@ void collatzTask()
         if (pid == 0)
         {
             sysprintf("Child task running\n");
-            collatz(i);
+            collatzChild(i);
             sysprintf("Child task exiting\n");
-            syscall_exit();
+            syscall_exit(i);
         }
         else
         {
             sysprintf("Parent task waiting for child\n");
-            syscall_waitpid(pid);
-            sysprintf("Task finished\n");
+            int status = syscall_waitpid(pid);
+            sysprintf("Task finished with status ");
+            printInteger(status);
+            sysprintf("\n");
         }
     }
+    printSyscallStats();
     sysprintf("Collatz task exiting\n");
-    syscall_exit();
+    syscall_exit(0);
 }
 
 void longRunningProgram() {
@@ -296,7 +424,741 @@ void longRunningProgram() {
 
 void longRunningProgramTask() {
     longRunningProgram();
-    syscall_exit();
+    syscall_exit(0);
+}
+
+// Runs in ring 0 for the screen and the serial port. It renders what
+// piled up and sleeps again, so the log costs interrupt handlers only the
+// copy.
+void logTask()
+{
+    logTaskRunning = true;
+    while (1)
+    {
+        drainLog();
+        syscall_sleep(LOG_INTERVAL_MS);
+    }
+}
+
+// Dirty blocks of the buffer cache go to the disk together once per
+// interval, so repeated writes to a block cost one transfer
+static const uint32_t WRITEBACK_INTERVAL_MS = 1000;
+
+void writeBackTask()
+{
+    while (1)
+    {
+        syscall_sleep(WRITEBACK_INTERVAL_MS);
+        if (BufferCache::activeBufferCache != 0)
+            BufferCache::activeBufferCache->WriteBack();
+    }
+}
+
+// Moves the data of a drive without DMA, so the tasks using it can sleep
+static BlockQueue* pioQueue = 0;
+
+void pioTask()
+{
+    pioQueue->Serve();
+}
+
+#ifdef BENCHMARKMODE
+void idleBenchmarkTask()
+{
+    while (1);
+}
+
+// Cost of one TaskManager::Schedule for a growing number of ready tasks.
+// Runs before the real TaskManager exists, since it installs its own.
+void benchmarkScheduler(GlobalDescriptorTable* gdt)
+{
+    const int taskCounts[] = { 2, 16, 64, 256 };
+    const int switches = 1000;
+
+    for (int c = 0; c < 4; c++)
+    {
+        Task* tasks[256];
+        TaskManager manager;
+        for (int i = 0; i < taskCounts[c]; i++)
+        {
+            tasks[i] = new Task(gdt, idleBenchmarkTask);
+            manager.AddTask(tasks[i]);
+        }
+
+        CPUState* cpustate = 0;
+        for (int i = 0; i < switches; i++)
+            cpustate = manager.Schedule(cpustate);
+
+        char buffer[64];
+        sprintf(buffer, "Schedule: %d tasks, %d cycles per switch\n",
+            taskCounts[c], (uint32_t)manager.ScheduleCycles() / manager.ScheduleCount());
+        printf(buffer);
+
+        for (int i = 0; i < taskCounts[c]; i++)
+            delete tasks[i];
+    }
+}
+
+// The heap as it was before the size-class bins: one address-ordered
+// list of all chunks, searched first fit. Only here to compare against.
+struct FirstFitChunk
+{
+    FirstFitChunk* next;
+    FirstFitChunk* prev;
+    bool allocated;
+    size_t size;
+};
+
+class FirstFitHeap
+{
+protected:
+    FirstFitChunk* first;
+
+public:
+    FirstFitHeap(size_t start, size_t size)
+    {
+        first = (FirstFitChunk*)start;
+        first->next = 0;
+        first->prev = 0;
+        first->allocated = false;
+        first->size = size - sizeof(FirstFitChunk);
+    }
+
+    void* malloc(size_t size)
+    {
+        size = (size + MemoryManager::ALIGNMENT - 1) & ~(MemoryManager::ALIGNMENT - 1);
+        FirstFitChunk* result = 0;
+        for (FirstFitChunk* chunk = first; chunk != 0 && result == 0; chunk = chunk->next)
+            if (!chunk->allocated && chunk->size >= size)
+                result = chunk;
+        if (result == 0)
+            return 0;
+
+        if (result->size >= size + sizeof(FirstFitChunk) + MemoryManager::ALIGNMENT)
+        {
+            FirstFitChunk* rest = (FirstFitChunk*)((size_t)result + sizeof(FirstFitChunk) + size);
+            rest->allocated = false;
+            rest->size = result->size - size - sizeof(FirstFitChunk);
+            rest->prev = result;
+            rest->next = result->next;
+            if (rest->next != 0)
+                rest->next->prev = rest;
+            result->size = size;
+            result->next = rest;
+        }
+        result->allocated = true;
+        return (void*)((size_t)result + sizeof(FirstFitChunk));
+    }
+
+    void free(void* ptr)
+    {
+        FirstFitChunk* chunk = (FirstFitChunk*)((size_t)ptr - sizeof(FirstFitChunk));
+        chunk->allocated = false;
+        if (chunk->prev != 0 && !chunk->prev->allocated)
+        {
+            chunk->prev->next = chunk->next;
+            chunk->prev->size += chunk->size + sizeof(FirstFitChunk);
+            if (chunk->next != 0)
+                chunk->next->prev = chunk->prev;
+            chunk = chunk->prev;
+        }
+        if (chunk->next != 0 && !chunk->next->allocated)
+        {
+            chunk->size += chunk->next->size + sizeof(FirstFitChunk);
+            chunk->next = chunk->next->next;
+            if (chunk->next != 0)
+                chunk->next->prev = chunk;
+        }
+    }
+
+    // The few HeapStats a list of chunks has to tell
+    bool Verify(HeapStats* stats)
+    {
+        stats->totalBytes = 0;
+        stats->bytesInUse = 0;
+        stats->bytesFree = 0;
+        stats->largestFreeBlock = 0;
+        stats->usedChunks = 0;
+        stats->freeChunks = 0;
+        stats->regions = 1;
+        stats->fragmentation = 0;
+        for (FirstFitChunk* chunk = first; chunk != 0; chunk = chunk->next)
+        {
+            stats->totalBytes += chunk->size + sizeof(FirstFitChunk);
+            if (chunk->allocated)
+            {
+                stats->bytesInUse += chunk->size;
+                stats->usedChunks++;
+                continue;
+            }
+            stats->bytesFree += chunk->size;
+            stats->freeChunks++;
+            if (chunk->size > stats->largestFreeBlock)
+                stats->largestFreeBlock = chunk->size;
+        }
+        if (stats->bytesFree != 0)
+            stats->fragmentation = (stats->bytesFree - stats->largestFreeBlock) / ((stats->bytesFree + 99) / 100);
+        return true;
+    }
+};
+
+static const int HEAP_SLOTS = 1024;
+static const int HEAP_OPERATIONS = 20000;
+
+// Mostly small objects with some large ones, all from one seed so both
+// heaps see the same requests
+static size_t heapRequestSize(uint32_t* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    uint32_t value = *seed >> 8;
+    return (value % 8 == 0) ? 256 + value % 2048 : 16 + value % 240;
+}
+
+// Fill every slot, free every other one to leave holes all over the
+// heap, then free and allocate at random. Returns the cycles of the
+// random part; failed allocations are counted, and the heap is looked at
+// before the slots left are freed.
+template<class Heap>
+static uint32_t heapWorkload(Heap* heap, void** slots, uint32_t* failures, HeapStats* stats)
+{
+    uint32_t seed = 7;
+    *failures = 0;
+    for (int i = 0; i < HEAP_SLOTS; i++)
+        slots[i] = heap->malloc(heapRequestSize(&seed));
+    for (int i = 0; i < HEAP_SLOTS; i += 2)
+    {
+        heap->free(slots[i]);
+        slots[i] = 0;
+    }
+
+    uint64_t start = ReadTimestampCounter();
+    for (int i = 0; i < HEAP_OPERATIONS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % HEAP_SLOTS;
+        if (slots[slot] != 0)
+        {
+            heap->free(slots[slot]);
+            slots[slot] = 0;
+        }
+        else if ((slots[slot] = heap->malloc(heapRequestSize(&seed))) == 0)
+            (*failures)++;
+    }
+    uint32_t cycles = (uint32_t)(ReadTimestampCounter() - start);
+
+    heap->Verify(stats);
+    for (int i = 0; i < HEAP_SLOTS; i++)
+        if (slots[i] != 0)
+            heap->free(slots[i]);
+    return cycles;
+}
+
+// The binned heap against first fit on a fragmented heap, each in a
+// region of its own. The binned one must not become the kernel's heap.
+void benchmarkHeap()
+{
+    const int order = 10; // 4 MiB, so neither runs out and grows
+    PageFrameAllocator* frames = PageFrameAllocator::activePageFrameAllocator;
+    void* firstFitRegion = frames->AllocateFrames(order);
+    void* binnedRegion = frames->AllocateFrames(order);
+    void** slots = new void*[HEAP_SLOTS];
+    if (firstFitRegion == 0 || binnedRegion == 0 || slots == 0)
+    {
+        printf("Heap: no memory for the benchmark\n");
+        return;
+    }
+    size_t size = PageFrameAllocator::PAGE_SIZE << order;
+
+    FirstFitHeap firstFit((size_t)firstFitRegion, size);
+    uint32_t firstFitFailures;
+    HeapStats firstFitStats;
+    uint32_t firstFitCycles = heapWorkload(&firstFit, slots, &firstFitFailures, &firstFitStats);
+
+    MemoryManager* kernelHeap = MemoryManager::activeMemoryManager;
+    MemoryManager binned((size_t)binnedRegion, size);
+    MemoryManager::activeMemoryManager = kernelHeap;
+    uint32_t binnedFailures;
+    HeapStats binnedStats;
+    uint32_t binnedCycles = heapWorkload(&binned, slots, &binnedFailures, &binnedStats);
+
+    char buffer[112];
+    sprintf(buffer, "Heap, first fit: %d cycles per operation, %d failed, %d free chunks, %d% fragmented\n",
+        firstFitCycles / HEAP_OPERATIONS, firstFitFailures, firstFitStats.freeChunks, firstFitStats.fragmentation);
+    printf(buffer);
+    sprintf(buffer, "Heap, bins: %d cycles per operation, %d failed, %d free chunks, %d% fragmented\n",
+        binnedCycles / HEAP_OPERATIONS, binnedFailures, binnedStats.freeChunks, binnedStats.fragmentation);
+    printf(buffer);
+
+    delete[] slots;
+    frames->FreeFrames(firstFitRegion);
+    frames->FreeFrames(binnedRegion);
+}
+
+static void countTimer(void* data)
+{
+    (*(uint32_t*)data)++;
+}
+
+// Cost of adding, cancelling and expiring timers with many of them
+// pending. Every other timer is cancelled, the rest fire.
+void benchmarkTimerWheel()
+{
+    const int timerCounts[] = { 64, 1024, 4096 };
+    const uint32_t span = 20000; // ticks
+
+    for (int c = 0; c < 3; c++)
+    {
+        int count = timerCounts[c];
+        TimerWheel wheel(100);
+        Timer* timers = new Timer[count];
+        uint32_t fired = 0;
+        uint32_t seed = 1;
+
+        uint64_t start = ReadTimestampCounter();
+        for (int i = 0; i < count; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            timers[i].callback = countTimer;
+            timers[i].data = &fired;
+            wheel.Add(&timers[i], (seed >> 8) % span);
+        }
+        uint32_t addCycles = (uint32_t)(ReadTimestampCounter() - start);
+
+        start = ReadTimestampCounter();
+        for (int i = 0; i < count; i += 2)
+            wheel.Cancel(&timers[i]);
+        uint32_t cancelCycles = (uint32_t)(ReadTimestampCounter() - start);
+
+        start = ReadTimestampCounter();
+        for (uint32_t tick = 0; tick <= span; tick++)
+            wheel.Advance(tick);
+        uint32_t advanceCycles = (uint32_t)(ReadTimestampCounter() - start);
+
+        char buffer[96];
+        sprintf(buffer, "Timer wheel: %d timers, add %d, cancel %d, tick %d cycles, %d fired\n",
+            count, addCycles / count, cancelCycles / (count / 2), advanceCycles / (span + 1), fired);
+        printf(buffer);
+
+        delete[] timers;
+    }
+}
+
+// What a message costs the code that logs it, and what rendering it
+// later costs the log task. The messages are debug ones, so they only go
+// to the serial port.
+void benchmarkKernelLog()
+{
+    const int messages = KernelLog::ENTRIES / 2;
+    char* text = "Switching to task 12\n";
+    size_t length = strlen(text);
+
+    uint64_t start = ReadTimestampCounter();
+    for (int i = 0; i < messages; i++)
+        KernelLog::activeKernelLog->Write(LOG_DEBUG, text, length);
+    uint32_t writeCycles = (uint32_t)(ReadTimestampCounter() - start);
+
+    start = ReadTimestampCounter();
+    drainLog();
+    uint32_t renderCycles = (uint32_t)(ReadTimestampCounter() - start);
+
+    char buffer[80];
+    sprintf(buffer, "Kernel log: %d cycles per message logged, %d rendered\n",
+        writeCycles / messages, renderCycles / messages);
+    printf(buffer);
+}
+
+// Set up by kernelMain for the disk benchmark
+static AdvancedTechnologyAttachment* benchmarkDrive = 0;
+static BusMasterIDE* benchmarkDMA = 0;
+static BlockQueue* benchmarkQueue = 0;
+static uint32_t benchmarkTimestampFrequency = 0;
+static volatile bool benchmarkDiskDone = false;
+static uint8_t benchmarkBuffer[128 * AdvancedTechnologyAttachment::SECTOR_SIZE] __attribute__((aligned(4096)));
+
+// Sequential read throughput of the primary master, a megabyte per run:
+// PIO in commands of 128 sectors and of one sector, then DMA in commands
+// of 128 sectors. CPU is the share of the time the reading task kept the
+// processor; PIO spins for all of it, DMA leaves it to other tasks until
+// the interrupt. Runs in ring 0 as a task so DMA can block it.
+void diskBenchmarkTask()
+{
+    AdvancedTechnologyAttachment* drive = benchmarkDrive;
+    uint32_t frequency = benchmarkTimestampFrequency;
+    if (drive == 0 || benchmarkDMA == 0 || frequency < 1000)
+    {
+        benchmarkDiskDone = true;
+        syscall_exit(0);
+    }
+
+    const uint32_t sectors = 2048;
+    const uint32_t chunks[] = { 128, 1, 128 };
+    const bool useDMA[] = { false, false, true };
+
+    for (int c = 0; c < 3; c++)
+    {
+        drive->SetDMA(useDMA[c] ? benchmarkDMA : 0);
+        if (useDMA[c] && !drive->UsesDMA())
+        {
+            printf("Disk: no DMA\n");
+            break;
+        }
+
+        uint64_t blocked = benchmarkDMA->BlockedCycles();
+        uint64_t start = ReadTimestampCounter();
+        for (uint32_t lba = 0; lba < sectors; lba += chunks[c])
+            if (!drive->ReadSectors(lba, chunks[c], benchmarkBuffer))
+                break;
+        uint64_t elapsed = ReadTimestampCounter() - start;
+        uint64_t busy = elapsed - (benchmarkDMA->BlockedCycles() - blocked);
+
+        uint32_t milliseconds = DivideU64(elapsed, frequency / 1000);
+        if (milliseconds == 0)
+            milliseconds = 1;
+        uint32_t rate = sectors / 2 * 1000 / milliseconds; // KiB/s
+        uint32_t cpu = DivideU64(busy, frequency / 1000) * 100 / milliseconds;
+
+        char report[96];
+        sprintf(report, "Disk: %d MB/s (%d KB/s), CPU %d%, ", rate / 1024, rate, cpu);
+        printf(report);
+        printf(useDMA[c] ? (char*)"DMA" : (char*)"PIO");
+        sprintf(report, " in %d sector commands\n", chunks[c]);
+        printf(report);
+    }
+
+    drive->SetDMA(benchmarkDMA);
+    benchmarkDiskDone = true;
+    syscall_exit(0);
+}
+
+// Readers sharing the queue, each reading every QUEUE_READERS-th block of
+// the same megabyte. Whatever queues up behind the command in flight is
+// adjacent, so it goes out merged. Starts once the disk benchmark is done.
+static const uint32_t QUEUE_READERS = 4;
+static const uint32_t QUEUE_BLOCK = 8; // sectors
+static uint8_t queueBuffers[QUEUE_READERS][QUEUE_BLOCK * AdvancedTechnologyAttachment::SECTOR_SIZE] __attribute__((aligned(4096)));
+static uint32_t queueReaderIds = 0;
+static uint32_t queueReadersDone = 0;
+static uint64_t queueStart = 0;
+
+void queueBenchmarkTask()
+{
+    BlockQueue* queue = benchmarkQueue;
+    uint32_t frequency = benchmarkTimestampFrequency;
+    if (queue == 0 || frequency < 1000)
+        syscall_exit(0);
+    while (!benchmarkDiskDone)
+        syscall_sleep(10);
+
+    uint32_t reader = __sync_fetch_and_add(&queueReaderIds, 1);
+    if (reader == 0)
+        queueStart = ReadTimestampCounter();
+
+    const uint32_t sectors = 2048;
+    uint32_t submitted = queue->Submitted();
+    uint32_t commands = queue->Commands();
+    for (uint32_t lba = reader * QUEUE_BLOCK; lba < sectors; lba += QUEUE_READERS * QUEUE_BLOCK)
+        if (!queue->Read(lba, QUEUE_BLOCK, queueBuffers[reader]))
+            break;
+
+    if (__sync_add_and_fetch(&queueReadersDone, 1) == QUEUE_READERS)
+    {
+        uint32_t milliseconds = DivideU64(ReadTimestampCounter() - queueStart, frequency / 1000);
+        if (milliseconds == 0)
+            milliseconds = 1;
+        char report[96];
+        sprintf(report, "Disk queue: %d KB/s, %d readers, ", sectors / 2 * 1000 / milliseconds, QUEUE_READERS);
+        printf(report);
+        sprintf(report, "%d requests in %d commands\n", queue->Submitted() - submitted, queue->Commands() - commands);
+        printf(report);
+    }
+    syscall_exit(0);
+}
+
+// Filesystem-like metadata reads, the same few sectors over and over,
+// first straight from the queue, then through the buffer cache; then a
+// sequential stream through the cache, which its read-ahead runs ahead
+// of. Starts once the queue readers are done.
+static uint8_t cacheBuffer[AdvancedTechnologyAttachment::SECTOR_SIZE] __attribute__((aligned(16)));
+
+static void reportCache(const char* what, uint64_t elapsed, uint32_t frequency, uint32_t lookups, uint32_t hits)
+{
+    uint32_t microseconds = DivideU64(elapsed, frequency / 1000000);
+    char report[96];
+    printf((char*)what);
+    sprintf(report, ": %d us, %d lookups, ", microseconds, lookups);
+    printf(report);
+    sprintf(report, "hit rate %d%\n", lookups != 0 ? hits * 100 / lookups : 0);
+    printf(report);
+}
+
+void cacheBenchmarkTask()
+{
+    BlockQueue* queue = benchmarkQueue;
+    BufferCache* cache = BufferCache::activeBufferCache;
+    uint32_t frequency = benchmarkTimestampFrequency;
+    if (queue == 0 || cache == 0 || frequency < 1000000)
+        syscall_exit(0);
+    while (queueReadersDone < QUEUE_READERS)
+        syscall_sleep(10);
+
+    // Superblock, a group descriptor, a few inode and directory sectors
+    const uint32_t metadata[] = { 2, 4, 64, 65, 66, 67, 1024, 1025 };
+    const uint32_t metadataCount = sizeof(metadata) / sizeof(metadata[0]);
+    const int rounds = 100;
+
+    uint64_t start = ReadTimestampCounter();
+    for (int r = 0; r < rounds; r++)
+        for (uint32_t i = 0; i < metadataCount; i++)
+            queue->Read(metadata[i], 1, cacheBuffer);
+    reportCache("Metadata from disk", ReadTimestampCounter() - start, frequency, 0, 0);
+
+    uint32_t lookups = cache->Lookups();
+    uint32_t hits = cache->Hits();
+    start = ReadTimestampCounter();
+    for (int r = 0; r < rounds; r++)
+        for (uint32_t i = 0; i < metadataCount; i++)
+            cache->Read(queue, metadata[i], 1, cacheBuffer);
+    reportCache("Metadata cached", ReadTimestampCounter() - start, frequency,
+        cache->Lookups() - lookups, cache->Hits() - hits);
+
+    uint32_t sectors = 8192;
+    if (queue->Drive()->Sectors() < 4096 + sectors)
+        sectors = 0;
+    lookups = cache->Lookups();
+    hits = cache->Hits();
+    uint32_t readAheads = cache->ReadAheads();
+    start = ReadTimestampCounter();
+    for (uint32_t lba = 4096; lba < 4096 + sectors; lba++)
+        cache->Read(queue, lba, 1, cacheBuffer);
+    reportCache("Stream cached", ReadTimestampCounter() - start, frequency,
+        cache->Lookups() - lookups, cache->Hits() - hits);
+
+    char report[64];
+    sprintf(report, "Stream: %d blocks read ahead\n", cache->ReadAheads() - readAheads);
+    printf(report);
+    syscall_exit(0);
+}
+
+// Fork, exit and waitpid round trips per second. Runs as a task, since
+// fork needs a caller in its own address space.
+void forkBenchmarkTask()
+{
+    const int forks = 200;
+
+    uint64_t start = ReadTimestampCounter();
+    for (int i = 0; i < forks; i++)
+    {
+        int pid = syscall_fork();
+        if (pid == 0)
+            syscall_exit(0);
+        syscall_waitpid(pid);
+    }
+    uint64_t cycles = ReadTimestampCounter() - start;
+
+    char buffer[96];
+    uint32_t perFork = DivideU64(cycles, forks);
+    uint32_t frequency = task_local()->timestampFrequency;
+    sprintf(buffer, "Fork: %d cycles per fork+exit, %d per second\n",
+        perFork, perFork != 0 ? frequency / perFork : 0);
+    sysprintf(buffer);
+    syscall_exit(0);
+}
+
+// collatz() with its output queued on a system call ring. The numbers are
+// formatted into the text slot matching their ring slot, and the ring is
+// entered only when it is full, so a slot is free again when it is reused.
+struct RingWriter
+{
+    SyscallRing ring;
+    char texts[SyscallRing::ENTRIES][12];
+    uint32_t writes;
+    uint32_t traps;
+};
+
+static void ringFlush(RingWriter* writer)
+{
+    if (writer->ring.Pending() == 0)
+        return;
+    syscall_ring_enter();
+    writer->traps++;
+    SyscallCompletion completion;
+    while (writer->ring.Reap(&completion));
+}
+
+static void ringWrite(RingWriter* writer, char* text)
+{
+    if (writer->ring.Pending() == SyscallRing::ENTRIES)
+        ringFlush(writer);
+    writer->ring.Submit(SYS_WRITE, (uint32_t)text, strlen(text), 0, 0);
+    writer->writes++;
+}
+
+static void ringWriteInteger(RingWriter* writer, int number)
+{
+    if (writer->ring.Pending() == SyscallRing::ENTRIES)
+        ringFlush(writer);
+    char* text = writer->texts[writer->ring.submitTail & (SyscallRing::ENTRIES - 1)];
+    sprintf(text, "%d", number);
+    ringWrite(writer, text);
+}
+
+void collatzRing(RingWriter* writer, int n)
+{
+    ringWrite(writer, "Collatz sequence for ");
+    ringWriteInteger(writer, n);
+    ringWrite(writer, ": ");
+    while (n != 1)
+    {
+        ringWriteInteger(writer, n);
+        ringWrite(writer, ", ");
+        if (n % 2 == 0)
+            n /= 2;
+        else
+            n = 3 * n + 1;
+    }
+    ringWrite(writer, "1\n");
+    ringFlush(writer);
+}
+
+// System calls per second for the collatz output, one trap per write
+// against one trap per full ring
+void ringBenchmarkTask()
+{
+    const int n = 27;
+    RingWriter writer;
+    writer.writes = 0;
+    writer.traps = 0;
+    syscall_ring_setup(&writer.ring, 0);
+
+    uint64_t start = ReadTimestampCounter();
+    collatz(n);
+    uint64_t directCycles = ReadTimestampCounter() - start;
+
+    start = ReadTimestampCounter();
+    collatzRing(&writer, n);
+    uint64_t ringCycles = ReadTimestampCounter() - start;
+
+    uint32_t frequency = task_local()->timestampFrequency;
+    uint32_t directPerCall = DivideU64(directCycles, writer.writes);
+    uint32_t ringPerCall = DivideU64(ringCycles, writer.writes);
+
+    char buffer[128];
+    sprintf(buffer, "Collatz writes: direct %d per second, %d traps; ring %d per second, %d traps\n",
+        directPerCall != 0 ? frequency / directPerCall : 0, writer.writes,
+        ringPerCall != 0 ? frequency / ringPerCall : 0, writer.traps);
+    sysprintf(buffer);
+    syscall_exit(0);
+}
+
+// Cycles per log line of three pieces: a write per piece, one writev,
+// and the task's line buffer
+void consoleBenchmarkTask()
+{
+    const int lines = 200;
+    char number[12];
+    char buffer[96];
+
+    uint64_t start = ReadTimestampCounter();
+    for (int i = 0; i < lines; i++)
+    {
+        sprintf(number, "%d", i);
+        syscall_write("Log line ", 9);
+        syscall_write(number, strlen(number));
+        syscall_write("\n", 1);
+    }
+    uint32_t directCycles = DivideU64(ReadTimestampCounter() - start, lines);
+
+    start = ReadTimestampCounter();
+    for (int i = 0; i < lines; i++)
+    {
+        sprintf(number, "%d", i);
+        IoVector vectors[3] = { { "Log line ", 9 }, { number, strlen(number) }, { "\n", 1 } };
+        syscall_writev(vectors, 3);
+    }
+    uint32_t vectorCycles = DivideU64(ReadTimestampCounter() - start, lines);
+
+    start = ReadTimestampCounter();
+    for (int i = 0; i < lines; i++)
+    {
+        sprintf(number, "%d", i);
+        console_write("Log line ");
+        console_write(number);
+        console_write("\n");
+    }
+    uint32_t bufferedCycles = DivideU64(ReadTimestampCounter() - start, lines);
+
+    sprintf(buffer, "Console: %d cycles per line with writes, %d with writev, %d buffered\n",
+        directCycles, vectorCycles, bufferedCycles);
+    sysprintf(buffer);
+    syscall_exit(0);
+}
+
+// Round trip of a system call that does nothing, through int 0x80 and
+// through sysenter
+void syscallBenchmarkTask()
+{
+    const int calls = 10000;
+    char buffer[96];
+
+    uint64_t start = ReadTimestampCounter();
+    for (int i = 0; i < calls; i++)
+        syscall_int80(SYS_NULL, 0);
+    uint32_t interruptCycles = DivideU64(ReadTimestampCounter() - start, calls);
+
+    uint32_t sysenterCycles = 0;
+    if (task_local()->fastSyscalls)
+    {
+        start = ReadTimestampCounter();
+        for (int i = 0; i < calls; i++)
+            syscall_sysenter(SYS_NULL, 0);
+        sysenterCycles = DivideU64(ReadTimestampCounter() - start, calls);
+    }
+
+    sprintf(buffer, "Null syscall: int 0x80 %d cycles, sysenter %d cycles\n",
+        interruptCycles, sysenterCycles);
+    sysprintf(buffer);
+    syscall_exit(0);
+}
+#endif
+
+// Find a word on the boot loader's command line. Words are separated by
+// spaces. An option ending in '=' matches any value and the value is
+// returned, otherwise the word must match up to its end or its '='.
+static const char* commandLineFind(const MultibootInfo* info, const char* option)
+{
+    if (info == 0 || !(info->flags & MULTIBOOT_INFO_CMDLINE))
+        return 0;
+
+    const char* start = (const char*)info->cmdline;
+    for (const char* line = start; *line != '\0'; line++)
+    {
+        if (line != start && line[-1] != ' ')
+            continue;
+        int i = 0;
+        while (option[i] != '\0' && line[i] == option[i])
+            i++;
+        if (option[i] == '\0'
+            && (option[i - 1] == '=' || line[i] == '\0' || line[i] == ' ' || line[i] == '='))
+            return line + i;
+    }
+    return 0;
+}
+
+static bool commandLineHas(const MultibootInfo* info, const char* option)
+{
+    return commandLineFind(info, option) != 0;
+}
+
+static uint32_t commandLineNumber(const MultibootInfo* info, const char* option, uint32_t defaultValue)
+{
+    const char* value = commandLineFind(info, option);
+    if (value == 0 || *value < '0' || *value > '9')
+        return defaultValue;
+
+    uint32_t number = 0;
+    for (; *value >= '0' && *value <= '9'; value++)
+        number = number * 10 + (*value - '0');
+    return number;
 }
 
 typedef void (*constructor)();
@@ -310,35 +1172,149 @@ extern "C" void callConstructors()
 
 extern "C" void kernelMain(const void* multiboot_structure, uint32_t /*multiboot_magic*/)
 {
+    KernelLog kernelLog;
+    Console console;
+    SerialPort serial;
     printf("cagriOS\n");
 
     GlobalDescriptorTable gdt;
-    TaskManager taskManager;
+
+    // Boot with "multiboot /boot/mykernel.bin sched=mlfq" for the feedback
+    // queue scheduler, add "tickless" to stop the timer while idle and
+    // "hz=<n>" to change the tick rate. The command line is read before
+    // the page frame allocator hands out memory it may live in.
+    SchedulingPolicy policy = commandLineHas((const MultibootInfo*)multiboot_structure, "sched=mlfq")
+        ? MULTILEVEL_FEEDBACK : ROUND_ROBIN;
+    bool tickless = commandLineHas((const MultibootInfo*)multiboot_structure, "tickless");
+    uint32_t timerFrequency = commandLineNumber((const MultibootInfo*)multiboot_structure, "hz=", 100);
+
+    PageFrameAllocator pageFrameAllocator((const MultibootInfo*)multiboot_structure);
+    size_t heap = (size_t)pageFrameAllocator.AllocateFrames(PageFrameAllocator::MAX_ORDER);
+    MemoryManager memoryManager(heap, PageFrameAllocator::PAGE_SIZE << PageFrameAllocator::MAX_ORDER);
+    AddressSpace::EnablePaging();
+    char pagingBuffer[64];
+    sprintf(pagingBuffer, "Paging: %d large pages, %d small pages\n",
+        AddressSpace::largePages, AddressSpace::smallPages);
+    printf(pagingBuffer);
+
+#ifdef BENCHMARKMODE
+    benchmarkScheduler(&gdt);
+    benchmarkHeap();
+    benchmarkTimerWheel();
+    benchmarkKernelLog();
+#endif
+
+    TaskManager taskManager(policy, &gdt);
     InterruptManager interrupts(0x20, &gdt, &taskManager);
     SyscallHandler syscalls(&interrupts, 0x80, &taskManager);
+    PageFaultHandler pageFaults(&interrupts, &taskManager, &gdt);
+    // sysexit always returns to ring 3, so only with tasks running there
+    if (AddressSpace::kernelSpace != 0)
+        syscalls.EnableFastSyscalls(&gdt);
+
+    // First, so the drivers below have a clock for their timeouts
+    TimerDriver timer(&interrupts, timerFrequency);
+    timer.Activate();
+    uint32_t timestampFrequency = timer.TimestampFrequency();
+    logTimestampFrequency = timestampFrequency;
+    taskManager.SetTiming(timer.Frequency(), timestampFrequency);
+    if (tickless)
+        interrupts.EnableTicklessIdle(&timer);
 
+    // Primary IDE channel: its master drive, with bus-master DMA when the
+    // controller has it
+    PeripheralComponentInterconnectController pci;
+    BusMasterIDE ideDMA(&interrupts, &pci);
+    AdvancedTechnologyAttachment ata0m(true, 0x1F0);
+    if (ata0m.Identify())
+        ata0m.SetDMA(&ideDMA);
+    BlockQueue ata0mQueue(&ata0m);
+    BufferCache bufferCache;
+
+    Task logDrain(&gdt, logTask, false);
+    taskManager.AddTask(&logDrain);
+    Task writeBack(&gdt, writeBackTask, false);
+    taskManager.AddTask(&writeBack);
+    pioQueue = &ata0mQueue;
+    Task pio(&gdt, pioTask, false);
+    if (ata0m.Present() && !ata0m.UsesDMA())
+        taskManager.AddTask(&pio);
     Task longRunningTask(&gdt, longRunningProgramTask);
     Task collatzTask2(&gdt, collatzTask);
     
         taskManager.AddTask(&longRunningTask);
     taskManager.AddTask(&collatzTask2);
+#ifdef BENCHMARKMODE
+    Task forkBenchmark(&gdt, forkBenchmarkTask);
+    taskManager.AddTask(&forkBenchmark);
+    Task syscallBenchmark(&gdt, syscallBenchmarkTask);
+    taskManager.AddTask(&syscallBenchmark);
+    Task ringBenchmark(&gdt, ringBenchmarkTask);
+    taskManager.AddTask(&ringBenchmark);
+    Task consoleBenchmark(&gdt, consoleBenchmarkTask);
+    taskManager.AddTask(&consoleBenchmark);
+    benchmarkDrive = ata0m.Present() ? &ata0m : 0;
+    benchmarkDMA = &ideDMA;
+    benchmarkTimestampFrequency = timestampFrequency;
+    Task diskBenchmark(&gdt, diskBenchmarkTask, false);
+    taskManager.AddTask(&diskBenchmark);
+    benchmarkQueue = ata0m.Present() ? &ata0mQueue : 0;
+    Task queueBenchmark1(&gdt, queueBenchmarkTask, false);
+    Task queueBenchmark2(&gdt, queueBenchmarkTask, false);
+    Task queueBenchmark3(&gdt, queueBenchmarkTask, false);
+    Task queueBenchmark4(&gdt, queueBenchmarkTask, false);
+    taskManager.AddTask(&queueBenchmark1);
+    taskManager.AddTask(&queueBenchmark2);
+    taskManager.AddTask(&queueBenchmark3);
+    taskManager.AddTask(&queueBenchmark4);
+    Task cacheBenchmark(&gdt, cacheBenchmarkTask, false);
+    taskManager.AddTask(&cacheBenchmark);
+#endif
 
 
     interrupts.Activate();
 
     printf("cagriOS22\n");
 
+    // From here on this is the idle task: it only runs when no task is
+    // ready. It reports at most once a second and halts until the next
+    // interrupt.
+    uint64_t lastReport = 0;
     while (1)
     {
+        uint64_t now = ReadTimestampCounter();
+        if (now - lastReport < timestampFrequency)
+        {
+            asm volatile("hlt");
+            continue;
+        }
+        lastReport = now;
+
         // Debugging: Print current task index
-        char buffer[32];
+        char buffer[48];
         sprintf(buffer, "Current Task: %d\n", taskManager.getCurrentTask());
         printf(buffer);
+
+        // Heap health
+        HeapStats heapStats;
+        char heapBuffer[96];
+        if (!memoryManager.Verify(&heapStats))
+            printf("HEAP CORRUPTED\n");
+        sprintf(heapBuffer, "Heap: %d used, %d free, largest %d, frag %d\n",
+            heapStats.bytesInUse, heapStats.bytesFree, heapStats.largestFreeBlock, heapStats.fragmentation);
+        printf(heapBuffer);
+
+        taskManager.PrintProcessTable();
+
+        sprintf(buffer, "Idle ticks avoided: %d\n", interrupts.IdleTicksAvoided());
+        printf(buffer);
+
+        sprintf(heapBuffer, "Pages: %d shared, %d copied, %d committed on demand\n",
+            AddressSpace::pagesShared, AddressSpace::pagesCopied, AddressSpace::pagesCommitted);
+        printf(heapBuffer);
         
 #ifdef GRAPHICSMODE
         desktop.Draw(&vga);
 #endif
-
-        delay(1000);  // 1 saniyelik gecikme
     }
 }
@@ -0,0 +1,83 @@
+#include <kernellog.h>
+#include <common/cpu.h>
+#include <common/string.h>
+
+using namespace myos;
+using namespace myos::common;
+
+KernelLog* KernelLog::activeKernelLog = 0;
+
+KernelLog::KernelLog()
+{
+    activeKernelLog = this;
+    for (uint32_t i = 0; i < ENTRIES; i++)
+        records[i].sequence = 0;
+    head = 0;
+    tail = 0;
+    dropped = 0;
+}
+
+KernelLog::~KernelLog()
+{
+    if (activeKernelLog == this)
+        activeKernelLog = 0;
+}
+
+void KernelLog::Write(LogLevel level, const char* text, size_t length)
+{
+    uint64_t now = ReadTimestampCounter();
+    while (length > 0)
+    {
+        uint32_t size = length < LogRecord::TEXT_SIZE ? length : LogRecord::TEXT_SIZE;
+
+        // Whoever interrupts us gets the next record, so the slot is ours
+        uint32_t position = __sync_fetch_and_add(&head, 1);
+        LogRecord* record = &records[position & (ENTRIES - 1)];
+        record->sequence = 0;
+        asm volatile("" : : : "memory");
+        record->level = level;
+        record->length = size;
+        record->timestamp = now;
+        memcpy(record->text, text, size);
+        asm volatile("" : : : "memory"); // publish the text before the sequence
+        record->sequence = position + 1;
+
+        text += size;
+        length -= size;
+    }
+}
+
+bool KernelLog::Read(LogRecord* record)
+{
+    while (true)
+    {
+        uint32_t written = head;
+        if (tail == written)
+            return false;
+
+        // Lapped by the writers: skip to the oldest record still there
+        if (written - tail > ENTRIES)
+        {
+            dropped += written - ENTRIES - tail;
+            tail = written - ENTRIES;
+        }
+
+        LogRecord* slot = &records[tail & (ENTRIES - 1)];
+        uint32_t sequence = slot->sequence;
+        if (sequence == 0 || (int32_t)(sequence - (tail + 1)) < 0)
+            return false; // reserved, but not written yet
+
+        if (sequence == tail + 1)
+        {
+            memcpy(record, slot, sizeof(LogRecord));
+            asm volatile("" : : : "memory");
+            // Still the same record, so the copy is whole
+            if (slot->sequence == tail + 1)
+            {
+                tail++;
+                return true;
+            }
+        }
+        // Overwritten by a later lap; the next look at head shows by how much
+    }
+}
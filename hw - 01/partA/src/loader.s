@@ -29,6 +29,9 @@ _stop:
 
 
 .section .bss
+.global kernel_stack_bottom
+.global kernel_stack
+kernel_stack_bottom:
 .space 2*1024*1024; # 2 MiB
 kernel_stack:
 
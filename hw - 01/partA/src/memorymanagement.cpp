@@ -1,4 +1,6 @@
 #include <memorymanagement.h>
+#include <pageframeallocator.h>
+#include <common/cpu.h>
 
 using namespace myos::common;
 using namespace myos;
@@ -12,21 +14,16 @@ MemoryManager::MemoryManager(size_t start, size_t size)
     // Set the active memory manager to this instance
     activeMemoryManager = this;
 
-    // If the size is less than the size of a MemoryChunk, set first to 0
-    if (size < sizeof(MemoryChunk))
-    {
-        first = 0;
-    }
-    else
-    {
-        // Initialize the first memory chunk
-        first = (MemoryChunk*)start;
+    for (int i = 0; i < NUM_BINS; i++)
+        bins[i] = 0;
+    for (int i = 0; i < (NUM_BINS + 31) / 32; i++)
+        binMap[i] = 0;
 
-        first->allocated = false;
-        first->prev = 0;
-        first->next = 0;
-        first->size = size - sizeof(MemoryChunk);
-    }
+    regions = 0;
+    heapLow = ~(size_t)0;
+    heapHigh = 0;
+    bytesInUse = 0;
+    AddRegion(start, size);
 }
 
 // Destructor for the MemoryManager class
@@ -37,69 +34,476 @@ MemoryManager::~MemoryManager()
         activeMemoryManager = 0;
 }
 
+// Hand a block of memory to the heap as one free chunk
+void MemoryManager::AddRegion(size_t start, size_t size)
+{
+    if (start == 0)
+        return;
+
+    // Align both ends of the region
+    size_t end = (start + size) & ~(ALIGNMENT - 1);
+    start = (start + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    // The region header, the padding in front of the first header and
+    // the end marker have to leave room for at least one chunk
+    size_t chunks = start + sizeof(MemoryRegion) + ALIGNMENT - sizeof(MemoryChunk);
+    size_t marker = end - sizeof(MemoryChunk);
+    if (end <= start || marker < chunks + MIN_CHUNK_SIZE)
+        return;
+
+    MemoryRegion* region = (MemoryRegion*)start;
+    region->size = end - start;
+    region->next = regions;
+    regions = region;
+
+    if (start < heapLow)
+        heapLow = start;
+    if (end > heapHigh)
+        heapHigh = end;
+
+    // Nothing lies in front of the first chunk and nothing behind the end
+    // marker, so chunks never merge across regions
+    ((MemoryChunk*)marker)->sizeAndFlags = CHUNK_ALLOCATED;
+    MemoryChunk* chunk = (MemoryChunk*)chunks;
+    chunk->sizeAndFlags = CHUNK_PREV_ALLOCATED;
+    MakeFree(chunk, marker - chunks);
+}
+
+// Get more memory from the page frame allocator
+bool MemoryManager::Grow(size_t size)
+{
+    PageFrameAllocator* frames = PageFrameAllocator::activePageFrameAllocator;
+    if (frames == 0)
+        return false;
+
+    int order = PageFrameAllocator::OrderForSize(size + sizeof(MemoryRegion) + 2 * ALIGNMENT);
+    if (order < 0)
+        return false;
+    if (order < HEAP_GROW_ORDER)
+        order = HEAP_GROW_ORDER;
+
+    void* block = frames->AllocateFrames(order);
+    if (block == 0)
+        return false;
+
+    AddRegion((size_t)block, PageFrameAllocator::PAGE_SIZE << order);
+    return true;
+}
+
+// Chunk size needed to hold a payload of size bytes, 0 if that does
+// not fit in a size_t
+size_t MemoryManager::ChunkSizeFor(size_t size)
+{
+    if (size > ~(size_t)0 - sizeof(MemoryChunk) - ALIGNMENT)
+        return 0;
+    size = (size + sizeof(MemoryChunk) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    return size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : size;
+}
+
+// Map a chunk size to its size class
+int MemoryManager::BinIndex(size_t size)
+{
+    if (size < SMALL_LIMIT)
+        return size / ALIGNMENT;
+
+    // One bin per power of two, starting at SMALL_LIMIT
+    int log2 = 31 - __builtin_clz(size);
+    return NUM_SMALL_BINS + log2 - (31 - __builtin_clz(SMALL_LIMIT));
+}
+
+// Find the first non-empty bin at or above index, or -1
+int MemoryManager::FindNonEmptyBin(int index)
+{
+    for (int word = index / 32; word < (NUM_BINS + 31) / 32; word++)
+    {
+        uint32_t bits = binMap[word];
+        if (word == index / 32)
+            bits &= ~0u << (index % 32);
+        if (bits != 0)
+            return word * 32 + __builtin_ctz(bits);
+    }
+    return -1;
+}
+
+// Push a free chunk onto the front of its size class list
+void MemoryManager::InsertFree(MemoryChunk* chunk)
+{
+    int index = BinIndex(ChunkSize(chunk));
+    FreeMemoryChunk* freeChunk = (FreeMemoryChunk*)chunk;
+
+    freeChunk->prevFree = 0;
+    freeChunk->nextFree = bins[index];
+    if (bins[index] != 0)
+        bins[index]->prevFree = freeChunk;
+    bins[index] = freeChunk;
+
+    binMap[index / 32] |= 1u << (index % 32);
+}
+
+// Unlink a free chunk from its size class list
+void MemoryManager::RemoveFree(MemoryChunk* chunk)
+{
+    int index = BinIndex(ChunkSize(chunk));
+    FreeMemoryChunk* freeChunk = (FreeMemoryChunk*)chunk;
+
+    if (freeChunk->prevFree != 0)
+        freeChunk->prevFree->nextFree = freeChunk->nextFree;
+    else
+        bins[index] = freeChunk->nextFree;
+    if (freeChunk->nextFree != 0)
+        freeChunk->nextFree->prevFree = freeChunk->prevFree;
+
+    if (bins[index] == 0)
+        binMap[index / 32] &= ~(1u << (index % 32));
+}
+
+// Turn chunk into a free chunk of the given size, merging it with the
+// chunk behind it if that one is free too. The chunk in front of it is
+// the caller's business.
+void MemoryManager::MakeFree(MemoryChunk* chunk, size_t size)
+{
+    MemoryChunk* next = (MemoryChunk*)((size_t)chunk + size);
+    if ((next->sizeAndFlags & CHUNK_ALLOCATED) == 0)
+    {
+        RemoveFree(next);
+        size += ChunkSize(next);
+        next->sizeAndFlags = 0;
+        next = (MemoryChunk*)((size_t)chunk + size);
+    }
+
+    chunk->sizeAndFlags = size | (chunk->sizeAndFlags & CHUNK_PREV_ALLOCATED);
+    ((size_t*)next)[-1] = size;
+    next->sizeAndFlags &= ~CHUNK_PREV_ALLOCATED;
+    InsertFree(chunk);
+}
+
+// Find a free chunk of at least size bytes
+MemoryChunk* MemoryManager::FindFit(size_t size)
+{
+    MemoryChunk* result = 0;
+    int index = BinIndex(size);
+
+    // Small sizes have exact bins, so any chunk there fits. Large bins
+    // cover a range of sizes and have to be searched for a fit.
+    if (index < NUM_SMALL_BINS)
+    {
+        result = bins[index];
+    }
+    else
+    {
+        for (FreeMemoryChunk* chunk = bins[index]; chunk != 0 && result == 0; chunk = chunk->nextFree)
+            if (ChunkSize(chunk) >= size)
+                result = chunk;
+    }
+
+    // Every chunk in a higher bin is big enough, take the first one
+    if (result == 0)
+    {
+        int larger = FindNonEmptyBin(index + 1);
+        if (larger >= 0)
+            result = bins[larger];
+    }
+
+    return result;
+}
+
 // Allocate memory of a given size
 void* MemoryManager::malloc(size_t size)
 {
-    MemoryChunk* result = 0;
+    size = ChunkSizeFor(size);
+    if (size == 0)
+        return 0;
 
-    // Find a suitable free memory chunk
-    for (MemoryChunk* chunk = first; chunk != 0 && result == 0; chunk = chunk->next)
-        if (!chunk->allocated && chunk->size > size)
-            result = chunk;
+    MemoryChunk* result = FindFit(size);
+    if (result == 0 && Grow(size))
+        result = FindFit(size);
 
     // If no suitable chunk is found, return 0
     if (result == 0)
         return 0;
 
-    // If the chunk is larger than required, split it
-    if (result->size >= size + sizeof(MemoryChunk) + 1)
+    RemoveFree(result);
+
+    // Mark the chunk and tell the chunk behind it
+    result->sizeAndFlags |= CHUNK_ALLOCATED;
+    NextChunk(result)->sizeAndFlags |= CHUNK_PREV_ALLOCATED;
+    bytesInUse += ChunkSize(result);
+
+    Split(result, size);
+    return Payload(result);
+}
+
+// Give the tail of an allocated chunk beyond size back to the heap
+void MemoryManager::Split(MemoryChunk* chunk, size_t size)
+{
+    size_t chunkSize = ChunkSize(chunk);
+    if (chunkSize < size + MIN_CHUNK_SIZE)
+        return;
+
+    chunk->sizeAndFlags = size | (chunk->sizeAndFlags & CHUNK_FLAGS);
+    bytesInUse -= chunkSize - size;
+
+    MemoryChunk* rest = NextChunk(chunk);
+    rest->sizeAndFlags = CHUNK_PREV_ALLOCATED;
+    MakeFree(rest, chunkSize - size);
+}
+
+// Allocate memory whose address is a multiple of align (a power of two)
+void* MemoryManager::malloc_aligned(size_t size, size_t align)
+{
+    if (align <= ALIGNMENT)
+        return malloc(size);
+
+    // Room for the worst-case gap in front of the aligned address
+    size = ChunkSizeFor(size);
+    if (size == 0 || align > (~(size_t)0 - size) / 2)
+        return 0;
+    size_t ptr = (size_t)malloc(size + 2 * align);
+    if (ptr == 0)
+        return 0;
+
+    MemoryChunk* chunk = ChunkFor((void*)ptr);
+    size_t aligned = (ptr + align - 1) & ~(align - 1);
+
+    // The gap must be able to hold a free chunk of its own
+    if (aligned != ptr && aligned - ptr < MIN_CHUNK_SIZE)
+        aligned += align;
+
+    if (aligned != ptr)
+    {
+        // Carve a new chunk starting at the aligned address and give the
+        // gap in front of it back to the heap
+        size_t gap = aligned - ptr;
+        MemoryChunk* result = (MemoryChunk*)(aligned - sizeof(MemoryChunk));
+        result->sizeAndFlags = (ChunkSize(chunk) - gap) | CHUNK_ALLOCATED | CHUNK_PREV_ALLOCATED;
+        chunk->sizeAndFlags = gap | (chunk->sizeAndFlags & CHUNK_FLAGS);
+        free((void*)ptr);
+        chunk = result;
+    }
+
+    Split(chunk, size);
+    return (void*)aligned;
+}
+
+// Allocate zeroed memory for count objects of size bytes each
+void* MemoryManager::calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > ~(size_t)0 / size)
+        return 0;
+
+    size *= count;
+    uint32_t* result = (uint32_t*)malloc(size);
+    if (result == 0)
+        return 0;
+
+    // Payloads are word aligned and a whole number of words long
+    for (size_t i = 0; i < (size + sizeof(uint32_t) - 1) / sizeof(uint32_t); i++)
+        result[i] = 0;
+    return result;
+}
+
+// Resize an allocation, in place whenever the chunk or the free chunk
+// behind it has room
+void* MemoryManager::realloc(void* ptr, size_t size)
+{
+    if (ptr == 0)
+        return malloc(size);
+    if (size == 0)
+    {
+        free(ptr);
+        return 0;
+    }
+
+    MemoryChunk* chunk = ChunkFor(ptr);
+    if (chunk == 0)
+        return 0;
+
+    size_t needed = ChunkSizeFor(size);
+    if (needed == 0)
+        return 0;
+    size_t current = ChunkSize(chunk);
+
+    // Growing: swallow the next chunk if it is free and big enough
+    MemoryChunk* next = NextChunk(chunk);
+    if (needed > current && (next->sizeAndFlags & CHUNK_ALLOCATED) == 0
+        && current + ChunkSize(next) >= needed)
     {
-        MemoryChunk* temp = (MemoryChunk*)((size_t)result + sizeof(MemoryChunk) + size);
+        size_t nextSize = ChunkSize(next);
+        RemoveFree(next);
+        next->sizeAndFlags = 0;
 
-        temp->allocated = false;
-        temp->size = result->size - size - sizeof(MemoryChunk);
-        temp->prev = result;
-        temp->next = result->next;
-        if (temp->next != 0)
-            temp->next->prev = temp;
+        chunk->sizeAndFlags += nextSize;
+        NextChunk(chunk)->sizeAndFlags |= CHUNK_PREV_ALLOCATED;
+        bytesInUse += nextSize;
+        current += nextSize;
+    }
 
-        result->size = size;
-        result->next = temp;
+    // Shrinking, or grown in place: hand back what is not needed
+    if (needed <= current)
+    {
+        Split(chunk, needed);
+        return ptr;
     }
 
-    // Mark the chunk as allocated
-    result->allocated = true;
-    return (void*)((size_t)result + sizeof(MemoryChunk));
+    // Otherwise move the data to a new chunk
+    uint32_t* result = (uint32_t*)malloc(size);
+    if (result == 0)
+        return 0;
+
+    uint32_t* source = (uint32_t*)ptr;
+    for (size_t i = 0; i < (current - sizeof(MemoryChunk)) / sizeof(uint32_t); i++)
+        result[i] = source[i];
+
+    free(ptr);
+    return result;
+}
+
+// Map a pointer handed out by malloc back to its chunk, or 0 if it does
+// not look like one
+MemoryChunk* MemoryManager::ChunkFor(void* ptr)
+{
+    size_t address = (size_t)ptr;
+    if (address % ALIGNMENT != 0 || address < heapLow || address >= heapHigh)
+        return 0;
+
+    MemoryChunk* chunk = (MemoryChunk*)(address - sizeof(MemoryChunk));
+    size_t size = ChunkSize(chunk);
+    if ((chunk->sizeAndFlags & CHUNK_ALLOCATED) == 0 || size < MIN_CHUNK_SIZE
+        || size % ALIGNMENT != 0 || size > heapHigh - address)
+        return 0;
+
+    // The chunk behind it has to agree that this chunk is allocated
+    if ((NextChunk(chunk)->sizeAndFlags & CHUNK_PREV_ALLOCATED) == 0)
+        return 0;
+
+    return chunk;
 }
 
 // Free previously allocated memory
 void MemoryManager::free(void* ptr)
 {
-    // Get the memory chunk from the pointer
-    MemoryChunk* chunk = (MemoryChunk*)((size_t)ptr - sizeof(MemoryChunk));
+    if (ptr == 0)
+        return;
 
-    // Mark the chunk as free
-    chunk->allocated = false;
+    // Ignore pointers that were not handed out by this heap, including
+    // double frees
+    MemoryChunk* chunk = ChunkFor(ptr);
+    if (chunk == 0)
+        return;
 
-    // Merge with the previous chunk if it is free
-    if (chunk->prev != 0 && !chunk->prev->allocated)
+    size_t size = ChunkSize(chunk);
+    bytesInUse -= size;
+
+    // Merge with the previous chunk if it is free; its size is in the
+    // footer right in front of this chunk
+    if ((chunk->sizeAndFlags & CHUNK_PREV_ALLOCATED) == 0)
     {
-        chunk->prev->next = chunk->next;
-        chunk->prev->size += chunk->size + sizeof(MemoryChunk);
-        if (chunk->next != 0)
-            chunk->next->prev = chunk->prev;
+        MemoryChunk* prev = PrevChunk(chunk);
+        RemoveFree(prev);
+        size += ChunkSize(prev);
+        chunk->sizeAndFlags = 0;
+        chunk = prev;
+    }
+
+    // MakeFree merges with the next chunk and files the result
+    MakeFree(chunk, size);
+}
+
+// Walk every region and check the heap invariants. Fills in stats if
+// given and returns false at the first inconsistency. Interrupts stay off
+// meanwhile, so no task changes the lists under the walk.
+bool MemoryManager::Verify(HeapStats* stats)
+{
+    uint32_t flags = DisableInterrupts();
+    HeapStats result;
+    result.totalBytes = 0;
+    result.bytesInUse = 0;
+    result.bytesFree = 0;
+    result.largestFreeBlock = 0;
+    result.usedChunks = 0;
+    result.freeChunks = 0;
+    result.regions = 0;
+    result.fragmentation = 0;
+
+    bool consistent = true;
+
+    for (MemoryRegion* region = regions; region != 0 && consistent; region = region->next)
+    {
+        size_t start = (size_t)region;
+        size_t marker = start + region->size - sizeof(MemoryChunk);
+        result.regions++;
+        result.totalBytes += region->size;
+
+        bool prevAllocated = true;
+        MemoryChunk* chunk = (MemoryChunk*)(start + sizeof(MemoryRegion) + ALIGNMENT - sizeof(MemoryChunk));
+        while ((size_t)chunk < marker)
+        {
+            size_t size = ChunkSize(chunk);
+            bool allocated = (chunk->sizeAndFlags & CHUNK_ALLOCATED) != 0;
+
+            // Sizes must be sane, the flag must match the chunk in front
+            // and no two free chunks may be neighbours
+            if (size < MIN_CHUNK_SIZE || size > marker - (size_t)chunk
+                || ((chunk->sizeAndFlags & CHUNK_PREV_ALLOCATED) != 0) != prevAllocated
+                || (!allocated && !prevAllocated))
+            {
+                consistent = false;
+                break;
+            }
 
-        chunk = chunk->prev;
+            if (allocated)
+            {
+                result.usedChunks++;
+                result.bytesInUse += size;
+            }
+            else
+            {
+                // The footer must repeat the size
+                if (((size_t*)NextChunk(chunk))[-1] != size)
+                {
+                    consistent = false;
+                    break;
+                }
+                result.freeChunks++;
+                result.bytesFree += size;
+                if (size > result.largestFreeBlock)
+                    result.largestFreeBlock = size;
+            }
+
+            prevAllocated = allocated;
+            chunk = NextChunk(chunk);
+        }
+
+        // The walk has to land exactly on the end marker
+        if ((size_t)chunk != marker || ChunkSize(chunk) != 0
+            || ((chunk->sizeAndFlags & CHUNK_PREV_ALLOCATED) != 0) != prevAllocated)
+            consistent = false;
     }
 
-    // Merge with the next chunk if it is free
-    if (chunk->next != 0 && !chunk->next->allocated)
+    // Every free chunk must be filed in the right bin, and nothing else
+    uint32_t binned = 0;
+    for (int i = 0; i < NUM_BINS && consistent; i++)
     {
-        chunk->size += chunk->next->size + sizeof(MemoryChunk);
-        chunk->next = chunk->next->next;
-        if (chunk->next != 0)
-            chunk->next->prev = chunk;
+        if ((bins[i] != 0) != ((binMap[i / 32] >> (i % 32)) & 1))
+            consistent = false;
+        for (FreeMemoryChunk* chunk = bins[i]; chunk != 0 && consistent; chunk = chunk->nextFree)
+        {
+            if ((chunk->sizeAndFlags & CHUNK_ALLOCATED) != 0 || BinIndex(ChunkSize(chunk)) != i
+                || (chunk->nextFree != 0 && chunk->nextFree->prevFree != chunk))
+                consistent = false;
+            binned++;
+        }
     }
+    if (binned != result.freeChunks || result.bytesInUse != bytesInUse)
+        consistent = false;
+
+    if (result.bytesFree != 0)
+        result.fragmentation = (result.bytesFree - result.largestFreeBlock) / ((result.bytesFree + 99) / 100);
+
+    if (stats != 0)
+        *stats = result;
+    RestoreInterrupts(flags);
+    return consistent;
 }
 
 // Overloaded new operator for single object allocation
@@ -137,3 +541,224 @@ void operator delete[](void* ptr)
     if (myos::MemoryManager::activeMemoryManager != 0)
         myos::MemoryManager::activeMemoryManager->free(ptr);
 }
+
+
+
+// Constructor for the Arena class
+Arena::Arena()
+{
+    blocks = 0;
+    bytesAllocated = 0;
+}
+
+// Destructor for the Arena class
+Arena::~Arena()
+{
+    Release();
+}
+
+// Allocate from the current block, starting a new one when it is full
+void* Arena::Allocate(size_t size)
+{
+    size = (size + MemoryManager::ALIGNMENT - 1) & ~(MemoryManager::ALIGNMENT - 1);
+
+    if (blocks == 0 || blocks->size - blocks->used < size)
+    {
+        PageFrameAllocator* frames = PageFrameAllocator::activePageFrameAllocator;
+        if (frames == 0)
+            return 0;
+
+        size_t headerSize = (sizeof(ArenaBlock) + MemoryManager::ALIGNMENT - 1) & ~(MemoryManager::ALIGNMENT - 1);
+        int order = PageFrameAllocator::OrderForSize(headerSize + size);
+        if (order < 0)
+            return 0;
+
+        ArenaBlock* block = (ArenaBlock*)frames->AllocateFrames(order);
+        if (block == 0)
+            return 0;
+
+        block->size = PageFrameAllocator::PAGE_SIZE << order;
+        block->used = headerSize;
+        block->next = blocks;
+        blocks = block;
+    }
+
+    void* result = (void*)((size_t)blocks + blocks->used);
+    blocks->used += size;
+    bytesAllocated += size;
+    return result;
+}
+
+// Give every block back to the page frame allocator
+void Arena::Release()
+{
+    while (blocks != 0)
+    {
+        ArenaBlock* block = blocks;
+        blocks = block->next;
+        if (PageFrameAllocator::activePageFrameAllocator != 0)
+            PageFrameAllocator::activePageFrameAllocator->FreeFrames(block);
+    }
+    bytesAllocated = 0;
+}
+
+// Constructor for the SlabAllocator class
+SlabAllocator::SlabAllocator(size_t objectSize)
+{
+    // Free objects hold the free list link, keep them aligned too
+    if (objectSize < sizeof(void*))
+        objectSize = sizeof(void*);
+    this->objectSize = (objectSize + MemoryManager::ALIGNMENT - 1) & ~(MemoryManager::ALIGNMENT - 1);
+    headerSize = (sizeof(Slab) + MemoryManager::ALIGNMENT - 1) & ~(MemoryManager::ALIGNMENT - 1);
+
+    // Use the smallest power-of-two slab that holds an object, and grow
+    // it while more than an eighth of the slab would be left over
+    slabSize = PAGE_SIZE;
+    while (slabSize < headerSize + this->objectSize)
+        slabSize *= 2;
+    while (slabSize < MAX_SLAB_SIZE
+        && (slabSize - headerSize) % this->objectSize > slabSize / 8)
+        slabSize *= 2;
+    objectsPerSlab = (slabSize - headerSize) / this->objectSize;
+
+    partialSlabs = 0;
+    fullSlabs = 0;
+    emptySlab = 0;
+    objectsInUse = 0;
+    slabsHeld = 0;
+}
+
+// Destructor for the SlabAllocator class
+// Objects still allocated go with their slabs
+SlabAllocator::~SlabAllocator()
+{
+    Slab* lists[2] = { partialSlabs, fullSlabs };
+    for (int i = 0; i < 2; i++)
+    {
+        Slab* slab = lists[i];
+        while (slab != 0)
+        {
+            Slab* next = slab->next;
+            ReleaseSlab(slab);
+            slab = next;
+        }
+    }
+    partialSlabs = 0;
+    fullSlabs = 0;
+    objectsInUse = 0;
+
+    if (emptySlab != 0)
+        ReleaseSlab(emptySlab);
+    emptySlab = 0;
+}
+
+void SlabAllocator::Link(Slab** list, Slab* slab)
+{
+    slab->prev = 0;
+    slab->next = *list;
+    if (*list != 0)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+void SlabAllocator::Unlink(Slab** list, Slab* slab)
+{
+    if (slab->prev != 0)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next != 0)
+        slab->next->prev = slab->prev;
+}
+
+// Get a new slab from the page frame allocator. Buddy blocks are
+// aligned to their size, which is what Free relies on.
+Slab* SlabAllocator::NewSlab()
+{
+    if (PageFrameAllocator::activePageFrameAllocator == 0)
+        return 0;
+
+    Slab* slab = (Slab*)PageFrameAllocator::activePageFrameAllocator->AllocateFrames(PageFrameAllocator::OrderForSize(slabSize));
+    if (slab == 0)
+        return 0;
+
+    slab->next = 0;
+    slab->prev = 0;
+    slab->freeObjects = 0;
+    slab->nextUnused = 0;
+    slab->inUse = 0;
+    slabsHeld++;
+    return slab;
+}
+
+// Give a slab back to the page frame allocator
+void SlabAllocator::ReleaseSlab(Slab* slab)
+{
+    slabsHeld--;
+    if (PageFrameAllocator::activePageFrameAllocator != 0)
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(slab);
+}
+
+// Allocate one object from the cache
+void* SlabAllocator::Allocate()
+{
+    Slab* slab = partialSlabs;
+    if (slab == 0)
+    {
+        // Reuse the cached empty slab before asking the heap
+        slab = emptySlab;
+        emptySlab = 0;
+        if (slab == 0)
+            slab = NewSlab();
+        if (slab == 0)
+            return 0;
+        Link(&partialSlabs, slab);
+    }
+
+    // Prefer recycled objects, then objects never handed out before
+    void* object = slab->freeObjects;
+    if (object != 0)
+        slab->freeObjects = *(void**)object;
+    else
+        object = (void*)((size_t)slab + headerSize + slab->nextUnused++ * objectSize);
+
+    slab->inUse++;
+    objectsInUse++;
+
+    if (slab->inUse == objectsPerSlab)
+    {
+        Unlink(&partialSlabs, slab);
+        Link(&fullSlabs, slab);
+    }
+
+    return object;
+}
+
+// Return an object to its slab
+void SlabAllocator::Free(void* object)
+{
+    if (object == 0)
+        return;
+
+    Slab* slab = (Slab*)((size_t)object & ~(slabSize - 1));
+
+    if (slab->inUse == objectsPerSlab)
+    {
+        Unlink(&fullSlabs, slab);
+        Link(&partialSlabs, slab);
+    }
+
+    *(void**)object = slab->freeObjects;
+    slab->freeObjects = object;
+    slab->inUse--;
+    objectsInUse--;
+
+    // Keep one empty slab around to absorb alloc/free churn
+    if (slab->inUse == 0)
+    {
+        Unlink(&partialSlabs, slab);
+        if (emptySlab != 0)
+            ReleaseSlab(emptySlab);
+        emptySlab = slab;
+    }
+}
@@ -1,15 +1,94 @@
 #include <multitasking.h>
 #include <memorymanagement.h>
+#include <pageframeallocator.h>
+#include <paging.h>
+#include <syscalls.h>
+#include <common/cpu.h>
+#include <common/string.h>
+#include <kernellog.h>
 
 using namespace myos;
 using namespace myos::common;
 
-extern void sysprintf(char* str);
+void printf(char* str);
+void printk(LogLevel level, char* str);
 void sprintf(char* buffer, const char* format, ...);
 
-Task::Task(GlobalDescriptorTable *gdt, void (*entrypoint)())
+static uint8_t* AllocateStack()
 {
-    cpustate = (CPUState*)(stack + 4096 - sizeof(CPUState));
+    if (PageFrameAllocator::activePageFrameAllocator == 0)
+        return 0;
+    return (uint8_t*)PageFrameAllocator::activePageFrameAllocator->AllocateFrames(
+        PageFrameAllocator::OrderForSize(Task::STACK_SIZE));
+}
+
+static void FreeStack(uint8_t* stack)
+{
+    if (AddressSpace::IsKernelStack(stack))
+        AddressSpace::FreeKernelStack(stack);
+    else if (stack != 0 && PageFrameAllocator::activePageFrameAllocator != 0)
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(stack);
+}
+
+// A zeroed page the task can write
+static bool MapUserPage(AddressSpace* addressSpace, uint32_t virtualAddress)
+{
+    uint8_t* page = AllocateStack();
+    if (page == 0)
+        return false;
+    memset(page, 0, AddressSpace::PAGE_SIZE);
+    if (!addressSpace->Map(virtualAddress, (uint32_t)page, AddressSpace::PAGE_WRITABLE | AddressSpace::PAGE_USER))
+    {
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(page);
+        return false;
+    }
+    return true;
+}
+
+// With paging on, the task starts in ring 3 on a stack at the top of its
+// user half. Only the top page of the stack is there from the start, the
+// rest comes on demand. Its first switch irets from the frame on its
+// kernel stack. A task that cannot get its address space or stack stays
+// FINISHED, and AddTask refuses it; one asked for in ring 3 never falls
+// back to ring 0.
+Task::Task(GlobalDescriptorTable *gdt, void (*entrypoint)(), bool userMode)
+{
+    taskState = FINISHED;
+    cpustate = 0;
+    stack = 0;
+
+    if (userMode && AddressSpace::kernelSpace != 0)
+    {
+        addressSpace = new AddressSpace();
+        if (addressSpace == 0 || !addressSpace->IsValid())
+        {
+            delete addressSpace;
+            addressSpace = 0;
+            return;
+        }
+        addressSpace->Reserve(AddressSpace::USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE);
+        if (!MapUserPage(addressSpace, AddressSpace::USER_STACK_TOP - STACK_SIZE)
+            || !MapUserPage(addressSpace, AddressSpace::TASK_LOCAL_BASE))
+        {
+            // Also frees whatever was mapped already
+            delete addressSpace;
+            addressSpace = 0;
+            return;
+        }
+    }
+
+    // A kernel task runs all its code on this stack, not just handlers
+    if (addressSpace == 0)
+    {
+        stack = AddressSpace::AllocateKernelStack();
+        if (stack != 0)
+            stackSize = AddressSpace::KERNEL_STACK_SIZE;
+    }
+    if (stack == 0)
+        stack = AllocateStack();
+    if (stack == 0)
+        return;
+    cpustate = (CPUState*)(stack + stackSize - sizeof(CPUState));
     
     cpustate->eax = 0;
     cpustate->ebx = 0;
@@ -20,73 +99,372 @@ Task::Task(GlobalDescriptorTable *gdt, void (*entrypoint)())
     cpustate->edi = 0;
     cpustate->ebp = 0;
     
+    cpustate->error = 0;
     cpustate->eip = (uint32_t)entrypoint;
-    cpustate->cs = gdt->CodeSegmentSelector();
     cpustate->eflags = 0x202;
-    cpustate->esp = (uint32_t)stack + 4096;
-    cpustate->ss = gdt->DataSegmentSelector();
+    if (addressSpace != 0)
+    {
+        cpustate->cs = gdt->UserCodeSegmentSelector();
+        cpustate->esp = AddressSpace::USER_STACK_TOP;
+        cpustate->ss = gdt->UserDataSegmentSelector();
+    }
+    else
+    {
+        cpustate->cs = gdt->CodeSegmentSelector();
+        cpustate->esp = (uint32_t)stack + stackSize;
+        cpustate->ss = gdt->DataSegmentSelector();
+    }
+    taskState = READY;
+}
+
+Task::Task()
+{
+    stack = AllocateStack();
+    cpustate = (CPUState*)(stack + STACK_SIZE - sizeof(CPUState));
     taskState = READY;
 }
 
-Task::Task() {}
+Task::~Task()
+{
+    FreeStack(stack);
+    delete addressSpace;
+}
+
+TaskQueue::TaskQueue()
+{
+    head = 0;
+    tail = 0;
+    count = 0;
+}
 
-Task::~Task() {}
+void TaskQueue::PushBack(Task* task)
+{
+    task->queueNext = 0;
+    task->queuePrev = tail;
+    if (tail != 0)
+        tail->queueNext = task;
+    else
+        head = task;
+    tail = task;
+    count++;
+}
 
-TaskManager::TaskManager()
+Task* TaskQueue::PopFront()
 {
+    Task* task = head;
+    if (task != 0)
+        Remove(task);
+    return task;
+}
+
+void TaskQueue::Remove(Task* task)
+{
+    if (task->queuePrev != 0)
+        task->queuePrev->queueNext = task->queueNext;
+    else
+        head = task->queueNext;
+    if (task->queueNext != 0)
+        task->queueNext->queuePrev = task->queuePrev;
+    else
+        tail = task->queuePrev;
+    task->queueNext = 0;
+    task->queuePrev = 0;
+    count--;
+}
+
+// Move every task of the other queue to the back of this one
+void TaskQueue::Append(TaskQueue* other)
+{
+    if (other->head == 0)
+        return;
+    other->head->queuePrev = tail;
+    if (tail != 0)
+        tail->queueNext = other->head;
+    else
+        head = other->head;
+    tail = other->tail;
+    count += other->count;
+
+    other->head = 0;
+    other->tail = 0;
+    other->count = 0;
+}
+
+TaskManager* TaskManager::activeTaskManager = 0;
+
+TaskManager::TaskManager(SchedulingPolicy policy, GlobalDescriptorTable* gdt)
+{
+    activeTaskManager = this;
+    this->policy = policy;
+    this->gdt = gdt;
+    current = 0;
+    idleState = 0;
+    for (int i = 0; i < PID_HASH_SIZE; i++)
+        pidHash[i] = 0;
+    nextPid = 1;
     numTasks = 0;
-    currentTask = -1;
+    ticks = 0;
+    boostEpoch = 0;
+    SetTiming(18, 0);
+    scheduleCycles = 0;
+    scheduleCount = 0;
+}
+
+TaskManager::~TaskManager()
+{
+    if (activeTaskManager == this)
+        activeTaskManager = 0;
+}
+
+// Give the task a pid and make it findable
+void TaskManager::InsertTask(Task* task, common::uint32_t parentPid)
+{
+    task->pId = nextPid++;
+    task->pPid = parentPid;
+
+    Task** bucket = &pidHash[task->pId & (PID_HASH_SIZE - 1)];
+    task->hashNext = *bucket;
+    *bucket = task;
+    numTasks++;
 }
 
-TaskManager::~TaskManager() {}
+Task* TaskManager::FindTask(common::uint32_t pid)
+{
+    for (Task* task = pidHash[pid & (PID_HASH_SIZE - 1)]; task != 0; task = task->hashNext)
+        if (task->pId == pid)
+            return task;
+    return 0;
+}
 
 bool TaskManager::AddTask(Task* task)
 {
-    if(numTasks >= 256)
+    // Its constructor failed
+    if (task->cpustate == 0)
         return false;
-    tasks[numTasks++] = task;
+
+    // Tasks in ring 3 cannot read the kernel's copy
+    if (task->addressSpace != 0)
+    {
+        uint32_t* entry = task->addressSpace->Entry(AddressSpace::TASK_LOCAL_BASE, false);
+        if (entry != 0 && (*entry & AddressSpace::PAGE_PRESENT))
+        {
+            TaskLocalPage* local = (TaskLocalPage*)(*entry & AddressSpace::PAGE_FRAME);
+            local->fastSyscalls = SyscallHandler::fastSyscalls;
+            local->timestampFrequency = timestampFrequency;
+        }
+    }
+
+    InsertTask(task, 0);
+    MakeReady(task, ReadTimestampCounter());
     return true;
 }
 
-CPUState* TaskManager::Schedule(CPUState* cpustate)
+void TaskManager::SetTiming(common::uint32_t tickFrequency, common::uint32_t timestampFrequency)
 {
-    if(numTasks <= 0)
-        return cpustate;
+    this->tickFrequency = tickFrequency;
+    this->timestampFrequency = timestampFrequency;
+    boostInterval = BOOST_INTERVAL_MS * tickFrequency / 1000;
+    if (boostInterval == 0)
+        boostInterval = 1;
+}
 
-    if(currentTask >= 0)
-        tasks[currentTask]->cpustate = cpustate;
+// Time slice of a feedback queue level: QUANTUM_MS at the top, doubling
+// with every level below. Round robin uses the top level's slice. Never
+// less than one tick.
+int TaskManager::Quantum(int priority)
+{
+    if (policy == ROUND_ROBIN)
+        priority = 0;
+    int ticks = (QUANTUM_MS << priority) * tickFrequency / 1000;
+    return ticks != 0 ? ticks : 1;
+}
+
+void TaskManager::MakeReady(Task* task, common::uint64_t now)
+{
+    // A task that missed a boost while it was off the ready queues
+    // catches up here
+    if (task->boostEpoch != boostEpoch)
+    {
+        task->priority = 0;
+        task->boostEpoch = boostEpoch;
+    }
+    task->taskState = READY;
+    task->lastTimestamp = now;
+    readyQueues[task->priority].PushBack(task);
+}
 
-    currentTask++;
-    if(currentTask >= numTasks)
-        currentTask = 0;
+// Lift every task back to the top level so CPU-bound tasks cannot be
+// starved forever. The queues are spliced as a whole; the tasks' own
+// priority fields are fixed lazily through boostEpoch.
+void TaskManager::BoostAll()
+{
+    for (int i = 1; i < NUM_PRIORITIES; i++)
+        readyQueues[0].Append(&readyQueues[i]);
+    boostEpoch++;
+}
 
-    while (tasks[currentTask]->taskState == FINISHED)
+// Forget a task completely
+void TaskManager::RemoveTask(Task* task)
+{
+    for (Task** link = &pidHash[task->pId & (PID_HASH_SIZE - 1)]; *link != 0; link = &(*link)->hashNext)
     {
-        // Remove finished task from the task list
-        delete tasks[currentTask];
-        for (int i = currentTask; i < numTasks - 1; i++)
+        if (*link == task)
         {
-            tasks[i] = tasks[i + 1];
+            *link = task->hashNext;
+            break;
         }
-        numTasks--;
-        if (numTasks == 0)
+    }
+    numTasks--;
+
+    if (task->cached)
+        taskCache.Destroy(task);
+}
+
+// Free the tasks that finished before the last switch. The one that is
+// finishing right now still runs on its own stack, so it waits a tick.
+void TaskManager::ReapFinishedTasks()
+{
+    while (Task* task = finishedQueue.PopFront())
+    {
+        // Return everything it allocated in one go
+        task->arena.Release();
+        FreeStack(task->stack);
+        task->stack = 0;
+        delete task->addressSpace;
+        task->addressSpace = 0;
+
+        // Nobody can collect its zombie children any more, and the live
+        // ones will not leave zombies behind
+        for (int i = 0; task->children > 0 && i < PID_HASH_SIZE; i++)
+        {
+            Task* child = pidHash[i];
+            while (child != 0)
+            {
+                Task* next = child->hashNext;
+                if (child->pPid == task->pId)
+                {
+                    child->pPid = 0;
+                    task->children--;
+                    if (child->taskState == ZOMBIE)
+                        RemoveTask(child);
+                }
+                child = next;
+            }
+        }
+
+        // Keep the exit status until the parent collects it
+        if (task->pPid != 0)
+            task->taskState = ZOMBIE;
+        else
+            RemoveTask(task);
+    }
+}
+
+CPUState* TaskManager::Schedule(CPUState* cpustate)
+{
+    uint64_t start = ReadTimestampCounter();
+
+    ReapFinishedTasks();
+
+    // The syscall handler also calls in here when the current task blocks
+    // or exits; only calls that find a runnable task are timer ticks
+    bool tick = current == 0 || current->taskState == READY;
+    if (tick && policy == MULTILEVEL_FEEDBACK && ++ticks % boostInterval == 0)
+        BoostAll();
+
+    if (current != 0)
+    {
+        current->cpustate = cpustate;
+
+        // Keep running until the time slice is used up
+        if (current->taskState == READY && --current->ticksLeft > 0)
         {
+            scheduleCycles += ReadTimestampCounter() - start;
+            scheduleCount++;
             return cpustate;
         }
-        if (currentTask >= numTasks)
+
+        current->runtimeCycles += start - current->lastTimestamp;
+
+        // Park the interrupted task on the queue matching its state. A
+        // task that used its whole slice drops a level, one that blocks
+        // before that moves up a level.
+        switch (current->taskState)
+        {
+            case READY:
+                if (policy == MULTILEVEL_FEEDBACK && current->priority < NUM_PRIORITIES - 1)
+                    current->priority++;
+                MakeReady(current, start);
+                break;
+            case WAITING:
+            case SLEEPING:
+                // Already on the wait queue of the task it waits for, or
+                // its sleep timer is running
+                if (current->priority > 0)
+                    current->priority--;
+                break;
+            case FINISHED:
+                finishedQueue.PushBack(current);
+                break;
+            default:
+                break;
+        }
+    }
+    else
+    {
+        idleState = cpustate;
+    }
+
+    // Run the task that has waited longest on the highest non-empty
+    // level; round robin only ever uses level 0. With nothing ready, go
+    // back to whatever was running before the first task.
+    current = 0;
+    for (int i = 0; i < NUM_PRIORITIES && current == 0; i++)
+        current = readyQueues[i].PopFront();
+
+    CPUState* next = idleState;
+    if (current != 0)
+    {
+        if (current->boostEpoch != boostEpoch)
         {
-            currentTask = 0;
+            current->priority = 0;
+            current->boostEpoch = boostEpoch;
         }
+        current->ticksLeft = Quantum(current->priority);
+        current->readyWaitCycles += start - current->lastTimestamp;
+        current->lastTimestamp = start;
+        current->switches++;
+        next = current->cpustate;
+    }
+
+    // Interrupts from ring 3 land on the task's kernel stack
+    if (current != 0 && current->addressSpace != 0)
+        current->addressSpace->Activate();
+    else if (AddressSpace::kernelSpace != 0)
+        AddressSpace::kernelSpace->Activate();
+    if (current != 0 && gdt != 0)
+        gdt->SetKernelStack((uint32_t)current->stack + current->stackSize);
+
+    // Its address space is active now, so the ring can be written
+    if (current != 0 && current->ringBlocked)
+    {
+        current->ringBlocked = false;
+        current->ring->Complete(current->ringUserData, current->cpustate->eax);
+        current->cpustate->eax = current->ringConsumed;
     }
 
-    // Debugging: Print task information
-    sysprintf("Switching to task ");
-    char buffer[16];
-    sprintf(buffer, "%d", currentTask);
-    sysprintf(buffer);
-    sysprintf("\n");
+    scheduleCycles += ReadTimestampCounter() - start;
+    scheduleCount++;
 
-    return tasks[currentTask]->cpustate;
+    if (current != 0)
+    {
+        // Debugging: Print task information
+        char buffer[32];
+        sprintf(buffer, "Switching to task %d\n", current->pId);
+        printk(LOG_DEBUG, buffer);
+    }
+
+    return next;
 }
 
 void TaskManager::Yield()
@@ -96,93 +474,240 @@ void TaskManager::Yield()
 
 common::uint32_t TaskManager::ForkTask(CPUState* cpustate)
 {
-    if(numTasks >= 256)
+    if(current == 0)
+        return -1;
+
+    Task* parentTask = current;
+    Task* newTask = taskCache.Create();
+    if(newTask != 0 && newTask->stack == 0)
+    {
+        taskCache.Destroy(newTask);
+        newTask = 0;
+    }
+    // The child sees the same user memory, copied lazily on write
+    if(newTask != 0 && parentTask->addressSpace != 0)
+    {
+        newTask->addressSpace = parentTask->addressSpace->Clone();
+        if(newTask->addressSpace == 0)
+        {
+            taskCache.Destroy(newTask);
+            newTask = 0;
+        }
+    }
+    if(newTask == 0)
     {
-        sysprintf("Fork failed: too many tasks\n");
+        printf("Fork failed: out of memory\n");
         return -1;
     }
+    newTask->cached = true;
 
-    Task* parentTask = tasks[currentTask];
-    Task* newTask = new Task();
-    
     // Copy the CPU state without using memcpy
-    newTask->cpustate->eax = parentTask->cpustate->eax;
-    newTask->cpustate->ebx = parentTask->cpustate->ebx;
-    newTask->cpustate->ecx = parentTask->cpustate->ecx;
-    newTask->cpustate->edx = parentTask->cpustate->edx;
-    newTask->cpustate->esi = parentTask->cpustate->esi;
-    newTask->cpustate->edi = parentTask->cpustate->edi;
-    newTask->cpustate->ebp = parentTask->cpustate->ebp;
-    newTask->cpustate->eip = parentTask->cpustate->eip;
-    newTask->cpustate->cs = parentTask->cpustate->cs;
-    newTask->cpustate->eflags = parentTask->cpustate->eflags;
-    newTask->cpustate->esp = parentTask->cpustate->esp;
-    newTask->cpustate->ss = parentTask->cpustate->ss;
+    newTask->cpustate->eax = cpustate->eax;
+    newTask->cpustate->ebx = cpustate->ebx;
+    newTask->cpustate->ecx = cpustate->ecx;
+    newTask->cpustate->edx = cpustate->edx;
+    newTask->cpustate->esi = cpustate->esi;
+    newTask->cpustate->edi = cpustate->edi;
+    newTask->cpustate->ebp = cpustate->ebp;
+    newTask->cpustate->error = cpustate->error;
+    newTask->cpustate->eip = cpustate->eip;
+    newTask->cpustate->cs = cpustate->cs;
+    newTask->cpustate->eflags = cpustate->eflags;
+    newTask->cpustate->esp = cpustate->esp;
+    newTask->cpustate->ss = cpustate->ss;
 
     newTask->cpustate->eax = 0; // Child process returns 0
 
-    tasks[numTasks++] = newTask;
-    sysprintf("Fork successful: child task created\n");
-    return newTask->cpustate->eax;
+    // Same virtual address, the ring memory itself is copied on write
+    newTask->ring = parentTask->ring;
+
+    // The child starts on its parent's level
+    newTask->priority = parentTask->priority;
+    newTask->boostEpoch = parentTask->boostEpoch;
+
+    InsertTask(newTask, parentTask->pId);
+    parentTask->children++;
+    MakeReady(newTask, ReadTimestampCounter());
+    printf("Fork successful: child task created\n");
+    return newTask->pId;
 }
 
 common::uint32_t TaskManager::ExecTask(void* entrypoint)
 {
-    Task* task = tasks[currentTask];
+    Task* task = current;
     task->cpustate->eip = (uint32_t)entrypoint;
     return task->cpustate->eax;
 }
 
-bool TaskManager::WaitTask(common::uint32_t pid)
+common::uint32_t TaskManager::GetPid()
+{
+    return current != 0 ? current->pId : 0;
+}
+
+// Returns the exit status of the task, or -1 if there is no such task.
+// If it is still running the caller blocks and the status is delivered
+// into its eax by ExitTask.
+int TaskManager::WaitTask(common::uint32_t pid)
 {
-    int taskIndex = getIndex(pid);
-    if (taskIndex == -1)
+    Task* task = FindTask(pid);
+    if (current == 0 || task == 0 || task == current)
+    {
+        printf("Wait failed: task not found\n");
+        return -1; // Task not found
+    }
+
+    if (task->taskState == FINISHED || task->taskState == ZOMBIE)
     {
-        sysprintf("Wait failed: task not found\n");
-        return false; // Task not found
+        int status = task->exitStatus;
+        if (task->pPid == current->pId)
+        {
+            // Collect it; a task still on its stack goes at its reap
+            task->pPid = 0;
+            current->children--;
+            if (task->taskState == ZOMBIE)
+                RemoveTask(task);
+        }
+        return status;
     }
 
-    sysprintf("Waiting for task to finish\n");
-    tasks[currentTask]->taskState = WAITING;
-    tasks[currentTask]->waitpid = pid;
+    // Park the caller; the syscall handler switches away from it and
+    // ExitTask makes it ready again
+    printf("Waiting for task to finish\n");
+    current->taskState = WAITING;
+    current->waitpid = pid;
+    task->waiters.PushBack(current);
+    return 0;
+}
+
+void TaskManager::ExitTask(int status)
+{
+    printf("Task exiting\n");
+    current->taskState = FINISHED; // Mark the task as finished
+    current->exitStatus = status;
 
-    while (tasks[taskIndex]->taskState != FINISHED)
+    // Wake the tasks waiting for this one and hand them the status. If
+    // the parent is among them it collects the task right away.
+    uint64_t now = ReadTimestampCounter();
+    while (Task* task = current->waiters.PopFront())
     {
-        sysprintf("Task not finished yet, scheduling...\n");
-        Schedule(tasks[currentTask]->cpustate); // Yield CPU until the target task finishes
+        task->cpustate->eax = status;
+        if (task->pId == current->pPid)
+        {
+            current->pPid = 0;
+            task->children--;
+        }
+        MakeReady(task, now);
     }
 
-    sysprintf("Task finished\n");
-    tasks[currentTask]->taskState = READY;
-    return true;
+    // The syscall handler reschedules, since this task is no longer
+    // runnable
 }
 
-int TaskManager::getIndex(common::uint32_t pid)
+void TaskManager::PrintProcessTable()
 {
-    for (int i = 0; i < numTasks; i++)
+    static const char* stateNames[] = { "ready", "waiting", "finished", "zombie", "sleeping" };
+    char buffer[96];
+
+    // Without a calibrated clock the times are shown in units of 2^20 and
+    // 2^10 cycles instead
+    bool calibrated = timestampFrequency >= 1000000;
+    if (calibrated)
+        printf("PID PPID STATE    PRIO SWITCHES RUN(ms) AVG-WAIT(us)\n");
+    else
+        printf("PID PPID STATE    PRIO SWITCHES RUN(Mcyc) AVG-WAIT(Kcyc)\n");
+
+    // Tasks come and go with the interrupts, not under the walk
+    uint32_t flags = DisableInterrupts();
+    for (int i = 0; i < PID_HASH_SIZE; i++)
     {
-        if (tasks[i]->pId == pid)
+        for (Task* task = pidHash[i]; task != 0; task = task->hashNext)
         {
-            return i;
+            uint32_t run, avgWait = 0;
+            if (calibrated)
+            {
+                run = DivideU64(task->runtimeCycles, timestampFrequency / 1000);
+                if (task->switches != 0)
+                    avgWait = DivideU64(task->readyWaitCycles, task->switches) / (timestampFrequency / 1000000);
+            }
+            else
+            {
+                run = (uint32_t)(task->runtimeCycles >> 20);
+                if (task->switches != 0)
+                    avgWait = (uint32_t)(task->readyWaitCycles >> 10) / task->switches;
+            }
+            sprintf(buffer, "%d %d ", task->pId, task->pPid);
+            printf(buffer);
+            printf((char*)stateNames[task->taskState]);
+            sprintf(buffer, " %d %d %d %d\n", task->priority, task->switches, run, avgWait);
+            printf(buffer);
         }
     }
-    return -1;
+    RestoreInterrupts(flags);
 }
 
-void TaskManager::ExitTask()
+// Block the current task for at least the given time. The syscall handler
+// switches away from it and its timer makes it ready again.
+void TaskManager::SleepTask(common::uint32_t milliseconds)
 {
-    sysprintf("Task exiting\n");
-    tasks[currentTask]->taskState = FINISHED; // Mark the task as finished
-    
-    // Reschedule to the next task
-    CPUState* cpustate = tasks[currentTask]->cpustate;
-    currentTask++;
-    if(currentTask >= numTasks)
-        currentTask = 0;
-    cpustate = tasks[currentTask]->cpustate;
-    asm volatile("mov %0, %%esp" : : "g"(cpustate));
+    TimerWheel* wheel = TimerWheel::activeTimerWheel;
+    if (current == 0 || wheel == 0)
+        return;
+
+    current->taskState = SLEEPING;
+    current->sleepTimer.callback = WakeSleeper;
+    current->sleepTimer.data = current;
+    wheel->Add(&current->sleepTimer, wheel->TicksForMilliseconds(milliseconds));
+}
+
+// Runs from the timer interrupt
+void TaskManager::WakeSleeper(void* data)
+{
+    Task* task = (Task*)data;
+    if (task->taskState == SLEEPING && activeTaskManager != 0)
+        activeTaskManager->MakeReady(task, ReadTimestampCounter());
+}
+
+Task* TaskManager::BlockCurrentTask()
+{
+    if (current != 0)
+        current->taskState = WAITING;
+    return current;
+}
+
+void TaskManager::WakeTask(Task* task)
+{
+    if (task != 0 && task->taskState == WAITING)
+        MakeReady(task, ReadTimestampCounter());
+}
+
+void TaskManager::SetRing(SyscallRing* ring)
+{
+    if (current != 0)
+        current->ring = ring;
+}
+
+// The current task blocked on a request from its ring. Its completion is
+// posted when the task is switched to again.
+void TaskManager::BlockInRing(common::uint32_t userData, common::uint32_t consumed)
+{
+    if (current == 0 || current->ring == 0)
+        return;
+    current->ringBlocked = true;
+    current->ringUserData = userData;
+    current->ringConsumed = consumed;
+}
+
+// Allocate memory that lives until the calling task is reaped. Tasks in
+// ring 3 get it in their own address space, kernel tasks from their arena.
+void* TaskManager::AllocateTaskMemory(common::size_t size)
+{
+    if (current == 0)
+        return 0;
+    if (current->addressSpace != 0)
+        return current->addressSpace->AllocateArena(size);
+    return current->arena.Allocate(size);
 }
 
-void operator delete(void* p, unsigned int size) {
+void operator delete(void* p, unsigned int /*size*/) {
     MemoryManager::activeMemoryManager->free(p);
 }
\ No newline at end of file
@@ -0,0 +1,355 @@
+#include <pageframeallocator.h>
+#include <paging.h>
+#include <common/string.h>
+
+using namespace myos::common;
+using namespace myos;
+
+// Provided by linker.ld and loader.s
+extern "C" uint8_t kernel_start[];
+extern "C" uint8_t kernel_end[];
+extern "C" uint8_t kernel_stack_bottom[];
+extern "C" uint8_t kernel_stack[];
+
+// Static variable to keep track of the active page frame allocator
+PageFrameAllocator* PageFrameAllocator::activePageFrameAllocator = 0;
+
+// Constructor for the PageFrameAllocator class
+PageFrameAllocator::PageFrameAllocator(const MultibootInfo* multiboot)
+{
+    activePageFrameAllocator = this;
+
+    frameState = 0;
+    frameShares = 0;
+    numFrames = 0;
+    freeFrames = 0;
+    totalFrames = 0;
+    for (int i = 0; i <= MAX_ORDER; i++)
+        freeLists[i] = 0;
+
+    bool hasMemoryMap = (multiboot->flags & MULTIBOOT_INFO_MEM_MAP) != 0;
+    MultibootMemoryMapEntry* mmapStart = (MultibootMemoryMapEntry*)multiboot->mmap_addr;
+    MultibootMemoryMapEntry* mmapEnd = (MultibootMemoryMapEntry*)(multiboot->mmap_addr + multiboot->mmap_length);
+
+    // Without a memory map, fall back to the upper memory size, which
+    // starts at 1 MiB
+    MultibootMemoryMapEntry upperMemory;
+    if (!hasMemoryMap)
+    {
+        if ((multiboot->flags & MULTIBOOT_INFO_MEMORY) == 0)
+            return;
+        upperMemory.size = sizeof(MultibootMemoryMapEntry) - sizeof(upperMemory.size);
+        upperMemory.base_addr = 0x100000;
+        upperMemory.length = (uint64_t)multiboot->mem_upper * 1024;
+        upperMemory.type = MULTIBOOT_MEMORY_AVAILABLE;
+        mmapStart = &upperMemory;
+        mmapEnd = &upperMemory + 1;
+    }
+
+    // The kernel reaches frames through its identity map, which ends
+    // where the kernel task stacks below the user half start
+    const uint64_t addressLimit = AddressSpace::KERNEL_STACKS_BASE;
+
+    // Find the highest usable address to size the frame state table
+    uint64_t highest = 0;
+    for (MultibootMemoryMapEntry* entry = mmapStart; entry < mmapEnd;
+        entry = (MultibootMemoryMapEntry*)((size_t)entry + entry->size + sizeof(entry->size)))
+    {
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE)
+            continue;
+        uint64_t end = entry->base_addr + entry->length;
+        if (end > addressLimit)
+            end = addressLimit;
+        if (end > highest)
+            highest = end;
+    }
+    numFrames = highest / PAGE_SIZE;
+
+    // Put the frame state and share count tables in the first available
+    // memory behind the kernel image that the boot loader left nothing in.
+    // Filling them must not overwrite the memory map we still walk below.
+    size_t tableSize = numFrames + numFrames * sizeof(uint16_t);
+    size_t kernelEnd = ((size_t)kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for (MultibootMemoryMapEntry* entry = mmapStart; entry < mmapEnd && frameState == 0;
+        entry = (MultibootMemoryMapEntry*)((size_t)entry + entry->size + sizeof(entry->size)))
+    {
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE)
+            continue;
+        uint64_t start = entry->base_addr;
+        uint64_t end = entry->base_addr + entry->length;
+        if (start < kernelEnd)
+            start = kernelEnd;
+        while (frameState == 0)
+        {
+            start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            if (start + tableSize > end || start + tableSize > addressLimit)
+                break;
+            uint64_t skip = BootDataEnd(multiboot, start, start + tableSize);
+            if (skip == 0)
+                frameState = (uint8_t*)(size_t)start;
+            start = skip;
+        }
+    }
+    if (frameState == 0)
+    {
+        numFrames = 0;
+        return;
+    }
+
+    frameShares = (uint16_t*)(((size_t)frameState + numFrames + 1) & ~1);
+    for (uint32_t frame = 0; frame < numFrames; frame++)
+    {
+        frameState[frame] = FRAME_RESERVED;
+        frameShares[frame] = 0;
+    }
+
+    for (MultibootMemoryMapEntry* entry = mmapStart; entry < mmapEnd;
+        entry = (MultibootMemoryMapEntry*)((size_t)entry + entry->size + sizeof(entry->size)))
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE)
+            MarkAvailable(entry->base_addr, entry->length);
+
+    // Everything below 1 MiB (BIOS data, VGA memory, the null page), the
+    // kernel image with its stack, the frame state table itself and the
+    // boot information we are still reading stay off limits
+    Reserve(0, 0x100000);
+    Reserve((size_t)kernel_start, (size_t)kernel_end - (size_t)kernel_start);
+    Reserve((size_t)kernel_stack_bottom, (size_t)kernel_stack - (size_t)kernel_stack_bottom);
+    Reserve((size_t)frameState, tableSize + 1);
+    ReserveBootData(multiboot);
+
+    // Hand every remaining frame to the buddy lists, which merges them
+    // into the largest aligned blocks possible
+    for (uint32_t frame = 0; frame < numFrames; frame++)
+    {
+        if (frameState[frame] != FRAME_AVAILABLE)
+            continue;
+        totalFrames++;
+        freeFrames++;
+        FreeBlock(frame, 0);
+    }
+}
+
+// Destructor for the PageFrameAllocator class
+PageFrameAllocator::~PageFrameAllocator()
+{
+    if (activePageFrameAllocator == this)
+        activePageFrameAllocator = 0;
+}
+
+// Mark the whole frames inside a memory map entry as usable
+void PageFrameAllocator::MarkAvailable(uint64_t start, uint64_t length)
+{
+    uint64_t first = (start + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t last = (start + length) / PAGE_SIZE;
+    if (last > numFrames)
+        last = numFrames;
+
+    for (uint64_t frame = first; frame < last; frame++)
+        frameState[frame] = FRAME_AVAILABLE;
+}
+
+// Keep every frame touching [start, start + size) away from the free lists
+void PageFrameAllocator::Reserve(size_t start, size_t size)
+{
+    if (size == 0)
+        return;
+
+    uint32_t first = start / PAGE_SIZE;
+    uint32_t last = (start + size - 1) / PAGE_SIZE;
+    for (uint32_t frame = first; frame <= last && frame < numFrames; frame++)
+        frameState[frame] = FRAME_RESERVED;
+}
+
+// The boot loader's data: the info block, the memory map, the command
+// line and the modules with their list
+void PageFrameAllocator::ReserveBootData(const MultibootInfo* multiboot)
+{
+    Reserve((size_t)multiboot, sizeof(MultibootInfo));
+    if (multiboot->flags & MULTIBOOT_INFO_MEM_MAP)
+        Reserve(multiboot->mmap_addr, multiboot->mmap_length);
+    if ((multiboot->flags & MULTIBOOT_INFO_CMDLINE) && multiboot->cmdline != 0)
+        Reserve(multiboot->cmdline, strlen((const char*)multiboot->cmdline) + 1);
+    if (multiboot->flags & MULTIBOOT_INFO_MODS)
+    {
+        MultibootModule* modules = (MultibootModule*)multiboot->mods_addr;
+        Reserve(multiboot->mods_addr, multiboot->mods_count * sizeof(MultibootModule));
+        for (uint32_t i = 0; i < multiboot->mods_count; i++)
+            if (modules[i].mod_end > modules[i].mod_start)
+                Reserve(modules[i].mod_start, modules[i].mod_end - modules[i].mod_start);
+    }
+}
+
+static bool Overlaps(uint64_t start, uint64_t end, uint64_t dataStart, uint64_t dataSize)
+{
+    return dataSize != 0 && dataStart < end && start < dataStart + dataSize;
+}
+
+// End of the highest boot loader data in [start, end), or 0 if the range
+// holds none
+uint64_t PageFrameAllocator::BootDataEnd(const MultibootInfo* multiboot, uint64_t start, uint64_t end)
+{
+    uint64_t result = 0;
+    uint64_t dataStart = (size_t)multiboot;
+    uint64_t dataSize = sizeof(MultibootInfo);
+    if (Overlaps(start, end, dataStart, dataSize) && dataStart + dataSize > result)
+        result = dataStart + dataSize;
+
+    if (multiboot->flags & MULTIBOOT_INFO_MEM_MAP)
+    {
+        dataStart = multiboot->mmap_addr;
+        dataSize = multiboot->mmap_length;
+        if (Overlaps(start, end, dataStart, dataSize) && dataStart + dataSize > result)
+            result = dataStart + dataSize;
+    }
+    if ((multiboot->flags & MULTIBOOT_INFO_CMDLINE) && multiboot->cmdline != 0)
+    {
+        dataStart = multiboot->cmdline;
+        dataSize = strlen((const char*)multiboot->cmdline) + 1;
+        if (Overlaps(start, end, dataStart, dataSize) && dataStart + dataSize > result)
+            result = dataStart + dataSize;
+    }
+    if (multiboot->flags & MULTIBOOT_INFO_MODS)
+    {
+        MultibootModule* modules = (MultibootModule*)multiboot->mods_addr;
+        dataStart = multiboot->mods_addr;
+        dataSize = multiboot->mods_count * sizeof(MultibootModule);
+        if (Overlaps(start, end, dataStart, dataSize) && dataStart + dataSize > result)
+            result = dataStart + dataSize;
+        for (uint32_t i = 0; i < multiboot->mods_count; i++)
+        {
+            dataStart = modules[i].mod_start;
+            dataSize = modules[i].mod_end > modules[i].mod_start ? modules[i].mod_end - modules[i].mod_start : 0;
+            if (Overlaps(start, end, dataStart, dataSize) && dataStart + dataSize > result)
+                result = dataStart + dataSize;
+        }
+    }
+    return result;
+}
+
+// Push a free block onto the list for its order
+void PageFrameAllocator::PushBlock(uint32_t frame, int order)
+{
+    FreeFrameBlock* block = (FreeFrameBlock*)(frame * PAGE_SIZE);
+
+    block->prev = 0;
+    block->next = freeLists[order];
+    if (block->next != 0)
+        block->next->prev = block;
+    freeLists[order] = block;
+
+    frameState[frame] = FRAME_FREE_HEAD | order;
+}
+
+// Unlink a free block from the list for its order
+void PageFrameAllocator::RemoveBlock(uint32_t frame, int order)
+{
+    FreeFrameBlock* block = (FreeFrameBlock*)(frame * PAGE_SIZE);
+
+    if (block->prev != 0)
+        block->prev->next = block->next;
+    else
+        freeLists[order] = block->next;
+    if (block->next != 0)
+        block->next->prev = block->prev;
+
+    frameState[frame] = FRAME_INTERIOR;
+}
+
+// Return a block to the free lists, merging it with its free buddies
+void PageFrameAllocator::FreeBlock(uint32_t frame, int order)
+{
+    frameState[frame] = FRAME_INTERIOR;
+
+    while (order < MAX_ORDER)
+    {
+        uint32_t buddy = frame ^ (1u << order);
+        if (buddy >= numFrames || frameState[buddy] != (FRAME_FREE_HEAD | order))
+            break;
+
+        RemoveBlock(buddy, order);
+        if (buddy < frame)
+            frame = buddy;
+        order++;
+    }
+
+    PushBlock(frame, order);
+}
+
+// Allocate 2^order contiguous frames, aligned to their size
+void* PageFrameAllocator::AllocateFrames(int order)
+{
+    if (order < 0 || order > MAX_ORDER)
+        return 0;
+
+    // Find the smallest block that is big enough
+    int blockOrder = order;
+    while (blockOrder <= MAX_ORDER && freeLists[blockOrder] == 0)
+        blockOrder++;
+    if (blockOrder > MAX_ORDER)
+        return 0;
+
+    uint32_t frame = (size_t)freeLists[blockOrder] / PAGE_SIZE;
+    RemoveBlock(frame, blockOrder);
+
+    // Split it, handing the upper halves back to the lower orders
+    while (blockOrder > order)
+    {
+        blockOrder--;
+        PushBlock(frame + (1u << blockOrder), blockOrder);
+    }
+
+    frameState[frame] = FRAME_USED_HEAD | order;
+    freeFrames -= 1u << order;
+    return (void*)(frame * PAGE_SIZE);
+}
+
+// Free a block returned by AllocateFrames
+void PageFrameAllocator::FreeFrames(void* address)
+{
+    size_t addr = (size_t)address;
+    if (addr % PAGE_SIZE != 0 || addr / PAGE_SIZE >= numFrames)
+        return;
+
+    uint32_t frame = addr / PAGE_SIZE;
+    if ((frameState[frame] & ~0x0F) != FRAME_USED_HEAD)
+        return;
+
+    if (frameShares[frame] != 0)
+    {
+        frameShares[frame]--;
+        return;
+    }
+
+    int order = frameState[frame] & 0x0F;
+    freeFrames += 1u << order;
+    FreeBlock(frame, order);
+}
+
+void PageFrameAllocator::ShareFrame(void* address)
+{
+    size_t addr = (size_t)address;
+    if (addr % PAGE_SIZE != 0 || addr / PAGE_SIZE >= numFrames)
+        return;
+
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frameState[frame] == (FRAME_USED_HEAD | 0))
+        frameShares[frame]++;
+}
+
+// Number of owners besides the first
+uint16_t PageFrameAllocator::FrameShares(void* address)
+{
+    size_t addr = (size_t)address;
+    if (addr % PAGE_SIZE != 0 || addr / PAGE_SIZE >= numFrames)
+        return 0;
+    return frameShares[addr / PAGE_SIZE];
+}
+
+// Smallest order whose blocks hold size bytes, or -1 if none does
+int PageFrameAllocator::OrderForSize(size_t size)
+{
+    int order = 0;
+    while (order <= MAX_ORDER && (PAGE_SIZE << order) < size)
+        order++;
+    return order <= MAX_ORDER ? order : -1;
+}
@@ -0,0 +1,535 @@
+#include <paging.h>
+#include <pageframeallocator.h>
+#include <common/cpu.h>
+#include <kernellog.h>
+
+using namespace myos;
+using namespace myos::common;
+using namespace myos::hardwarecommunication;
+
+void printf(char* str);
+void printk(LogLevel level, char* str);
+void printfHex32(uint32_t key);
+void sprintf(char* buffer, const char* format, ...);
+
+// Provided by linker.ld
+extern "C" uint8_t kernel_start[];
+extern "C" uint8_t kernel_text_end[];
+
+AddressSpace* AddressSpace::kernelSpace = 0;
+uint32_t AddressSpace::identityEnd = 0;
+uint32_t AddressSpace::largePages = 0;
+uint32_t AddressSpace::smallPages = 0;
+uint32_t AddressSpace::pagesShared = 0;
+uint32_t AddressSpace::pagesCopied = 0;
+uint32_t AddressSpace::pagesReclaimed = 0;
+uint32_t AddressSpace::pagesCommitted = 0;
+uint32_t AddressSpace::kernelStackSlots[(KERNEL_STACK_SLOTS + 31) / 32];
+
+static const uint32_t ENTRIES = 1024;
+static const uint32_t KERNEL_ENTRIES = AddressSpace::KERNEL_SPACE_END >> 22;
+
+// A zeroed frame for a page directory or page table
+uint32_t* AddressSpace::AllocateTable()
+{
+    if (PageFrameAllocator::activePageFrameAllocator == 0)
+        return 0;
+    uint32_t* table = (uint32_t*)PageFrameAllocator::activePageFrameAllocator->AllocateFrames(0);
+    if (table == 0)
+        return 0;
+    for (uint32_t i = 0; i < ENTRIES; i++)
+        table[i] = 0;
+    return table;
+}
+
+void AddressSpace::FlushPage(uint32_t virtualAddress)
+{
+    asm volatile("invlpg (%0)" : : "r" (virtualAddress) : "memory");
+}
+
+void AddressSpace::FlushAll()
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    asm volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
+}
+
+// Starts with the kernel's tables and an empty user half
+AddressSpace::AddressSpace()
+{
+    reservedStart = 0;
+    reservedEnd = 0;
+    arenaNext = USER_ARENA_BASE;
+    arenaEnd = USER_ARENA_BASE;
+    directory = AllocateTable();
+    if (directory != 0 && kernelSpace != 0)
+        for (uint32_t i = 0; i < KERNEL_ENTRIES; i++)
+            directory[i] = kernelSpace->directory[i];
+}
+
+// Give back the user pages, their tables and the directory. The kernel
+// tables are shared and stay.
+AddressSpace::~AddressSpace()
+{
+    PageFrameAllocator* allocator = PageFrameAllocator::activePageFrameAllocator;
+    if (directory == 0 || allocator == 0)
+        return;
+
+    for (uint32_t i = KERNEL_ENTRIES; i < ENTRIES; i++)
+    {
+        if (!(directory[i] & PAGE_PRESENT))
+            continue;
+        uint32_t* table = (uint32_t*)(directory[i] & PAGE_FRAME);
+        for (uint32_t j = 0; j < ENTRIES; j++)
+            if (table[j] & PAGE_PRESENT)
+                allocator->FreeFrames((void*)(table[j] & PAGE_FRAME));
+        allocator->FreeFrames(table);
+    }
+    allocator->FreeFrames(directory);
+}
+
+// Identity map every frame the allocator manages. The tasks still run
+// code linked into the kernel image, so its code and constants are open
+// to ring 3, read only for everyone; the rest of memory, the kernel's
+// data included, is supervisor only. A 4 MiB page has one user bit, so
+// the regions holding the code get 4 KiB tables and all others a single
+// large page. Page 0 is left out, so a null pointer faults.
+void AddressSpace::EnablePaging()
+{
+    PageFrameAllocator* allocator = PageFrameAllocator::activePageFrameAllocator;
+    if (allocator == 0 || kernelSpace != 0)
+        return;
+
+    kernelSpace = new AddressSpace();
+    if (kernelSpace == 0 || kernelSpace->directory == 0)
+        return;
+
+    uint32_t end = allocator->HighestAddress();
+    if (end == 0 || end > KERNEL_STACKS_BASE)
+        end = KERNEL_STACKS_BASE;
+    identityEnd = end;
+    uint32_t textStart = (uint32_t)kernel_start;
+    uint32_t textEnd = (uint32_t)kernel_text_end;
+
+    uint32_t features = CPUFeatures();
+    bool large = (features & CPUID_EDX_PSE) != 0;
+    uint32_t global = (features & CPUID_EDX_PGE) ? PAGE_GLOBAL : 0;
+
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    if (large)
+        cr4 |= 0x10;
+    if (global)
+        cr4 |= 0x80;
+    asm volatile("mov %0, %%cr4" : : "r" (cr4));
+
+    for (uint32_t region = 0; region < end; region += LARGE_PAGE_SIZE)
+    {
+        uint32_t regionEnd = region + LARGE_PAGE_SIZE;
+        if (large && region != 0 && (regionEnd <= textStart || textEnd <= region))
+        {
+            kernelSpace->directory[region >> 22] = region | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE | global;
+            largePages++;
+            continue;
+        }
+
+        for (uint32_t address = region != 0 ? region : PAGE_SIZE; address < regionEnd && address < end; address += PAGE_SIZE)
+        {
+            uint32_t flags = PAGE_WRITABLE | global;
+            if (textStart <= address && address < textEnd)
+                flags = PAGE_USER | global;
+            if (!kernelSpace->Map(address, address, flags))
+                return;
+            smallPages++;
+        }
+    }
+
+    // The tables of the stack area exist before any other address space
+    // copies the kernel's directory entries, so all of them share them
+    for (uint32_t address = KERNEL_STACKS_BASE; address < KERNEL_SPACE_END; address += LARGE_PAGE_SIZE)
+        if (kernelSpace->Entry(address, true) == 0)
+            return;
+
+    kernelSpace->Activate();
+
+    // Paging, and write protection in ring 0 as well, so the kernel
+    // cannot write through a copy-on-write page either
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    cr0 |= 0x80010000;
+    asm volatile("mov %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
+bool AddressSpace::IsIdentityMapped(uint32_t address, uint64_t size)
+{
+    if (kernelSpace == 0)
+        return true;
+    return address >= PAGE_SIZE && address + size <= identityEnd;
+}
+
+// A slot is the guard page followed by the stack. Running off the bottom
+// of the stack faults on the guard page instead of overwriting whatever
+// lies below; with no stack left to handle that fault on, it becomes a
+// double fault, which PageFaultHandler takes on a stack of its own.
+uint8_t* AddressSpace::AllocateKernelStack()
+{
+    if (kernelSpace == 0)
+        return 0;
+
+    uint32_t flags = DisableInterrupts();
+    uint32_t slot = 0;
+    while (slot < KERNEL_STACK_SLOTS && (kernelStackSlots[slot / 32] & (1u << (slot % 32))))
+        slot++;
+    if (slot == KERNEL_STACK_SLOTS)
+    {
+        RestoreInterrupts(flags);
+        return 0;
+    }
+    kernelStackSlots[slot / 32] |= 1u << (slot % 32);
+    RestoreInterrupts(flags);
+
+    uint8_t* stack = (uint8_t*)(KERNEL_STACKS_BASE + slot * (KERNEL_STACK_SIZE + PAGE_SIZE) + PAGE_SIZE);
+    for (uint32_t offset = 0; offset < KERNEL_STACK_SIZE; offset += PAGE_SIZE)
+    {
+        uint32_t* frame = AllocateTable();
+        if (frame == 0 || !kernelSpace->Map((uint32_t)stack + offset, (uint32_t)frame, PAGE_WRITABLE))
+        {
+            if (frame != 0)
+                PageFrameAllocator::activePageFrameAllocator->FreeFrames(frame);
+            FreeKernelStack(stack);
+            return 0;
+        }
+    }
+    return stack;
+}
+
+void AddressSpace::FreeKernelStack(uint8_t* stack)
+{
+    if (!IsKernelStack(stack))
+        return;
+
+    for (uint32_t offset = 0; offset < KERNEL_STACK_SIZE; offset += PAGE_SIZE)
+    {
+        uint32_t* entry = kernelSpace->Entry((uint32_t)stack + offset, false);
+        if (entry == 0 || !(*entry & PAGE_PRESENT))
+            continue;
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames((void*)(*entry & PAGE_FRAME));
+        *entry = 0;
+        FlushPage((uint32_t)stack + offset);
+    }
+
+    uint32_t slot = ((uint32_t)stack - KERNEL_STACKS_BASE) / (KERNEL_STACK_SIZE + PAGE_SIZE);
+    uint32_t flags = DisableInterrupts();
+    kernelStackSlots[slot / 32] &= ~(1u << (slot % 32));
+    RestoreInterrupts(flags);
+}
+
+bool AddressSpace::IsKernelStack(uint8_t* stack)
+{
+    return KERNEL_STACKS_BASE <= (uint32_t)stack && (uint32_t)stack < KERNEL_SPACE_END;
+}
+
+uint32_t* AddressSpace::Entry(uint32_t virtualAddress, bool create)
+{
+    uint32_t* pde = &directory[virtualAddress >> 22];
+    if (*pde & PAGE_LARGE)
+        return 0;
+    if (!(*pde & PAGE_PRESENT))
+    {
+        if (!create)
+            return 0;
+        uint32_t* table = AllocateTable();
+        if (table == 0)
+            return 0;
+        // Access is decided per page
+        *pde = (uint32_t)table | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+    }
+    uint32_t* table = (uint32_t*)(*pde & PAGE_FRAME);
+    return &table[(virtualAddress >> 12) & (ENTRIES - 1)];
+}
+
+bool AddressSpace::Map(uint32_t virtualAddress, uint32_t physicalAddress, uint32_t flags)
+{
+    uint32_t* entry = Entry(virtualAddress, true);
+    if (entry == 0)
+        return false;
+    *entry = (physicalAddress & PAGE_FRAME) | flags | PAGE_PRESENT;
+    return true;
+}
+
+void AddressSpace::Activate()
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    if (cr3 != (uint32_t)directory)
+        asm volatile("mov %0, %%cr3" : : "r" (directory) : "memory");
+}
+
+bool AddressSpace::IsUserRange(uint32_t address, uint32_t size, bool write)
+{
+    if (size == 0)
+        return true;
+    if (address + size < address)
+        return false;
+
+    for (uint32_t page = address & PAGE_FRAME; page < address + size && page >= (address & PAGE_FRAME); page += PAGE_SIZE)
+    {
+        if (reservedStart <= page && page < reservedEnd)
+            continue;
+
+        uint32_t pde = directory[page >> 22];
+        if ((pde & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER))
+            return false;
+        uint32_t entry = pde;
+        if (!(pde & PAGE_LARGE))
+            entry = ((uint32_t*)(pde & PAGE_FRAME))[(page >> 12) & (ENTRIES - 1)];
+        if ((entry & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER))
+            return false;
+        if (write && !(entry & (PAGE_WRITABLE | PAGE_COPY_ON_WRITE)))
+            return false;
+    }
+    return true;
+}
+
+int AddressSpace::UserStringLength(uint32_t address, uint32_t maxLength)
+{
+    // Check a page at a time, then scan it
+    uint32_t length = 0;
+    while (length <= maxLength)
+    {
+        uint32_t current = address + length;
+        uint32_t pageEnd = (current & PAGE_FRAME) + PAGE_SIZE;
+        if (!IsUserRange(current, 1, false))
+            return -1;
+        for (; current < pageEnd && length <= maxLength; current++, length++)
+            if (*(char*)current == '\0')
+                return length;
+        if (pageEnd == 0)
+            return -1;
+    }
+    return -1;
+}
+
+// Set aside a range that costs no memory until it is touched. The page
+// below it stays unmapped, so running off its bottom faults.
+void AddressSpace::Reserve(uint32_t start, uint32_t size)
+{
+    reservedStart = start & PAGE_FRAME;
+    reservedEnd = (start + size + PAGE_SIZE - 1) & PAGE_FRAME;
+}
+
+// Commit a zeroed page for a first touch inside the reserved range
+bool AddressSpace::HandleMissingPage(uint32_t virtualAddress)
+{
+    if (virtualAddress < reservedStart || virtualAddress >= reservedEnd)
+        return false;
+
+    uint32_t* page = AllocateTable();
+    if (page == 0)
+        return false;
+    if (!Map(virtualAddress & PAGE_FRAME, (uint32_t)page, PAGE_WRITABLE | PAGE_USER))
+    {
+        PageFrameAllocator::activePageFrameAllocator->FreeFrames(page);
+        return false;
+    }
+    pagesCommitted++;
+    return true;
+}
+
+bool AddressSpace::IsGuardPage(uint32_t virtualAddress)
+{
+    return reservedStart != reservedEnd
+        && reservedStart - PAGE_SIZE <= virtualAddress && virtualAddress < reservedStart;
+}
+
+// Bump the arena pointer, mapping zeroed pages behind it as it grows.
+// Pages mapped before a failure stay for the next call.
+void* AddressSpace::AllocateArena(uint32_t size)
+{
+    size = (size + MemoryManager::ALIGNMENT - 1) & ~(MemoryManager::ALIGNMENT - 1);
+    if (size == 0 || size > TASK_LOCAL_BASE - arenaNext)
+        return 0;
+
+    while (arenaEnd - arenaNext < size)
+    {
+        uint32_t* page = AllocateTable();
+        if (page == 0)
+            return 0;
+        if (!Map(arenaEnd, (uint32_t)page, PAGE_WRITABLE | PAGE_USER))
+        {
+            PageFrameAllocator::activePageFrameAllocator->FreeFrames(page);
+            return 0;
+        }
+        arenaEnd += PAGE_SIZE;
+    }
+
+    void* result = (void*)arenaNext;
+    arenaNext += size;
+    return result;
+}
+
+// Only the page tables are copied. Every writable user page becomes read
+// only in both spaces and gets one more owner; the first write to it
+// faults into HandleWriteFault.
+AddressSpace* AddressSpace::Clone()
+{
+    PageFrameAllocator* allocator = PageFrameAllocator::activePageFrameAllocator;
+    AddressSpace* copy = new AddressSpace();
+    if (copy == 0)
+        return 0;
+    if (copy->directory == 0)
+    {
+        delete copy;
+        return 0;
+    }
+    copy->reservedStart = reservedStart;
+    copy->reservedEnd = reservedEnd;
+    copy->arenaNext = arenaNext;
+    copy->arenaEnd = arenaEnd;
+
+    for (uint32_t i = KERNEL_ENTRIES; i < ENTRIES; i++)
+    {
+        if (!(directory[i] & PAGE_PRESENT))
+            continue;
+        uint32_t* table = (uint32_t*)(directory[i] & PAGE_FRAME);
+        uint32_t* copyTable = AllocateTable();
+        if (copyTable == 0)
+        {
+            delete copy;
+            return 0;
+        }
+        copy->directory[i] = (uint32_t)copyTable | (directory[i] & ~PAGE_FRAME);
+
+        for (uint32_t j = 0; j < ENTRIES; j++)
+        {
+            if (!(table[j] & PAGE_PRESENT))
+                continue;
+            if (table[j] & PAGE_WRITABLE)
+                table[j] = (table[j] & ~PAGE_WRITABLE) | PAGE_COPY_ON_WRITE;
+            copyTable[j] = table[j];
+            allocator->ShareFrame((void*)(table[j] & PAGE_FRAME));
+            pagesShared++;
+        }
+    }
+
+    // The pages just turned read only may be cached as writable
+    FlushAll();
+    return copy;
+}
+
+// Resolve a write to a copy-on-write page. The last owner takes the
+// frame back as it is, everyone else gets a private copy.
+bool AddressSpace::HandleWriteFault(uint32_t virtualAddress)
+{
+    uint32_t* entry = Entry(virtualAddress, false);
+    if (entry == 0 || !(*entry & PAGE_PRESENT) || !(*entry & PAGE_COPY_ON_WRITE))
+        return false;
+
+    PageFrameAllocator* allocator = PageFrameAllocator::activePageFrameAllocator;
+    uint32_t frame = *entry & PAGE_FRAME;
+    uint32_t flags = (*entry & ~PAGE_FRAME & ~PAGE_COPY_ON_WRITE) | PAGE_WRITABLE;
+
+    if (allocator->FrameShares((void*)frame) == 0)
+    {
+        *entry = frame | flags;
+        pagesReclaimed++;
+    }
+    else
+    {
+        void* copy = allocator->AllocateFrames(0);
+        if (copy == 0)
+            return false;
+
+        uint32_t count = PAGE_SIZE / 4;
+        void* source = (void*)frame;
+        void* destination = copy;
+        asm volatile("cld; rep movsl"
+            : "+S" (source), "+D" (destination), "+c" (count) : : "memory");
+
+        *entry = (uint32_t)copy | flags;
+        allocator->FreeFrames((void*)frame); // drops our share
+        pagesCopied++;
+    }
+
+    FlushPage(virtualAddress);
+    return true;
+}
+
+static uint8_t doubleFaultStack[4096] __attribute__((aligned(16)));
+
+PageFaultHandler::PageFaultHandler(InterruptManager* interruptManager, TaskManager* taskManager,
+    GlobalDescriptorTable* gdt)
+: InterruptHandler(interruptManager, 0x0E), taskManager(taskManager)
+{
+    // The task switch loads cr3 as well; the kernel's half is the same
+    // in every address space, so the current directory will do
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    gdt->SetDoubleFaultTask(&HandleDoubleFault, (uint32_t)(doubleFaultStack + sizeof(doubleFaultStack)), cr3);
+    interruptManager->SetTaskGate(0x08, gdt->DoubleFaultSegmentSelector());
+}
+
+PageFaultHandler::~PageFaultHandler()
+{
+}
+
+void PageFaultHandler::HandleDoubleFault()
+{
+    // The switch saved the faulting code's registers in the kernel's segment
+    TaskStateSegment* state = GlobalDescriptorTable::TaskState();
+    uint32_t slotSize = AddressSpace::KERNEL_STACK_SIZE + AddressSpace::PAGE_SIZE;
+    if (AddressSpace::IsKernelStack((uint8_t*)state->esp)
+        && (state->esp - AddressSpace::KERNEL_STACKS_BASE) % slotSize <= AddressSpace::PAGE_SIZE + sizeof(CPUState))
+        printk(LOG_ERROR, "KERNEL STACK OVERFLOW\n");
+
+    char buffer[48];
+    int pid = TaskManager::activeTaskManager != 0 ? TaskManager::activeTaskManager->getCurrentTask() : -1;
+    sprintf(buffer, "DOUBLE FAULT in task %d", pid);
+    printk(LOG_ERROR, buffer);
+    printf(" EIP 0x");
+    printfHex32(state->eip);
+    printf(" ESP 0x");
+    printfHex32(state->esp);
+    printk(LOG_ERROR, "\n");
+
+    while (true)
+        asm volatile("cli\n\thlt");
+}
+
+uint32_t PageFaultHandler::HandleInterrupt(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+
+    uint32_t address;
+    asm volatile("mov %%cr2, %0" : "=r" (address));
+
+    // Error code bits: 0 page was present, 1 write, 2 user mode
+    AddressSpace* space = taskManager->CurrentAddressSpace();
+    if (space != 0)
+    {
+        if ((cpu->error & 0x03) == 0x03 && space->HandleWriteFault(address))
+            return esp;
+        if (!(cpu->error & 0x01) && space->HandleMissingPage(address))
+            return esp;
+        if (space->IsGuardPage(address))
+            printk(LOG_ERROR, "STACK OVERFLOW\n");
+    }
+
+    // Errors are rendered right away, the line ends with one
+    printk(LOG_ERROR, "PAGE FAULT at 0x");
+    printfHex32(address);
+    printf(" EIP 0x");
+    printfHex32(cpu->eip);
+    printk(LOG_ERROR, "\n");
+
+    // A task only takes itself down
+    if ((cpu->error & 0x04) && !taskManager->IsIdle())
+    {
+        taskManager->ExitTask(-1);
+        return (uint32_t)taskManager->Schedule(cpu);
+    }
+
+    while (true)
+        asm volatile("cli; hlt");
+    return esp;
+}
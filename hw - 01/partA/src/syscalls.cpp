@@ -1,62 +1,433 @@
 #include <syscalls.h>
 #include <multitasking.h>
+#include <common/cpu.h>
+#include <paging.h>
+#include <common/string.h>
 
 using namespace myos;
 using namespace myos::common;
 using namespace myos::hardwarecommunication;
 
+SyscallHandler* SyscallHandler::activeSyscallHandler = 0;
+bool SyscallHandler::fastSyscalls = false;
+uint32_t SyscallHandler::userCodeSelector = 0;
+uint32_t SyscallHandler::userDataSelector = 0;
+
+// Stack sysenter loads before the entry stub switches to the kernel stack
+// of the calling task
+static uint32_t sysenterStack[16];
+
 SyscallHandler::SyscallHandler(InterruptManager* interruptManager, uint8_t InterruptNumber, TaskManager* taskManager)
 : InterruptHandler(interruptManager, InterruptNumber + interruptManager->HardwareInterruptOffset()), taskManager(taskManager)
 {
+    activeSyscallHandler = this;
+
+    for (int i = 0; i < MAX_SYSCALLS; i++)
+        syscallTable[i].handler = 0;
+
+    Register(SYS_NULL, SysNull, "null", 0, 0);
+    Register(SYS_FORK, SysFork, "fork", 0, SYSCALL_NOT_IN_RING);
+    Register(SYS_WAITPID, SysWaitpid, "waitpid", 1, SYSCALL_BLOCKING);
+    Register(SYS_EXECVE, SysExecve, "execve", 1, SYSCALL_NOT_IN_RING);
+    Register(SYS_WRITE, SysWrite, "write", 2, SYSCALL_INPUT_BUFFER);
+    Register(SYS_EXIT, SysExit, "exit", 1, SYSCALL_BLOCKING);
+    Register(SYS_SLEEP, SysSleep, "sleep", 1, SYSCALL_BLOCKING);
+    Register(SYS_STATS, SysStats, "stats", 2, SYSCALL_OUTPUT_BUFFER);
+    Register(SYS_RING_SETUP, SysRingSetup, "ring_setup", 2, SYSCALL_OUTPUT_BUFFER | SYSCALL_NOT_IN_RING);
+    Register(SYS_RING_ENTER, SysRingEnter, "ring_enter", 0, SYSCALL_BLOCKING | SYSCALL_NOT_IN_RING);
+    Register(SYS_WRITEV, SysWritev, "writev", 2, SYSCALL_INPUT_VECTOR);
+    Register(SYS_ALLOC, SysAlloc, "alloc", 1, 0);
 }
 
 SyscallHandler::~SyscallHandler()
 {
+    if (activeSyscallHandler == this)
+    {
+        activeSyscallHandler = 0;
+        fastSyscalls = false;
+    }
 }
 
-void printf(char*);
+// Console output, in kernel.cpp
+void print(const char* text, size_t length);
 
-uint32_t SyscallHandler::HandleInterrupt(uint32_t esp)
+bool SyscallHandler::Register(uint32_t number, Syscall handler, const char* name,
+    uint8_t argumentCount, uint32_t flags)
 {
-    CPUState* cpu = (CPUState*)esp;
+    if (number >= MAX_SYSCALLS || handler == 0 || syscallTable[number].handler != 0)
+        return false;
+
+    SyscallEntry* entry = &syscallTable[number];
+    entry->handler = handler;
+    entry->name = name;
+    entry->argumentCount = argumentCount;
+    entry->flags = flags;
+    entry->calls = 0;
+    entry->rejected = 0;
+    entry->cycles = 0;
+    return true;
+}
+
+bool SyscallHandler::EnableFastSyscalls(GlobalDescriptorTable* gdt)
+{
+    // The Pentium Pro reports SEP without supporting it
+    uint32_t signature = CPUSignature();
+    uint32_t family = (signature >> 8) & 0xF;
+    uint32_t model = (signature >> 4) & 0xF;
+    uint32_t stepping = signature & 0xF;
+    if (!(CPUFeatures() & CPUID_EDX_SEP) || (family == 6 && model < 3 && stepping < 3))
+        return false;
+
+    if (gdt->UserCodeSegmentSelector() != ((gdt->CodeSegmentSelector() + 16) | 3)
+        || gdt->UserDataSegmentSelector() != ((gdt->CodeSegmentSelector() + 24) | 3))
+        return false;
+
+    userCodeSelector = gdt->UserCodeSegmentSelector();
+    userDataSelector = gdt->UserDataSegmentSelector();
+    WriteModelSpecificRegister(0x174, gdt->CodeSegmentSelector());      // IA32_SYSENTER_CS
+    WriteModelSpecificRegister(0x175, (uint32_t)&sysenterStack[16]);   // IA32_SYSENTER_ESP
+    WriteModelSpecificRegister(0x176, (uint32_t)&SysenterEntry);        // IA32_SYSENTER_EIP
+    fastSyscalls = true;
+    return true;
+}
+
+void SyscallHandler::SysNull(TaskManager* /*taskManager*/, CPUState* cpu)
+{
+    cpu->eax = 0;
+}
+
+void SyscallHandler::SysFork(TaskManager* taskManager, CPUState* cpu)
+{
+    cpu->eax = taskManager->ForkTask(cpu);
+}
+
+void SyscallHandler::SysWaitpid(TaskManager* taskManager, CPUState* cpu)
+{
+    cpu->eax = taskManager->WaitTask(cpu->ebx);
+}
 
-    switch(cpu->eax)
+void SyscallHandler::SysExecve(TaskManager* taskManager, CPUState* cpu)
+{
+    cpu->eax = taskManager->ExecTask((void*)cpu->ebx);
+}
+
+void SyscallHandler::SysWrite(TaskManager* /*taskManager*/, CPUState* cpu)
+{
+    print((const char*)cpu->ebx, cpu->esi);
+    cpu->eax = cpu->esi;
+}
+
+// Several buffers, in order, with one trap
+void SyscallHandler::SysWritev(TaskManager* /*taskManager*/, CPUState* cpu)
+{
+    const IoVector* vectors = (const IoVector*)cpu->ebx;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < cpu->esi; i++)
     {
-        case 4: // sys_write
-            printf((char*)cpu->ebx);
-            break;
-        case 1: // sys_fork
-            cpu->eax = taskManager->ForkTask(cpu);
-            break;
-        case 2: // sys_waitpid
-            cpu->eax = taskManager->WaitTask(cpu->ebx);
-            break;
-        case 3: // sys_execve
-            cpu->eax = taskManager->ExecTask((void*)cpu->ebx);
-            break;
-        case 5: // sys_exit
-            taskManager->ExitTask();
+        print(vectors[i].base, vectors[i].length);
+        total += vectors[i].length;
+    }
+    cpu->eax = total;
+}
+
+void SyscallHandler::SysExit(TaskManager* taskManager, CPUState* cpu)
+{
+    taskManager->ExitTask(cpu->ebx);
+}
+
+void SyscallHandler::SysSleep(TaskManager* taskManager, CPUState* cpu)
+{
+    taskManager->SleepTask(cpu->ebx);
+}
+
+// Copies one SyscallStats per registered call into the caller's buffer
+void SyscallHandler::SysStats(TaskManager* /*taskManager*/, CPUState* cpu)
+{
+    SyscallStats* stats = (SyscallStats*)cpu->ebx;
+    uint32_t capacity = cpu->esi / sizeof(SyscallStats);
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < MAX_SYSCALLS && count < capacity; i++)
+    {
+        SyscallEntry* entry = &activeSyscallHandler->syscallTable[i];
+        if (entry->handler == 0)
+            continue;
+        stats[count].name = entry->name;
+        stats[count].number = i;
+        stats[count].calls = entry->calls;
+        stats[count].rejected = entry->rejected;
+        stats[count].cycles = entry->cycles;
+        count++;
+    }
+    cpu->eax = count;
+}
+
+void SyscallHandler::SysRingSetup(TaskManager* taskManager, CPUState* cpu)
+{
+    if (cpu->esi < sizeof(SyscallRing) || cpu->ebx % 4 != 0)
+    {
+        cpu->eax = SYSCALL_FAULT;
+        return;
+    }
+    taskManager->SetRing((SyscallRing*)cpu->ebx);
+    cpu->eax = 0;
+}
+
+void SyscallHandler::SysRingEnter(TaskManager* taskManager, CPUState* cpu)
+{
+    SyscallRing* ring = taskManager->CurrentRing();
+    if (ring == 0)
+    {
+        cpu->eax = SYSCALL_FAULT;
+        return;
+    }
+    uint32_t consumed = activeSyscallHandler->ProcessRing(ring, cpu);
+    if (taskManager->IsCurrentRunnable())
+        cpu->eax = consumed;
+}
+
+// Hands out task memory, 0 when there is none left
+void SyscallHandler::SysAlloc(TaskManager* taskManager, CPUState* cpu)
+{
+    cpu->eax = (uint32_t)taskManager->AllocateTaskMemory(cpu->ebx);
+}
+
+// Run queued requests until the queue is empty, the completion queue is
+// full or one of them blocks. Requests that cannot block run on a scratch
+// frame; blocking ones need the caller's frame, so without one (polling)
+// they wait for an explicit enter. Returns how many were consumed.
+uint32_t SyscallHandler::ProcessRing(SyscallRing* ring, CPUState* frame)
+{
+    uint32_t consumed = 0;
+    while (ring->submitHead != ring->submitTail && !ring->CompletionFull())
+    {
+        // Copy it, the task may write to the ring meanwhile
+        SyscallRequest request = ring->requests[ring->submitHead & (SyscallRing::ENTRIES - 1)];
+        SyscallEntry* entry = request.number < MAX_SYSCALLS ? &syscallTable[request.number] : 0;
+        bool valid = entry != 0 && entry->handler != 0 && !(entry->flags & SYSCALL_NOT_IN_RING);
+        bool blocking = valid && (entry->flags & SYSCALL_BLOCKING);
+        if (blocking && frame == 0)
             break;
-        default:
+
+        ring->submitHead = ring->submitHead + 1;
+        consumed++;
+        if (!valid)
+        {
+            ring->Complete(request.userData, SYSCALL_FAULT);
+            continue;
+        }
+
+        // Calls that cannot block run on a zeroed frame; only the
+        // arguments below are loaded into it
+        CPUState scratch = {};
+        CPUState* cpu = blocking ? frame : &scratch;
+        uint32_t ebx = cpu->ebx, esi = cpu->esi, edi = cpu->edi;
+        cpu->ebx = request.arguments[0];
+        cpu->esi = request.arguments[1];
+        cpu->edi = request.arguments[2];
+        Invoke(request.number, cpu);
+        cpu->ebx = ebx;
+        cpu->esi = esi;
+        cpu->edi = edi;
+
+        if (!taskManager->IsCurrentRunnable())
+        {
+            taskManager->BlockInRing(request.userData, consumed);
             break;
+        }
+        ring->Complete(request.userData, cpu->eax);
+    }
+    return consumed;
+}
+
+void SyscallHandler::PollRing()
+{
+    SyscallRing* ring = taskManager->CurrentRing();
+    if (ring != 0 && (ring->flags & SyscallRing::KERNEL_POLL) && ring->Pending() != 0)
+        ProcessRing(ring, 0);
+}
+
+// Pointers must lie in memory the calling task could access itself. Tasks
+// without their own address space run in ring 0 and are trusted.
+bool SyscallHandler::CheckArguments(SyscallEntry* entry, CPUState* cpu)
+{
+    AddressSpace* space = taskManager->CurrentAddressSpace();
+    if (space == 0 || entry->flags == 0)
+        return true;
+
+    if ((entry->flags & SYSCALL_STRING_ARGUMENT)
+        && space->UserStringLength(cpu->ebx, MAX_STRING_LENGTH) < 0)
+        return false;
+    if ((entry->flags & SYSCALL_OUTPUT_BUFFER)
+        && !space->IsUserRange(cpu->ebx, cpu->esi, true))
+        return false;
+    if ((entry->flags & SYSCALL_INPUT_BUFFER)
+        && !space->IsUserRange(cpu->ebx, cpu->esi, false))
+        return false;
+    if (entry->flags & SYSCALL_INPUT_VECTOR)
+    {
+        if (cpu->esi > MAX_IO_VECTORS
+            || !space->IsUserRange(cpu->ebx, cpu->esi * sizeof(IoVector), false))
+            return false;
+        const IoVector* vectors = (const IoVector*)cpu->ebx;
+        for (uint32_t i = 0; i < cpu->esi; i++)
+            if (!space->IsUserRange((uint32_t)vectors[i].base, vectors[i].length, false))
+                return false;
+    }
+    return true;
+}
+
+// Check and run one call. The result is left in eax.
+void SyscallHandler::Invoke(uint32_t number, CPUState* cpu)
+{
+    SyscallEntry* entry = number < MAX_SYSCALLS ? &syscallTable[number] : 0;
+    if (entry == 0 || entry->handler == 0)
+    {
+        cpu->eax = SYSCALL_FAULT;
+    }
+    else if (!CheckArguments(entry, cpu))
+    {
+        entry->rejected++;
+        cpu->eax = SYSCALL_FAULT;
     }
+    else
+    {
+        cpu->eax = 0;
+        uint64_t start = ReadTimestampCounter();
+        entry->handler(taskManager, cpu);
+        entry->cycles += ReadTimestampCounter() - start;
+        entry->calls++;
+    }
+}
+
+uint32_t SyscallHandler::Dispatch(uint32_t esp)
+{
+    CPUState* cpu = (CPUState*)esp;
+
+    Invoke(cpu->eax, cpu);
+
+    // The caller blocked or exited, switch to another task
+    if(!taskManager->IsCurrentRunnable())
+        return (uint32_t)taskManager->Schedule(cpu);
 
     return esp;
 }
 
+uint32_t SyscallHandler::HandleInterrupt(uint32_t esp)
+{
+    return Dispatch(esp);
+}
+
+// The stub returns with sysexit if this gives back its own frame, and
+// with iret if it switched to another task
+uint32_t SyscallHandler::HandleSysenter(uint32_t esp)
+{
+    if (activeSyscallHandler == 0)
+        return esp;
+    return activeSyscallHandler->Dispatch(esp);
+}
+
 namespace myos {
+    extern "C" int syscall_int80(int number, int argument1, int argument2, int argument3) {
+        int result;
+        asm volatile("int $0x80" : "=a"(result)
+            : "a"(number), "b"(argument1), "S"(argument2), "D"(argument3) : "memory");
+        return result;
+    }
+
+    extern "C" int syscall_sysenter(int number, int argument1, int argument2, int argument3) {
+        int result;
+        asm volatile("movl %%esp, %%ecx\n"
+                     "movl $1f, %%edx\n"
+                     "sysenter\n"
+                     "1:"
+                     : "=a"(result)
+                     : "a"(number), "b"(argument1), "S"(argument2), "D"(argument3)
+                     : "ecx", "edx", "memory");
+        return result;
+    }
+
+    // sysexit always returns to ring 3, so kernel tasks use the interrupt
+    extern "C" int syscall(int number, int argument1, int argument2, int argument3) {
+        TaskLocalPage* local = task_local();
+        if (local != 0 && local->fastSyscalls)
+            return syscall_sysenter(number, argument1, argument2, argument3);
+        return syscall_int80(number, argument1, argument2, argument3);
+    }
+
     extern "C" int syscall_fork() {
-        int pid;
-        asm("int $0x80" : "=a"(pid) : "a"(1));
-        return pid;
+        // Or the child would print the parent's pending output again
+        console_flush();
+        return ::syscall(SYS_FORK, 0);
+    }
+
+    extern "C" void syscall_exit(int status) {
+        console_flush();
+        ::syscall(SYS_EXIT, status);
+    }
+
+    extern "C" void syscall_sleep(int milliseconds) {
+        ::syscall(SYS_SLEEP, milliseconds);
+    }
+
+    extern "C" int syscall_waitpid(int pid) {
+        return ::syscall(SYS_WAITPID, pid);
+    }
+
+    extern "C" int syscall_write(const char* text, uint32_t length) {
+        return ::syscall(SYS_WRITE, (int)text, length);
+    }
+
+    extern "C" int syscall_writev(const IoVector* vectors, int count) {
+        return ::syscall(SYS_WRITEV, (int)vectors, count);
+    }
+
+    extern "C" void* syscall_alloc(uint32_t size) {
+        return (void*)::syscall(SYS_ALLOC, size);
+    }
+
+    // Only tasks in ring 3 have a local page
+    extern "C" TaskLocalPage* task_local() {
+        return CurrentPrivilegeLevel() != 0 ? (TaskLocalPage*)AddressSpace::TASK_LOCAL_BASE : 0;
+    }
+
+    static LineBuffer* TaskLineBuffer() {
+        TaskLocalPage* local = task_local();
+        return local != 0 ? &local->lineBuffer : 0;
+    }
+
+    extern "C" void console_flush() {
+        LineBuffer* buffer = TaskLineBuffer();
+        if (buffer != 0 && buffer->length != 0) {
+            syscall_write(buffer->data, buffer->length);
+            buffer->length = 0;
+        }
+    }
+
+    extern "C" void console_write(const char* text) {
+        LineBuffer* buffer = TaskLineBuffer();
+        if (buffer == 0) {
+            syscall_write(text, strlen(text));
+            return;
+        }
+
+        for (; *text != '\0'; text++) {
+            buffer->data[buffer->length++] = *text;
+            if (*text == '\n' || buffer->length == LineBuffer::SIZE)
+                console_flush();
+        }
+    }
+
+    extern "C" int syscall_stats(SyscallStats* stats, int count) {
+        return ::syscall(SYS_STATS, (int)stats, count * sizeof(SyscallStats));
     }
 
-    extern "C" void syscall_exit() {
-        asm("int $0x80" : : "a"(5));
-        //while (true);
+    extern "C" int syscall_ring_setup(SyscallRing* ring, uint32_t flags) {
+        ring->Initialize(flags);
+        return ::syscall(SYS_RING_SETUP, (int)ring, sizeof(SyscallRing));
     }
 
-    extern "C" void syscall_waitpid(int pid) {
-        asm("int $0x80" : : "a"(2), "b"(pid));
+    extern "C" int syscall_ring_enter() {
+        return ::syscall(SYS_RING_ENTER, 0);
     }
 }
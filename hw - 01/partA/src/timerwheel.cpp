@@ -0,0 +1,177 @@
+#include <timerwheel.h>
+#include <common/cpu.h>
+
+using namespace myos;
+using namespace myos::common;
+
+TimerWheel* TimerWheel::activeTimerWheel = 0;
+
+TimerWheel::TimerWheel(uint32_t frequency)
+{
+    activeTimerWheel = this;
+    for (int level = 0; level < LEVELS; level++)
+        for (int i = 0; i < SLOTS; i++)
+            slots[level][i] = 0;
+    nextTick = 0;
+    pending = 0;
+    expired = 0;
+    this->frequency = frequency;
+}
+
+TimerWheel::~TimerWheel()
+{
+    if (activeTimerWheel == this)
+        activeTimerWheel = 0;
+}
+
+void TimerWheel::Link(Timer** list, Timer* timer)
+{
+    timer->prev = 0;
+    timer->next = *list;
+    if (*list != 0)
+        (*list)->prev = timer;
+    *list = timer;
+    timer->list = list;
+}
+
+void TimerWheel::Unlink(Timer* timer)
+{
+    if (timer->prev != 0)
+        timer->prev->next = timer->next;
+    else
+        *timer->list = timer->next;
+    if (timer->next != 0)
+        timer->next->prev = timer->prev;
+    timer->next = 0;
+    timer->prev = 0;
+    timer->list = 0;
+}
+
+// Put the timer on the finest level whose range still covers it
+void TimerWheel::Insert(Timer* timer)
+{
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - nextTick;
+    Timer** list;
+
+    if ((int32_t)delta < 0)
+        list = &slots[0][nextTick & SLOT_MASK]; // already due
+    else if (delta < (1u << SLOT_BITS))
+        list = &slots[0][expires & SLOT_MASK];
+    else if (delta < (1u << 2 * SLOT_BITS))
+        list = &slots[1][(expires >> SLOT_BITS) & SLOT_MASK];
+    else if (delta < (1u << 3 * SLOT_BITS))
+        list = &slots[2][(expires >> 2 * SLOT_BITS) & SLOT_MASK];
+    else if (delta < (1u << 4 * SLOT_BITS))
+        list = &slots[3][(expires >> 3 * SLOT_BITS) & SLOT_MASK];
+    else
+        // Beyond the wheel: park it in the last slot to come round, from
+        // where it is re-sorted
+        list = &slots[3][((nextTick >> 3 * SLOT_BITS) + SLOT_MASK) & SLOT_MASK];
+
+    Link(list, timer);
+}
+
+// Interrupts are off around the list edits, since the timer interrupt
+// walks the same lists in Advance
+void TimerWheel::Add(Timer* timer, uint32_t ticks)
+{
+    uint32_t flags = DisableInterrupts();
+    if (timer->Pending())
+        Cancel(timer);
+    timer->expires = nextTick + ticks;
+    Insert(timer);
+    pending++;
+    RestoreInterrupts(flags);
+}
+
+bool TimerWheel::Cancel(Timer* timer)
+{
+    uint32_t flags = DisableInterrupts();
+    bool wasPending = timer->Pending();
+    if (wasPending)
+    {
+        Unlink(timer);
+        pending--;
+    }
+    RestoreInterrupts(flags);
+    return wasPending;
+}
+
+// Move the timers of one coarse slot down to the levels below
+int TimerWheel::Cascade(int level, int index)
+{
+    Timer* timer = slots[level][index];
+    slots[level][index] = 0;
+    while (timer != 0)
+    {
+        Timer* next = timer->next;
+        Insert(timer);
+        timer = next;
+    }
+    return index;
+}
+
+void TimerWheel::Advance(uint32_t now)
+{
+    while ((int32_t)(now - nextTick) >= 0)
+    {
+        // Nothing pending, so no slot needs looking at
+        if (pending == 0)
+        {
+            nextTick = now + 1;
+            return;
+        }
+
+        uint32_t index = nextTick & SLOT_MASK;
+        if (index == 0
+            && Cascade(1, (nextTick >> SLOT_BITS) & SLOT_MASK) == 0
+            && Cascade(2, (nextTick >> 2 * SLOT_BITS) & SLOT_MASK) == 0)
+            Cascade(3, (nextTick >> 3 * SLOT_BITS) & SLOT_MASK);
+
+        // Take the slot's list before running anything, so callbacks that
+        // add timers for now land on the next tick
+        Timer* due = slots[0][index];
+        slots[0][index] = 0;
+        for (Timer* timer = due; timer != 0; timer = timer->next)
+            timer->list = &due;
+        nextTick++;
+
+        while (due != 0)
+        {
+            Timer* timer = due;
+            Unlink(timer);
+            pending--;
+            expired++;
+            timer->callback(timer->data);
+        }
+    }
+}
+
+// Timers on the coarser levels are due no earlier than the cascade that
+// brings them down, at the next wrap of the finest level
+uint32_t TimerWheel::NextTick()
+{
+    uint32_t flags = DisableInterrupts();
+    uint32_t next = NO_TIMER;
+    if (pending != 0)
+    {
+        uint32_t wrap = (SLOTS - (nextTick & SLOT_MASK)) & SLOT_MASK;
+        next = nextTick + wrap;
+        for (uint32_t ticks = 0; ticks < wrap; ticks++)
+            if (slots[0][(nextTick + ticks) & SLOT_MASK] != 0)
+            {
+                next = nextTick + ticks;
+                break;
+            }
+    }
+    RestoreInterrupts(flags);
+    return next;
+}
+
+// Rounded up, and never 0, so a timeout lasts at least as long as asked
+uint32_t TimerWheel::TicksForMilliseconds(uint32_t milliseconds)
+{
+    uint32_t ticks = DivideU64((uint64_t)milliseconds * frequency + 999, 1000);
+    return ticks != 0 ? ticks : 1;
+}